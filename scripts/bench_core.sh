@@ -0,0 +1,14 @@
+# microbenchmarks of fanime-core on a fixed fixture dictionary, results of different builds are appended to the same file
+# usage: ./scripts/bench_core.sh [label] [out_dir]
+mkdir -p build
+cd build
+cmake .. -DCMAKE_BUILD_TYPE=Release -DFANIME_BUILD_TOOLS=ON
+make fanime-gendict fanime-corebench
+cd ..
+LABEL=${1:-$(git rev-parse --short HEAD)}
+OUT_DIR=${2:-/tmp/fanime-corebench}
+mkdir -p $OUT_DIR
+if [ ! -f $OUT_DIR/fixture.db ]; then
+  ./build/tools/fanime-gendict --words ./assets/word.txt --out $OUT_DIR/fixture.db --rows 100000 --seed 1
+fi
+./build/tools/fanime-corebench --db $OUT_DIR/fixture.db --assets ./assets --label $LABEL | tee -a $OUT_DIR/results.jsonl
@@ -0,0 +1,17 @@
+# data-size scaling benchmark: generate 1x / 10x / 100x dictionaries and benchmark each of them in a fresh process
+# usage: ./scripts/bench_scaling.sh [out_dir] [scales...]
+mkdir -p build
+cd build
+cmake .. -DCMAKE_BUILD_TYPE=Release -DFANIME_BUILD_TOOLS=ON
+make fanime-gendict fanime-dictbench
+cd ..
+OUT_DIR=${1:-/tmp/fanime-scaling}
+shift
+SCALES=${@:-1 10 100}
+mkdir -p $OUT_DIR
+for scale in $SCALES; do
+  if [ ! -f $OUT_DIR/dict_${scale}x.db ]; then
+    ./build/tools/fanime-gendict --words ./assets/word.txt --out $OUT_DIR/dict_${scale}x.db --scale $scale
+  fi
+  ./build/tools/fanime-dictbench --db $OUT_DIR/dict_${scale}x.db | tee -a $OUT_DIR/results.jsonl
+done
@@ -0,0 +1,90 @@
+#include "candidate_cursor.h"
+#include <algorithm>
+#include "dict.h"
+#include "trace.h"
+#include "memory_stats.h"
+
+CandidateCursor::CandidateCursor(std::vector<WordItem> rows) : rows_(std::move(rows)) {}
+
+CandidateCursor::CandidateCursor(std::shared_ptr<DictSnapshot> snap, const SqlQuery &query, const std::string &filter_regex, std::vector<WordItem> overlay_rows) : snap(std::move(snap)), sql(query.sql), overlay_rows(std::move(overlay_rows)) {
+  if (!filter_regex.empty()) {
+    use_filter = true;
+    filter = std::regex(filter_regex);
+  }
+  stmt = query.prepare(this->snap->db);
+}
+
+CandidateCursor::~CandidateCursor() { finish(); }
+
+void CandidateCursor::finish() {
+  if (!stmt)
+    return;
+  sqlite3_finalize(stmt);
+  stmt = nullptr;
+  // 分几次取的，报告的是累计的行数和时间
+  FANIME_PROBE(sql, sql.c_str(), stepped, sql_ns);
+}
+
+bool CandidateCursor::step_pending() {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  while (stmt) {
+    // 被过滤掉的行也算，正则过滤的查询可能扫很多行才出一个结果；每 16 行看一次时间
+    if (deadline_ns && (++deadline_steps & 15) == 0 && FanimeTrace::now_ns(true) > deadline_ns) {
+      sql_ns += FanimeTrace::elapsed_ns(start_ns);
+      return false;
+    }
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      if (count_empty && !any_row && snap->key_filter)
+        snap->key_filter->record_false_positive();
+      break;
+    }
+    any_row = true;
+    const char *key = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    if (use_filter && !std::regex_match(key, filter))
+      continue;
+    const char *value = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+    bool covered = std::any_of(overlay_rows.begin(), overlay_rows.end(), [key, value](const WordItem &each) { return std::get<0>(each) == key && std::get<1>(each) == value; });
+    if (covered)
+      continue;
+    pending = std::make_tuple(std::string(key), std::string(value), sqlite3_column_int(stmt, 3));
+    has_pending = true;
+    stepped++;
+    sql_ns += FanimeTrace::elapsed_ns(start_ns);
+    return true;
+  }
+  sql_ns += FanimeTrace::elapsed_ns(start_ns);
+  finish();
+  return false;
+}
+
+size_t CandidateCursor::fetch(size_t cnt) {
+  while (rows_.size() < cnt) {
+    // 到了 deadline_ns，不知道下一行和 overlay 谁在前面，先停下来
+    if (!has_pending && !step_pending() && stmt)
+      break;
+    bool take_overlay = overlay_pos < overlay_rows.size() && (!has_pending || std::get<2>(overlay_rows[overlay_pos]) >= std::get<2>(pending));
+    if (take_overlay) {
+      rows_.push_back(overlay_rows[overlay_pos++]);
+    } else if (has_pending) {
+      rows_.push_back(std::move(pending));
+      has_pending = false;
+    } else {
+      break;
+    }
+  }
+  return rows_.size();
+}
+
+bool CandidateCursor::fetch_before(size_t cnt, uint64_t deadline_ns) {
+  this->deadline_ns = deadline_ns;
+  fetch(cnt);
+  this->deadline_ns = 0;
+  return rows_.size() >= cnt || exhausted();
+}
+
+size_t CandidateCursor::memory_bytes() const { return MemoryStats::heap_bytes(rows_) + MemoryStats::heap_bytes(overlay_rows) + MemoryStats::heap_bytes(sql); }
+
+const std::vector<CandidateCursor::WordItem> &CandidateCursor::all() {
+  fetch(SIZE_MAX);
+  return rows_;
+}
@@ -0,0 +1,86 @@
+#ifndef FAN_CANDIDATE_CURSOR_H
+#define FAN_CANDIDATE_CURSOR_H
+
+#include <sqlite3.h>
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "sql_query.h"
+
+struct DictSnapshot;
+
+/*
+  一次查询的结果，按需从 sqlite 里面一行一行地取
+  第一页只取第一页加上预取的那几行，翻页翻到快没有的时候再接着取，大部分行根本不会被读出来
+
+  - 已经取出来的行留在 rows 里面，缓存里面同一个 code 的查询直接复用
+  - 需要过滤的查询(一个简拼混在全拼里面)边取边用正则过滤
+  - overlay 的结果在取的时候按照 weight 合并进来，和 DictionaryUlPb::merge_overlay 的结果一致
+  - 取完之后马上 finalize，不会一直占着读事务
+*/
+class CandidateCursor {
+public:
+  using WordItem = std::tuple<std::string, std::string, int>;
+
+  // 已经拿到全部结果的(单字、fanime-dictd 返回的结果)
+  explicit CandidateCursor(std::vector<WordItem> rows);
+  /*
+    snap 保证查询过程中词库不会因为热加载被关掉
+    filter_regex 为空的时候不过滤
+  */
+  CandidateCursor(std::shared_ptr<DictSnapshot> snap, const SqlQuery &query, const std::string &filter_regex, std::vector<WordItem> overlay_rows);
+  ~CandidateCursor();
+  CandidateCursor(const CandidateCursor &) = delete;
+  CandidateCursor &operator=(const CandidateCursor &) = delete;
+
+  /*
+    保证至少取出了 cnt 行，除非已经没有更多了
+    Return: 已经取出来的行数
+  */
+  size_t fetch(size_t cnt);
+  /*
+    和 fetch 一样，但是过了 deadline_ns(FanimeTrace::now_ns 的时间)还没取够就先停下来，下次接着取
+    deadline_ns 为 0 的时候不限时间
+    Return: 取够了 cnt 行或者已经没有更多了
+  */
+  bool fetch_before(size_t cnt, uint64_t deadline_ns);
+  // 全部取出来，辅助码筛选需要看到所有的结果
+  const std::vector<WordItem> &all();
+  const std::vector<WordItem> &rows() const { return rows_; }
+  bool exhausted() const { return !stmt && overlay_pos >= overlay_rows.size() && !has_pending; }
+  // key_filter 说可能有才去查的，查完一行都没有的时候记一次误报
+  void count_false_positive() { count_empty = true; }
+  // 取出来的行、overlay 的行和 sql 在堆上的大小，sqlite 自己的不算
+  size_t memory_bytes() const;
+
+private:
+  std::vector<WordItem> rows_;
+  std::shared_ptr<DictSnapshot> snap;
+  sqlite3_stmt *stmt = nullptr;
+  std::string sql;
+  bool use_filter = false;
+  std::regex filter;
+  std::vector<WordItem> overlay_rows;
+  size_t overlay_pos = 0;
+  // 从 sqlite 取出来但是还没有和 overlay 比较过的那一行
+  WordItem pending;
+  bool has_pending = false;
+  size_t stepped = 0;
+  bool count_empty = false;
+  // sqlite 返回过至少一行，包括被正则和 overlay 过滤掉的
+  bool any_row = false;
+  uint64_t sql_ns = 0;
+  // fetch_before 的期限，step_pending 过了这个时间就先返回，stmt 留着下次接着用
+  uint64_t deadline_ns = 0;
+  // 一次只取一行的时候也是累计每 16 行看一次时间
+  size_t deadline_steps = 0;
+
+  // 取下一行满足过滤条件、并且没有被 overlay 覆盖的行；到了 deadline_ns 的时候返回 false，但是 stmt 不为空
+  bool step_pending();
+  void finish();
+};
+
+#endif // FAN_CANDIDATE_CURSOR_H
@@ -0,0 +1,138 @@
+#include "candidate_ranker.h"
+#include <algorithm>
+#include <functional>
+
+void CandidateRanker::reset() {
+  sources.clear();
+  heap.clear();
+  heap_ready = false;
+  pending.clear();
+  seen.clear();
+}
+
+void CandidateRanker::add_source(int tier, std::vector<WordItem> items) {
+  if (items.empty())
+    return;
+  sources.push_back(Source{tier, std::move(items), nullptr, 0, false});
+  heap_ready = false;
+}
+
+void CandidateRanker::add_source(int tier, std::shared_ptr<CandidateCursor> cursor, bool overtake) {
+  if (!cursor)
+    return;
+  sources.push_back(Source{tier, {}, std::move(cursor), 0, overtake});
+  heap_ready = false;
+}
+
+bool CandidateRanker::Source::has_head(uint64_t deadline_ns, bool &ready) {
+  ready = true;
+  if (cursor) {
+    ready = cursor->fetch_before(pos + 1, deadline_ns);
+    return cursor->rows().size() > pos;
+  }
+  return pos < items.size();
+}
+
+/*
+  std::push_heap 是大根堆，所以这里返回的是 a 排在 b 后面
+  进堆之前已经 has_head 过了，这里不会再去取
+*/
+bool CandidateRanker::ranks_after(size_t a, size_t b) const {
+  const Source &sa = sources[a];
+  const Source &sb = sources[b];
+  if (sa.tier != sb.tier)
+    return sa.tier > sb.tier;
+  int wa = std::get<2>(sa.head());
+  int wb = std::get<2>(sb.head());
+  if (wa != wb)
+    return wa < wb;
+  return a > b;
+}
+
+void CandidateRanker::enqueue(size_t i, uint64_t deadline_ns) {
+  bool ready;
+  bool has = sources[i].has_head(deadline_ns, ready);
+  if (!ready) {
+    pending.push_back(i);
+  } else if (has) {
+    heap.push_back(i);
+    std::push_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return ranks_after(a, b); });
+  }
+}
+
+void CandidateRanker::fill(std::vector<WordItem> &out, size_t cnt, uint64_t deadline_ns) {
+  auto cmp = [this](size_t a, size_t b) { return ranks_after(a, b); };
+  if (!heap_ready) {
+    heap.clear();
+    pending.clear();
+    for (size_t i = 0; i < sources.size(); i++)
+      enqueue(i, deadline_ns);
+    heap_ready = true;
+  }
+  if (deadline_ns == 0)
+    resume(0);
+  while (out.size() < cnt && !heap.empty()) {
+    // 挂起的来源还不知道下一行的 weight，tier 相同的也不能越过它
+    const Source &top = sources[heap.front()];
+    if (std::any_of(pending.begin(), pending.end(), [this, &top](size_t i) { return !sources[i].overtake && sources[i].tier <= top.tier; }))
+      break;
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    size_t i = heap.back();
+    heap.pop_back();
+    Source &src = sources[i];
+    const WordItem &item = src.head();
+    if (seen.insert(out, std::get<1>(item), out.size()))
+      out.push_back(item);
+    src.pos++;
+    enqueue(i, deadline_ns);
+  }
+}
+
+bool CandidateRanker::resume(uint64_t deadline_ns) {
+  std::vector<size_t> waiting;
+  waiting.swap(pending);
+  for (size_t i : waiting)
+    enqueue(i, deadline_ns);
+  return !pending.empty();
+}
+
+// 保留容量，每次按键都会清一次
+void CandidateRanker::WordSet::clear() {
+  std::fill(slots.begin(), slots.end(), EMPTY);
+  cnt = 0;
+}
+
+bool CandidateRanker::WordSet::insert(const std::vector<WordItem> &out, const std::string &word, uint32_t idx) {
+  if ((cnt + 1) * 2 > slots.size())
+    grow();
+  uint64_t hash = std::hash<std::string>{}(word);
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    if (slots[i] == EMPTY) {
+      hashes[i] = hash;
+      slots[i] = idx;
+      cnt++;
+      return true;
+    }
+    if (hashes[i] == hash && std::get<1>(out[slots[i]]) == word)
+      return false;
+  }
+}
+
+void CandidateRanker::WordSet::grow() {
+  std::vector<uint64_t> old_hashes = std::move(hashes);
+  std::vector<uint32_t> old_slots = std::move(slots);
+  size_t capacity = std::max<size_t>(64, old_slots.size() * 2);
+  hashes.assign(capacity, 0);
+  slots.assign(capacity, EMPTY);
+  size_t mask = capacity - 1;
+  for (size_t j = 0; j < old_slots.size(); j++) {
+    if (old_slots[j] == EMPTY)
+      continue;
+    size_t i = old_hashes[j] & mask;
+    while (slots[i] != EMPTY)
+      i = (i + 1) & mask;
+    hashes[i] = old_hashes[j];
+    slots[i] = old_slots[j];
+  }
+}
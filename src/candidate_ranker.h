@@ -0,0 +1,95 @@
+#ifndef FAN_CANDIDATE_RANKER_H
+#define FAN_CANDIDATE_RANKER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "candidate_cursor.h"
+
+/*
+  把几个来源的候选项合并成一个列表，代替直接 vector::insert 拼接
+
+  - 按 (tier, weight) 做 k 路归并，tier 小的在前，同一个 tier 里面 weight 大的在前
+    每个来源自身的顺序保持不变，所以 tier 各不相同的时候结果就是按 tier 依次拼接
+  - 按词去重，同一个词只保留排得最靠前的那一个
+  - 惰性的，只合并到翻页实际需要的位置，剩下的留在来源里面
+    来源是 CandidateCursor 的时候，连 sqlite 里面的行也是合并到了才去取
+  - 可以给 fill 一个期限: 到期还没取到下一行的 cursor 先挂起，不进堆，之后 resume 取到了再放回堆里
+    挂起的来源会挡住排在它后面的候选项，合并出来的结果和不限时间的时候一样，只是少一些；
+    add_source 时 overtake 为 true 的来源不挡，其它来源照常合并，它取到之后的行接在后面
+    不管哪种，out 里面已经合并出来的都不会变
+*/
+class CandidateRanker {
+public:
+  using WordItem = std::tuple<std::string, std::string, int>;
+
+  void reset();
+  void add_source(int tier, std::vector<WordItem> items);
+  void add_source(int tier, std::shared_ptr<CandidateCursor> cursor, bool overtake = false);
+  /*
+    继续合并，追加到 out 里面，直到 out.size() >= cnt 或者所有来源都取完了
+    out 里面已有的内容需要是之前 fill 的结果
+    deadline_ns(FanimeTrace::now_ns 的时间)不为 0 的时候，到期还没准备好的来源挂起，见 resume
+    deadline_ns 为 0 的时候先把挂起的来源全部取完，结果和没有期限的时候一样
+  */
+  void fill(std::vector<WordItem> &out, size_t cnt, uint64_t deadline_ns = 0);
+  /*
+    接着取挂起的来源，在期限之前取到了(或者发现是空的)就放回堆里
+    Return: 还有没有挂起的来源
+  */
+  bool resume(uint64_t deadline_ns);
+  bool has_pending() const { return !pending.empty(); }
+  bool exhausted() const { return heap.empty() && pending.empty(); }
+
+private:
+  struct Source {
+    int tier;
+    std::vector<WordItem> items;
+    // 不为空的时候 items 不用，从 cursor->rows() 里面取
+    std::shared_ptr<CandidateCursor> cursor;
+    size_t pos;
+    bool overtake;
+
+    /*
+      需要的时候从 cursor 里面多取一行
+      ready: 在 deadline_ns 之前有没有弄清楚，没有的话返回值没有意义
+    */
+    bool has_head(uint64_t deadline_ns, bool &ready);
+    const WordItem &head() const { return cursor ? cursor->rows()[pos] : items[pos]; }
+  };
+
+  /*
+    开放寻址的字符串集合，只存下标，指向 fill 的 out 里面已经合并出来的候选项
+    来源里面的行在取的时候可能会挪动位置，out 里面已有的不会
+  */
+  class WordSet {
+  public:
+    void clear();
+    // 已经存在的话返回 false，不存在的话记下 out 的下标 idx
+    bool insert(const std::vector<WordItem> &out, const std::string &word, uint32_t idx);
+
+  private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> slots;
+    size_t cnt = 0;
+
+    void grow();
+  };
+
+  std::vector<Source> sources;
+  // 按照每个来源当前的第一项排序的小根堆，存的是 sources 的下标
+  std::vector<size_t> heap;
+  bool heap_ready = false;
+  // 挂起的来源，sources 的下标
+  std::vector<size_t> pending;
+  WordSet seen;
+
+  bool ranks_after(size_t a, size_t b) const;
+  // 来源 i 有下一项的话进堆，到期还不知道的话挂起
+  void enqueue(size_t i, uint64_t deadline_ns);
+};
+
+#endif // FAN_CANDIDATE_RANKER_H
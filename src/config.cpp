@@ -0,0 +1,49 @@
+#include "config.h"
+#include "pinyin_utils.h"
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+
+FanimeConfig &FanimeConfig::instance() {
+  static FanimeConfig config;
+  return config;
+}
+
+std::string FanimeConfig::data_dir() { return PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime"; }
+
+FanimeConfig::FanimeConfig() {
+  std::ifstream config_file(data_dir() + "/config.txt");
+  std::string line;
+  while (std::getline(config_file, line)) {
+    line.erase(std::remove_if(line.begin(), line.end(), [](unsigned char x) { return std::isspace(x); }), line.end());
+    if (line.empty() || line[0] == '#')
+      continue;
+    size_t pos = line.find('=');
+    if (pos == std::string::npos)
+      continue;
+    values[line.substr(0, pos)] = line.substr(pos + 1);
+  }
+}
+
+std::string FanimeConfig::get_string(const std::string &name, const std::string &default_value) const {
+  auto it = values.find(name);
+  return it == values.end() ? default_value : it->second;
+}
+
+int FanimeConfig::get_int(const std::string &name, int default_value) const {
+  auto it = values.find(name);
+  if (it == values.end())
+    return default_value;
+  try {
+    return std::stoi(it->second);
+  } catch (...) {
+    return default_value;
+  }
+}
+
+bool FanimeConfig::get_bool(const std::string &name, bool default_value) const {
+  auto it = values.find(name);
+  if (it == values.end())
+    return default_value;
+  return it->second == "1" || it->second == "true" || it->second == "True";
+}
@@ -0,0 +1,25 @@
+#ifndef FAN_CONFIG_H
+#define FAN_CONFIG_H
+
+#include <string>
+#include <unordered_map>
+
+/*
+  读取 ~/.local/share/fcitx5-fanime/config.txt
+  格式和 helpcode.txt 一样，每行一个 key=value，不存在的 key 使用默认值
+*/
+class FanimeConfig {
+public:
+  static FanimeConfig &instance();
+  static std::string data_dir();
+
+  std::string get_string(const std::string &name, const std::string &default_value) const;
+  int get_int(const std::string &name, int default_value) const;
+  bool get_bool(const std::string &name, bool default_value) const;
+
+private:
+  FanimeConfig();
+  std::unordered_map<std::string, std::string> values;
+};
+
+#endif // FAN_CONFIG_H
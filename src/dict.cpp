@@ -9,8 +9,14 @@
 #include <cstdlib>
 #include <codecvt>
 #include <locale>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
 #include "../googlepinyinime-rev/src/include/pinyinime.h"
 #include "./global.h"
+#include "config.h"
+#include "trace.h"
+#include "memory_stats.h"
 
 std::vector<std::string> DictionaryUlPb::alpha_list{"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m", "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z"};
 // clang-format off
@@ -45,63 +51,323 @@ std::vector<std::string> DictionaryUlPb::single_han_list{
 // clang-format on
 
 DictionaryUlPb::DictionaryUlPb() {
+  db_path = FanimeConfig::data_dir() + "/cutted_flyciku_with_jp.db";
+  log_path = FanimeConfig::data_dir() + "/app.log";
+  logger = Log::shared(log_path);
+  const char *homeDir = getenv("HOME");
+  if (!homeDir) {
+    // logger->error("Cannot get home directory.");
+  }
+
+  logger->info("usename: " + PinyinUtil::home_path);
+  logger->info("usename: " + PinyinUtil::get_home_path());
+  logger->info("db path: " + db_path);
+  logger->info("log path: " + log_path);
+
+  auto &config = FanimeConfig::instance();
+  bool use_dictd = config.get_bool("use_dictd", false);
+  if (use_dictd) {
+    // 和 fanime-dictd 用同一个 overlay 文件，守护进程不可用的时候学到的词它之后也能看到，等到 fall_back 的时候再读
+    own_overlay = std::make_unique<UserOverlay>(config.get_string("dictd_overlay_dir", "/var/lib/fanime-dictd") + "/" + std::to_string(getuid()) + "/overlay.txt");
+  } else if (config.get_bool("user_overlay", true)) {
+    own_overlay = std::make_unique<UserOverlay>(FanimeConfig::data_dir() + "/user_overlay.txt");
+    own_overlay->load();
+  }
+  if (own_overlay) {
+    overlay = own_overlay.get();
+    read_only_base = true;
+    mmap_bytes = static_cast<int64_t>(std::max(0, config.get_int("db_mmap_mb", 256))) << 20;
+  }
+  if (use_dictd) {
+    std::string socket_path = config.get_string("dictd_socket", "/run/fanime-dictd/dictd.sock");
+    client = std::make_unique<DictClient>(socket_path, config.get_int("dictd_timeout_ms", 200));
+    if (client->ensure_connected()) {
+      // 词库和谷歌输入法引擎都由守护进程持有，本地的等到守护进程不可用时再打开
+      logger->info("use fanime-dictd: " + socket_path);
+      return;
+    }
+    logger->warning("fanime-dictd is not available, fallback to local dictionary: " + socket_path);
+    fall_back();
+    return;
+  }
+  ensure_local();
+}
+
+DictionaryUlPb::DictionaryUlPb(const std::string &db_path) : db_path(db_path) {
+  log_path = db_path.substr(0, db_path.rfind('/') + 1) + "fanime-dictd.log";
+  logger = Log::shared(log_path);
+  logger->info("db path: " + db_path);
+  // fanime-dictd 的用户学习写到每个用户自己的 overlay，各种工具只查询
+  read_only_base = true;
+  mmap_bytes = static_cast<int64_t>(std::max(0, FanimeConfig::instance().get_int("db_mmap_mb", 256))) << 20;
+  ensure_local();
+}
+
+DictSnapshot::~DictSnapshot() {
+  if (db) {
+    sqlite3_close(db);
+  }
+}
+
+void DictionaryUlPb::ensure_local() {
+  if (local_ready)
+    return;
+  std::lock_guard<std::mutex> lock(local_mutex);
+  if (local_ready)
+    return;
+  typo_max_corrections = FanimeConfig::instance().get_int("typo_max_corrections", 3);
+  open_decoder();
+  auto snap = open_snapshot();
+  // 打不开的时候放一个空的，查询会在 sqlite3_prepare_v2 那里失败，和以前一样
+  snapshot.store(snap ? snap : std::make_shared<DictSnapshot>());
+  // 都打开了再设，reload 看到 true 的时候 snapshot 一定已经有了
+  local_ready = true;
+}
 
+void DictionaryUlPb::fall_back() {
+  ensure_local();
+  if (falling_back)
+    return;
+  falling_back = true;
+  // 守护进程在的时候一直在写同一个文件
+  if (own_overlay)
+    own_overlay->refresh();
+}
+
+bool DictionaryUlPb::daemon_ok(bool ok) {
+  if (!ok) {
+    fall_back();
+    return false;
+  }
+  if (falling_back) {
+    // 守护进程回来了，把 fallback 期间学到的写出去，它处理下一个请求的时候会合并进去
+    falling_back = false;
+    if (own_overlay)
+      own_overlay->checkpoint();
+  }
+  return true;
+}
+
+/*
+  谷歌输入法引擎的词库和 sqlite 词库放在同一个目录下
+*/
+void DictionaryUlPb::open_decoder() {
+  std::lock_guard<std::mutex> lock(decoder_mutex);
+  std::string data_dir = db_path.substr(0, db_path.rfind('/'));
+  ime_pinyin::im_close_decoder();
   ime_pinyin::im_set_max_lens(64, 32);
-  if (!ime_pinyin::im_open_decoder((PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/dict_pinyin.dat").c_str(), (PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/user_dict.dat").c_str())) {
+  if (!ime_pinyin::im_open_decoder((data_dir + "/dict_pinyin.dat").c_str(), (data_dir + "/user_dict.dat").c_str())) {
     // std::cout << "fany bug.\n";
   }
+}
 
-  const char *username = getenv("USER");
-  if (username == nullptr) {
-    username = getenv("LOGNAME");
+std::shared_ptr<DictSnapshot> DictionaryUlPb::open_snapshot() {
+  auto snap = std::make_shared<DictSnapshot>();
+  int exit = sqlite3_open_v2(db_path.c_str(), &snap->db, read_only_base ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+  if (exit != SQLITE_OK) {
+    logger->error("Failed to open db: " + db_path);
+    return nullptr;
   }
-  std::string usernameStr(username);
-  db_path = PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/cutted_flyciku_with_jp.db";
-  log_path = PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/app.log";
-  logger = std::make_unique<Log>(log_path);
-  const char *homeDir = getenv("HOME");
-  if (!homeDir) {
-    // logger->error("Cannot get home directory.");
+  // 只读的时候直接读 mmap 进来的页，不用再拷到每个连接自己的 page cache 里面，几个连接、几个进程共用同一份
+  if (read_only_base && mmap_bytes > 0)
+    sqlite3_exec(snap->db, ("PRAGMA mmap_size = " + std::to_string(mmap_bytes) + ";").c_str(), nullptr, nullptr, nullptr);
+  load_shard_scheme(*snap);
+  load_helpcode_columns(*snap);
+  load_key_filter(*snap);
+  // 造词最多 4 个前缀，调用者自己的线程也算一个；单核的机器上并发没有好处
+  int workers = FanimeConfig::instance().get_int("shard_workers", static_cast<int>(std::min(3u, std::max(1u, std::thread::hardware_concurrency()) - 1)));
+  if (workers > 0)
+    snap->executor = std::make_unique<ShardExecutor>(db_path, workers, read_only_base ? mmap_bytes : 0);
+  if (FanimeConfig::instance().get_bool("typo_correction", false)) {
+    std::string index_path = db_path.substr(0, db_path.rfind('/')) + "/typo_index.bin";
+    snap->typo_index = std::make_unique<TypoIndex>();
+    if (snap->typo_index->open(index_path)) {
+      logger->info("typo index: " + index_path + ", " + std::to_string(snap->typo_index->size()) + " entries");
+    } else {
+      snap->typo_index.reset();
+    }
   }
+  return snap;
+}
 
-  int exit = sqlite3_open(db_path.c_str(), &db);
-  if (exit != SQLITE_OK) {
-    // logger->error("Failed to open db.");
+bool DictionaryUlPb::reload() {
+  std::lock_guard<std::mutex> lock(local_mutex);
+  if (!local_ready)
+    return true;
+  auto snap = open_snapshot();
+  if (!snap)
+    return false;
+  open_decoder();
+  snapshot.store(snap);
+  logger->info("dictionary reloaded: " + db_path);
+  return true;
+}
+
+void DictionaryUlPb::load_key_filter(DictSnapshot &snap) {
+  if (!FanimeConfig::instance().get_bool("key_filter", true))
+    return;
+  snap.key_filter = std::make_unique<KeyFilter>();
+  if (!snap.key_filter->load(snap.db) || snap.key_filter->size() == 0) {
+    snap.key_filter.reset();
+    return;
   }
+  logger->info("key filter: " + std::to_string(snap.key_filter->size()) + " shards");
+}
 
-  logger->info("usename: " + PinyinUtil::home_path);
-  logger->info("usename: " + PinyinUtil::get_home_path());
-  logger->info("db path: " + db_path);
-  logger->info("log path: " + log_path);
+bool DictionaryUlPb::may_have_rows(const DictSnapshot &snap, const std::string &sp_str, const std::vector<std::string> &pinyin_list, bool &probed) {
+  probed = false;
+  if (!snap.key_filter || pinyin_list.empty() || sp_str.empty())
+    return true;
+  std::string jp;
+  size_t jp_cnt = 0, jp_pos = 0;
+  for (size_t i = 0; i < pinyin_list.size(); i++) {
+    if (pinyin_list[i].empty() || pinyin_list[i].size() > 2)
+      return true;
+    jp += pinyin_list[i][0];
+    if (pinyin_list[i].size() == 1) {
+      jp_cnt++;
+      jp_pos = i;
+    }
+  }
+  // 简拼夹在中间的范围查询没法问；tbl_others_* 里面的词长短不一，范围查询还会查到更长的 key
+  if (jp_cnt == 1 && (jp_pos + 1 != pinyin_list.size() || pinyin_list.size() >= 8))
+    return true;
+  probed = true;
+  std::string shard = Shard::table_prefix(pinyin_list.size(), sp_str[0]);
+  if (jp_cnt == 0)
+    return snap.key_filter->may_contain(shard, KeyFilter::Kind::Key, sp_str);
+  // 只有最后一个音节只打了声母，范围查询查到的就是去掉最后一个字母之后等于 sp_str 的 key
+  if (jp_cnt == 1)
+    return snap.key_filter->may_contain(shard, KeyFilter::Kind::Prefix, sp_str);
+  return snap.key_filter->may_contain(shard, KeyFilter::Kind::Jp, jp);
+}
+
+bool DictionaryUlPb::may_have_key(const DictSnapshot &snap, const std::string &key, bool &probed) {
+  probed = snap.key_filter && key.size() >= 2 && key.size() % 2 == 0;
+  return !probed || snap.key_filter->may_contain(Shard::table_prefix(key.size() / 2, key[0]), KeyFilter::Kind::Key, key);
+}
+
+void DictionaryUlPb::dump_stats(std::ostream &out) {
+  auto snap = snapshot.load();
+  if (snap && snap->key_filter)
+    snap->key_filter->dump(out);
+}
+
+/*
+  旧的词库没有 fanime_meta 表，保持 LenInitial
+*/
+void DictionaryUlPb::load_shard_scheme(DictSnapshot &snap) {
+  sqlite3 *db = snap.db;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "select value from fanime_meta where name = 'shard_scheme';", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    snap.shard_scheme = Shard::scheme_from_string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+  }
+  sqlite3_finalize(stmt);
+  logger->info("shard scheme: " + Shard::scheme_to_string(snap.shard_scheme));
+  if (snap.shard_scheme != Shard::Scheme::LenSyllable)
+    return;
+  sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'table' and name like 'tbl_%';", -1, &stmt, 0);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    std::string table(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+    snap.shard_tables[table.substr(0, table.size() - 1)].push_back(table);
+  }
+  sqlite3_finalize(stmt);
+}
+
+void DictionaryUlPb::load_helpcode_columns(DictSnapshot &snap) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(snap.db, "select value from fanime_meta where name = 'helpcode_columns';", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    snap.helpcode_columns = std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))) == "1";
+  }
+  sqlite3_finalize(stmt);
+  logger->info(std::string("helpcode columns: ") + (snap.helpcode_columns ? "yes" : "no"));
+}
+
+/*
+  LenSyllable 的词库里面不一定有新造的词所在的表
+*/
+void DictionaryUlPb::ensure_shard_table(DictSnapshot &snap, const std::string &table) {
+  auto &tables = snap.shard_tables[table.substr(0, table.size() - 1)];
+  if (std::find(tables.begin(), tables.end(), table) != tables.end())
+    return;
+  std::string base_sql = "create table if not exists %1% (key TEXT, jp TEXT, value TEXT, weight INTEGER); create index if not exists idx_%1%_key on %1% (key); create index if not exists idx_%1%_jp on %1% (jp);";
+  if (snap.helpcode_columns)
+    base_sql = "create table if not exists %1% (key TEXT, jp TEXT, value TEXT, weight INTEGER, hc_first TEXT, hc_last TEXT); create index if not exists idx_%1%_key on %1% (key); create index if not exists idx_%1%_jp on %1% (jp); create index if not exists idx_%1%_key_hc on %1% (key, hc_first, hc_last);";
+  if (sqlite3_exec(snap.db, boost::str(boost::format(base_sql) % table).c_str(), nullptr, nullptr, nullptr) == SQLITE_OK)
+    tables.push_back(table);
 }
 
 std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate(const std::string code) {
+  std::vector<std::string> pinyin_list;
+  if (code.size() > 1) {
+    // segmentation first
+    std::string pinyin_with_seg = PinyinUtil::pinyin_segmentation(code);
+    boost::split(pinyin_list, pinyin_with_seg, boost::is_any_of("'"));
+  }
+  return generate(code, pinyin_list);
+}
+
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate(const std::string code, const std::vector<std::string> &pinyin_list) {
+  if (client && code.size() > 1) {
+    std::vector<DictionaryUlPb::WordItem> candidate_list;
+    if (daemon_ok(client->generate(code, candidate_list)))
+      return candidate_list;
+  }
+  return generate_local(code, pinyin_list);
+}
+
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate_local(const std::string &code, std::vector<std::string> pinyin_list) { return generate_cursor_local(code, pinyin_list)->all(); }
+
+std::shared_ptr<CandidateCursor> DictionaryUlPb::generate_cursor(const std::string &code, const std::vector<std::string> &pinyin_list) {
+  if (client && code.size() > 1) {
+    std::vector<DictionaryUlPb::WordItem> candidate_list;
+    if (daemon_ok(client->generate(code, candidate_list)))
+      return std::make_shared<CandidateCursor>(std::move(candidate_list));
+  }
+  return generate_cursor_local(code, pinyin_list);
+}
+
+std::shared_ptr<CandidateCursor> DictionaryUlPb::generate_cursor_local(const std::string &code, std::vector<std::string> pinyin_list) {
   std::vector<DictionaryUlPb::WordItem> candidate_list;
   if (code.size() == 0) {
-    return candidate_list;
+    return std::make_shared<CandidateCursor>(std::move(candidate_list));
   }
-  std::vector<std::string> code_list;
   if (code.size() == 1) {
     generate_for_single_char(candidate_list, code);
-  } else {
-    // segmentation first
-    std::string pinyin_with_seg = PinyinUtil::pinyin_segmentation(code);
-    std::vector<std::string> pinyin_list;
-    boost::split(pinyin_list, pinyin_with_seg, boost::is_any_of("'"));
-    // build sql for query
-    auto sql_pair = build_sql(code, pinyin_list);
-    std::string sql_str = sql_pair.first;
-    if (sql_pair.second) { // need to filter
-      auto key_value_weight_list = select_complete_data(sql_str);
-      filter_key_value_list(candidate_list, pinyin_list, key_value_weight_list);
-    } else {
-      candidate_list = select_complete_data(sql_str);
-    }
+    return std::make_shared<CandidateCursor>(std::move(candidate_list));
   }
-  return candidate_list;
+  // build sql for query
+  auto snap = snapshot.load();
+  // 一定查不到的不用去 sqlite 里面查，只剩下 overlay 里面的
+  bool probed;
+  if (!may_have_rows(*snap, code, pinyin_list, probed))
+    return std::make_shared<CandidateCursor>(overlay ? overlay->match(pinyin_list) : std::vector<DictionaryUlPb::WordItem>());
+  auto sql_pair = build_sql(*snap, code, pinyin_list);
+  std::string filter_regex = sql_pair.second ? build_filter_regex(pinyin_list) : ""; // need to filter
+  auto cursor = std::make_shared<CandidateCursor>(snap, sql_pair.first, filter_regex, overlay ? overlay->match(pinyin_list) : std::vector<DictionaryUlPb::WordItem>());
+  if (probed)
+    cursor->count_false_positive();
+  return cursor;
+}
+
+/*
+  overlay 里面的条目覆盖基础词库中相同 key 和 value 的条目，然后按照 weight 合并
+*/
+void DictionaryUlPb::merge_overlay(std::vector<DictionaryUlPb::WordItem> &candidate_list, std::vector<DictionaryUlPb::WordItem> overlay_list) {
+  if (overlay_list.empty())
+    return;
+  std::erase_if(candidate_list, [&overlay_list](const DictionaryUlPb::WordItem &item) {
+    return std::any_of(overlay_list.begin(), overlay_list.end(), [&item](const DictionaryUlPb::WordItem &each) { return std::get<0>(each) == std::get<0>(item) && std::get<1>(each) == std::get<1>(item); });
+  });
+  std::vector<DictionaryUlPb::WordItem> merged_list;
+  merged_list.reserve(candidate_list.size() + overlay_list.size());
+  std::merge(overlay_list.begin(), overlay_list.end(), candidate_list.begin(), candidate_list.end(), std::back_inserter(merged_list), [](const DictionaryUlPb::WordItem &a, const DictionaryUlPb::WordItem &b) { return std::get<2>(a) > std::get<2>(b); });
+  candidate_list = std::move(merged_list);
 }
 
 void DictionaryUlPb::generate_for_single_char(std::vector<DictionaryUlPb::WordItem> &candidate_list, std::string code) {
+  if (code.empty() || code[0] < 'a' || code[0] > 'z')
+    return;
   std::string s = single_han_list[code[0] - 'a'];
   for (size_t i = 0; i < s.length();) {
     size_t cplen = PinyinUtil::get_first_char_size(s.substr(i, s.size() - i));
@@ -110,7 +376,7 @@ void DictionaryUlPb::generate_for_single_char(std::vector<DictionaryUlPb::WordIt
   }
 }
 
-void DictionaryUlPb::filter_key_value_list(std::vector<DictionaryUlPb::WordItem> &candidate_list, const std::vector<std::string> &pinyin_list, const std::vector<DictionaryUlPb::WordItem> &key_value_weight_list) {
+std::string DictionaryUlPb::build_filter_regex(const std::vector<std::string> &pinyin_list) {
   std::string regex_str("");
   for (const auto &each_pinyin : pinyin_list) {
     if (each_pinyin.size() == 2) {
@@ -119,94 +385,323 @@ void DictionaryUlPb::filter_key_value_list(std::vector<DictionaryUlPb::WordItem>
       regex_str = regex_str + each_pinyin + "[a-z]";
     }
   }
-  std::regex pattern(regex_str);
-  for (const auto &each_tuple : key_value_weight_list) {
-    if (std::regex_match(std::get<0>(each_tuple), pattern)) {
-      candidate_list.push_back(each_tuple);
+  return regex_str;
+}
+
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate_for_creating_word(const std::string code) {
+  if (client) {
+    std::vector<DictionaryUlPb::WordItem> candidate_list;
+    if (daemon_ok(client->generate_for_creating_word(code, candidate_list)))
+      return candidate_list;
+  }
+  return generate_for_creating_word_local(code);
+}
+
+/*
+  每个前缀一张表，互相独立，分开查询(有 executor 的时候并发)，长的前缀在前面，每一组内部按照 weight 合并 overlay
+  和以前一条 union all 的结果一样
+*/
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate_for_creating_word_local(const std::string &code) {
+  auto snap = snapshot.load();
+  if (code.size() < 2)
+    return overlay ? std::vector<DictionaryUlPb::WordItem>() : select_complete_data(snap->db, build_sql_for_creating_word_prefix(*snap, code));
+  std::vector<std::string> prefixes;
+  for (size_t len = code.size() - code.size() % 2; len >= 2; len -= 2)
+    prefixes.push_back(code.substr(0, len));
+  std::vector<DictionaryUlPb::WordItem> res;
+  auto groups = select_prefixes(*snap, prefixes);
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (overlay)
+      merge_overlay(groups[i], overlay->match_key(prefixes[i]));
+    res.insert(res.end(), std::make_move_iterator(groups[i].begin()), std::make_move_iterator(groups[i].end()));
+  }
+  return res;
+}
+
+/*
+  union all 拆开，每个前缀自己一个 cursor，overlay 在 cursor 里面按 weight 合并，和上面按组合并的结果一样
+  造词的时候一般只看第一页，短的前缀根本不用去查；cursor 按 generate_deadline_ns 取，到期了就挂起
+  这里不用 executor: 它一次把所有前缀都查完，没有期限，只给上面一次要全部结果的 generate_for_creating_word 用
+*/
+std::vector<std::shared_ptr<CandidateCursor>> DictionaryUlPb::generate_cursors_for_creating_word(const std::string &code) {
+  std::vector<std::shared_ptr<CandidateCursor>> cursors;
+  if (client) {
+    std::vector<DictionaryUlPb::WordItem> candidate_list;
+    if (daemon_ok(client->generate_for_creating_word(code, candidate_list))) {
+      cursors.push_back(std::make_shared<CandidateCursor>(std::move(candidate_list)));
+      return cursors;
+    }
+  }
+  auto snap = snapshot.load();
+  if (code.size() < 2) {
+    cursors.push_back(std::make_shared<CandidateCursor>(snap, build_sql_for_creating_word_prefix(*snap, code), "", std::vector<DictionaryUlPb::WordItem>()));
+    return cursors;
+  }
+  std::vector<std::string> prefixes;
+  for (size_t len = code.size() - code.size() % 2; len >= 2; len -= 2)
+    prefixes.push_back(code.substr(0, len));
+  for (const auto &prefix : prefixes) {
+    bool probed;
+    if (!may_have_key(*snap, prefix, probed)) {
+      cursors.push_back(std::make_shared<CandidateCursor>(overlay ? overlay->match_key(prefix) : std::vector<DictionaryUlPb::WordItem>()));
+      continue;
     }
+    cursors.push_back(std::make_shared<CandidateCursor>(snap, build_sql_for_creating_word_prefix(*snap, prefix), "", overlay ? overlay->match_key(prefix) : std::vector<DictionaryUlPb::WordItem>()));
+    if (probed)
+      cursors.back()->count_false_positive();
   }
+  return cursors;
 }
 
-std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate_for_creating_word(const std::string code) { return select_complete_data(build_sql_for_creating_word(code)); }
+/*
+  key_filter 说一定没有的前缀不去查，对应的那一组是空的
+*/
+std::vector<std::vector<DictionaryUlPb::WordItem>> DictionaryUlPb::select_prefixes(const DictSnapshot &snap, const std::vector<std::string> &prefixes) {
+  std::vector<std::vector<DictionaryUlPb::WordItem>> groups(prefixes.size());
+  std::vector<size_t> queried;
+  std::vector<bool> probed_flags;
+  std::vector<SqlQuery> sqls;
+  for (size_t i = 0; i < prefixes.size(); i++) {
+    bool probed;
+    if (!may_have_key(snap, prefixes[i], probed))
+      continue;
+    queried.push_back(i);
+    probed_flags.push_back(probed);
+    sqls.push_back(build_sql_for_creating_word_prefix(snap, prefixes[i]));
+  }
+  if (sqls.empty())
+    return groups;
+  auto rows = select_each(snap, sqls);
+  for (size_t j = 0; j < queried.size(); j++) {
+    if (probed_flags[j] && rows[j].empty())
+      snap.key_filter->record_false_positive();
+    groups[queried[j]] = std::move(rows[j]);
+  }
+  return groups;
+}
+
+/*
+  改正之后的 key 都是完整的双拼，两个字母一个音节，不用再切
+*/
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::generate_corrections(const std::string &code, size_t cnt) {
+  std::vector<DictionaryUlPb::WordItem> res;
+  if (client || code.size() < 2 || typo_max_corrections <= 0)
+    return res;
+  auto snap = snapshot.load();
+  if (!snap || !snap->typo_index)
+    return res;
+  for (const auto &key : snap->typo_index->corrections(code, typo_max_corrections)) {
+    std::vector<std::string> pinyin_list;
+    for (size_t i = 0; i + 1 < key.size(); i += 2)
+      pinyin_list.push_back(key.substr(i, 2));
+    auto cursor = generate_cursor_local(key, pinyin_list);
+    cursor->fetch(cnt);
+    const auto &rows = cursor->rows();
+    res.insert(res.end(), rows.begin(), rows.begin() + std::min(cnt, rows.size()));
+  }
+  return res;
+}
+
+bool DictionaryUlPb::generate_with_fullhelpcode(const std::vector<std::string> &pinyin_list, const std::string &helpcode, std::vector<DictionaryUlPb::WordItem> &candidate_list) {
+  if (client || helpcode.size() != 2 || !std::islower(helpcode[0]) || !std::islower(helpcode[1]) || pinyin_list.empty())
+    return false;
+  if (std::any_of(pinyin_list.begin(), pinyin_list.end(), [](const std::string &each) { return each.size() != 2; }))
+    return false;
+  auto snap = snapshot.load();
+  if (!snap->helpcode_columns)
+    return false;
+  std::string sp_str = boost::algorithm::join(pinyin_list, "");
+  SqlQuery query = build_sql_for_fullhelpcode(*snap, sp_str, helpcode);
+  std::vector<DictionaryUlPb::WordItem> rows;
+  if (!query.empty())
+    rows = select_complete_data(snap->db, query);
+  candidate_list.clear();
+  if (!overlay) {
+    candidate_list = std::move(rows);
+    return true;
+  }
+  // overlay 里面的词没有辅助码列，在这里过滤，然后和 generate_for_creating_word_local 一样按组合并
+  auto assets = PinyinUtil::assets();
+  const auto &helpcode_keymap = assets->helpcode_keymap;
+  auto matched = [&](const std::string &word) {
+    std::string first_han_char = PinyinUtil::get_first_han_char(word);
+    auto first = helpcode_keymap.find(first_han_char);
+    if (first == helpcode_keymap.end())
+      return false;
+    if (PinyinUtil::cnt_han_chars(word) == 1)
+      return first->second == helpcode;
+    auto last = helpcode_keymap.find(PinyinUtil::get_last_han_char(word));
+    return first->second[0] == helpcode[0] && last != helpcode_keymap.end() && last->second[0] == helpcode[1];
+  };
+  for (size_t len = sp_str.size(); len >= 2; len -= 2) {
+    std::vector<DictionaryUlPb::WordItem> group;
+    for (const auto &item : rows)
+      if (std::get<0>(item).size() == len)
+        group.push_back(item);
+    auto overlay_list = overlay->match_key(sp_str.substr(0, len));
+    std::erase_if(overlay_list, [&](const DictionaryUlPb::WordItem &item) { return !matched(std::get<1>(item)); });
+    merge_overlay(group, overlay_list);
+    candidate_list.insert(candidate_list.end(), group.begin(), group.end());
+  }
+  return true;
+}
 
 int DictionaryUlPb::create_word(std::string pinyin, std::string word) {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(learn));
+  int status = ERROR;
+  if (!client || !daemon_ok(client->create_word(pinyin, word, status))) {
+    status = create_word_local(pinyin, word);
+  }
+  FANIME_PROBE(learn, 0, pinyin.c_str(), word.c_str(), FanimeTrace::elapsed_ns(start_ns));
+  return status;
+}
+
+int DictionaryUlPb::create_word_local(std::string pinyin, std::string word) {
   std::string jp;
   for (size_t i = 0; i < pinyin.size(); i += 2)
     jp += pinyin[i];
   if (!do_validate(pinyin, jp, word))
     return ERROR;
-  if (check_data(build_sql_for_checking_word(pinyin, jp, word))) {
+  auto snap = snapshot.load();
+  if (check_data(snap->db, build_sql_for_checking_word(*snap, pinyin, jp, word))) {
+    return OK;
+  }
+  if (overlay) {
+    if (!overlay->contains(pinyin, word)) {
+      overlay->add_word(pinyin, jp, word, 10000); // 默认权重 weight 是 10,000
+      overlay->maybe_checkpoint();
+    }
     return OK;
   }
-  insert_data(build_sql_for_inserting_word(pinyin, jp, word));
+  if (snap->shard_scheme == Shard::Scheme::LenSyllable)
+    ensure_shard_table(*snap, choose_tbl(*snap, pinyin, jp.size()));
+  insert_data(snap->db, build_sql_for_inserting_word(*snap, pinyin, jp, word));
+  // 写进词库的词 key_filter 里面也要有，重启之后也是
+  if (snap->key_filter) {
+    std::string shard = Shard::table_prefix(jp.size(), pinyin[0]);
+    snap->key_filter->add(shard, KeyFilter::Kind::Key, pinyin);
+    snap->key_filter->add(shard, KeyFilter::Kind::Jp, jp);
+    snap->key_filter->add(shard, KeyFilter::Kind::Prefix, pinyin.substr(0, pinyin.size() - 1));
+    snap->key_filter->save_shard(snap->db, shard);
+  }
   return OK;
 }
 
-std::string DictionaryUlPb::build_sql_for_updating_word(std::string word) {
+SqlQuery DictionaryUlPb::build_sql_for_updating_word(const DictSnapshot &snap, std::string word) {
   int han_cnt = PinyinUtil::cnt_han_chars(word);
   std::string pinyin = GlobalIME::pinyin.substr(0, han_cnt * 2);
   std::string jp;
   for (size_t i = 0; i < pinyin.size(); i += 2)
     jp += pinyin[i];
   if (!do_validate(pinyin, jp, word))
-    return "";
-  std::string table = choose_tbl(pinyin, jp.size());
-  // update %1% set weight = ( select MAX(weight) + 1 from %1% AS sub where sub.key = '%2%') where key = '%2%' and value = '%3%';
-  std::string base_sql = "update %1% set weight = ( select MAX(weight) + 1 from %1% AS sub where sub.key = '%2%') where key = '%2%' and value = '%3%';";
-  std::string res_sql = boost::str(boost::format(base_sql) % table % pinyin % word);
-  // logger->info("fany update word: " + res_sql);
-  return res_sql;
+    return SqlQuery();
+  std::string table = choose_tbl(snap, pinyin, jp.size());
+  std::string base_sql = "update %1% set weight = ( select MAX(weight) + 1 from %1% AS sub where sub.key = ?1) where key = ?1 and value = ?2;";
+  return SqlQuery{boost::str(boost::format(base_sql) % table), {pinyin, word}};
 }
 
-int DictionaryUlPb::update_data(std::string sql_str) {
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
-  exit = sqlite3_step(stmt);
+int DictionaryUlPb::update_data(sqlite3 *db, const SqlQuery &query) {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return 0;
+  int exit = sqlite3_step(stmt);
   if (exit != SQLITE_DONE) {
     // log
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), sqlite3_changes(db), FanimeTrace::elapsed_ns(start_ns));
   return 0;
 }
 
 int DictionaryUlPb::update_weight_by_word(std::string word) {
-  update_data(build_sql_for_updating_word(word));
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(learn));
+  int status = ERROR;
+  if (!client || !daemon_ok(client->update_weight_by_word(GlobalIME::pinyin, word, status))) {
+    status = update_weight_by_word_local(word);
+  }
+  FANIME_PROBE(learn, 1, GlobalIME::pinyin.c_str(), word.c_str(), FanimeTrace::elapsed_ns(start_ns));
+  return status;
+}
+
+int DictionaryUlPb::update_weight_by_word_local(std::string word) {
+  auto snap = snapshot.load();
+  if (!overlay) {
+    update_data(snap->db, build_sql_for_updating_word(*snap, word));
+    return OK;
+  }
+  int han_cnt = PinyinUtil::cnt_han_chars(word);
+  std::string pinyin = GlobalIME::pinyin.substr(0, han_cnt * 2);
+  std::string jp;
+  for (size_t i = 0; i < pinyin.size(); i += 2)
+    jp += pinyin[i];
+  if (!do_validate(pinyin, jp, word))
+    return ERROR;
+  // 和 build_sql_for_updating_word 一样，只调整已经存在的词
+  if (!overlay->contains(pinyin, word) && !check_data(snap->db, build_sql_for_checking_word(*snap, pinyin, jp, word)))
+    return OK;
+  int weight = std::max(select_max_weight(snap->db, build_sql_for_max_weight(*snap, pinyin, jp)), overlay->max_weight(pinyin)) + 1;
+  overlay->set_weight(pinyin, jp, word, weight);
+  overlay->maybe_checkpoint();
   return OK;
 }
 
+int DictionaryUlPb::select_max_weight(sqlite3 *db, const SqlQuery &query) {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  int weight = -1;
+  if (!stmt)
+    return weight;
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    weight = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), weight >= 0 ? 1 : 0, FanimeTrace::elapsed_ns(start_ns));
+  return weight;
+}
+
 // generate_with_seg_pinyin
 
-DictionaryUlPb::~DictionaryUlPb() {
-  if (db) {
-    sqlite3_close(db);
-  }
+DictionaryUlPb::~DictionaryUlPb() {}
+
+void DictionaryUlPb::checkpoint_overlay(bool force) {
+  if (!overlay)
+    return;
+  if (force)
+    overlay->checkpoint();
+  else
+    overlay->maybe_checkpoint();
 }
 
-std::vector<std::string> DictionaryUlPb::select_data(std::string sql_str) {
+std::vector<std::string> DictionaryUlPb::select_data(sqlite3 *db, const SqlQuery &query) {
   std::vector<std::string> candidateList;
-  // logger->error(sql_str);
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return candidateList;
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     candidateList.push_back(std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2))));
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), candidateList.size(), FanimeTrace::elapsed_ns(start_ns));
   return candidateList;
 }
 
-std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::select_complete_data(std::string sql_str) {
+std::vector<std::vector<DictionaryUlPb::WordItem>> DictionaryUlPb::select_each(const DictSnapshot &snap, const std::vector<SqlQuery> &sqls) {
+  if (snap.executor && sqls.size() > 1)
+    return snap.executor->run(snap.db, sqls);
+  std::vector<std::vector<DictionaryUlPb::WordItem>> res;
+  for (const auto &sql : sqls)
+    res.push_back(select_complete_data(snap.db, sql));
+  return res;
+}
+
+std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::select_complete_data(sqlite3 *db, const SqlQuery &query) {
   std::vector<DictionaryUlPb::WordItem> candidateList;
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return candidateList;
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     // clang-format off
     candidateList.push_back(
@@ -219,58 +714,140 @@ std::vector<DictionaryUlPb::WordItem> DictionaryUlPb::select_complete_data(std::
     // clang-format on
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), candidateList.size(), FanimeTrace::elapsed_ns(start_ns));
   return candidateList;
 }
 
-std::vector<std::pair<std::string, std::string>> DictionaryUlPb::select_key_and_value(std::string sql_str) {
+std::vector<std::pair<std::string, std::string>> DictionaryUlPb::select_key_and_value(sqlite3 *db, const SqlQuery &query) {
   std::vector<std::pair<std::string, std::string>> candidateList;
-  // logger->error(sql_str);
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return candidateList;
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     candidateList.push_back(std::make_pair(std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))), std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)))));
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), candidateList.size(), FanimeTrace::elapsed_ns(start_ns));
   return candidateList;
 }
 
 /**
  * 检查是否存在某个条目
  */
-int DictionaryUlPb::check_data(std::string sql_str) {
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
+int DictionaryUlPb::check_data(sqlite3 *db, const SqlQuery &query) {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
   bool exists = false;
-  exit = sqlite3_step(stmt);
+  if (!stmt)
+    return exists;
+  int exit = sqlite3_step(stmt);
   if (exit == SQLITE_ROW) {
     exists = true;
     // log
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), exists ? 1 : 0, FanimeTrace::elapsed_ns(start_ns));
   return exists;
 }
 
-int DictionaryUlPb::insert_data(std::string sql_str) {
-  sqlite3_stmt *stmt;
-  int exit = sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, 0);
-  if (exit != SQLITE_OK) {
-    // logger->error("sqlite3_prepare_v2 error.");
-  }
-  exit = sqlite3_step(stmt);
+int DictionaryUlPb::insert_data(sqlite3 *db, const SqlQuery &query) {
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return 0;
+  int exit = sqlite3_step(stmt);
   if (exit != SQLITE_DONE) {
     // log
   }
   sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), sqlite3_changes(db), FanimeTrace::elapsed_ns(start_ns));
   return 0;
 }
 
-std::pair<std::string, bool> DictionaryUlPb::build_sql(const std::string &sp_str, std::vector<std::string> &pinyin_list) {
+std::pair<SqlQuery, bool> DictionaryUlPb::explain_sql(const std::string &code, std::vector<std::string> pinyin_list) {
+  ensure_local();
+  auto snap = snapshot.load();
+  return build_sql(*snap, code, pinyin_list);
+}
+
+std::vector<SqlQuery> DictionaryUlPb::warm_up_queries(const std::vector<std::string> &codes) {
+  std::vector<SqlQuery> queries;
+  if (client)
+    return queries;
+  auto snap = snapshot.load();
+  if (!snap || !snap->db)
+    return queries;
+  for (const auto &code : codes) {
+    if (code.size() < 2)
+      continue;
+    std::string pinyin_with_seg = PinyinUtil::pinyin_segmentation(code);
+    std::vector<std::string> pinyin_list;
+    boost::split(pinyin_list, pinyin_with_seg, boost::is_any_of("'"));
+    queries.push_back(build_sql(*snap, code, pinyin_list).first);
+  }
+  return queries;
+}
+
+size_t DictionaryUlPb::warm_up(const std::vector<SqlQuery> &queries) {
+  if (queries.empty())
+    return 0;
+  sqlite3 *db = nullptr;
+  if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+    sqlite3_close(db);
+    return 0;
+  }
+  if (read_only_base && mmap_bytes > 0)
+    sqlite3_exec(db, ("PRAGMA mmap_size = " + std::to_string(mmap_bytes) + ";").c_str(), nullptr, nullptr, nullptr);
+  size_t rows = 0;
+  for (const auto &query : queries)
+    rows += select_complete_data(db, query).size();
+  sqlite3_close(db);
+  return rows;
+}
+
+/*
+  谷歌输入法引擎把 dict_pinyin.dat 整个读进内存，看不到里面，按文件大小算
+*/
+void DictionaryUlPb::memory_usage(MemoryStats &stats) {
+  if (overlay)
+    stats.record("user_overlay", overlay->memory_bytes(), overlay->size());
+  auto snap = snapshot.load();
+  if (!snap || !snap->db)
+    return;
+  int cur = 0, hiwtr = 0;
+  int64_t cache_used = sqlite3_db_status(snap->db, SQLITE_DBSTATUS_CACHE_USED, &cur, &hiwtr, 0) == SQLITE_OK ? cur : 0;
+  size_t conn_cnt = 1;
+  if (snap->executor) {
+    cache_used += snap->executor->cache_used();
+    conn_cnt += snap->executor->size();
+  }
+  stats.record("sqlite_page_cache", static_cast<uint64_t>(cache_used), conn_cnt);
+  size_t shard_bytes = MemoryStats::table_bytes(snap->shard_tables);
+  for (const auto &[prefix, tables] : snap->shard_tables) {
+    shard_bytes += MemoryStats::heap_bytes(prefix) + tables.capacity() * sizeof(std::string);
+    for (const auto &table : tables)
+      shard_bytes += MemoryStats::heap_bytes(table);
+  }
+  stats.record("shard_tables", shard_bytes, snap->shard_tables.size());
+  if (snap->key_filter)
+    stats.record("key_filter", snap->key_filter->memory_bytes(), snap->key_filter->size());
+  if (snap->typo_index)
+    stats.record("typo_index", snap->typo_index->mapped_bytes(), snap->typo_index->size(), true);
+  std::string data_dir = db_path.substr(0, db_path.rfind('/'));
+  stats.record("google_decoder", MemoryStats::file_size(data_dir + "/dict_pinyin.dat") + MemoryStats::file_size(data_dir + "/user_dict.dat"), 1);
+}
+
+void DictionaryUlPb::release_memory() {
+  auto snap = snapshot.load();
+  if (!snap || !snap->db)
+    return;
+  sqlite3_db_release_memory(snap->db);
+  if (snap->executor)
+    snap->executor->release_memory();
+}
+
+std::pair<SqlQuery, bool> DictionaryUlPb::build_sql(const DictSnapshot &snap, const std::string &sp_str, std::vector<std::string> &pinyin_list) {
   bool all_entire_pinyin = true;
   bool all_jp = true;
   std::vector<std::string>::size_type jp_cnt = 0; // 简拼的数量
@@ -283,14 +860,14 @@ std::pair<std::string, bool> DictionaryUlPb::build_sql(const std::string &sp_str
       all_jp = false;
     }
   }
-  std::string sql;
-  std::string base_sql("select * from %1% where %2% = '%3%' order by weight desc limit %4%;");
-  std::string table = choose_tbl(sp_str, pinyin_list.size());
+  SqlQuery query;
+  std::string base_sql("select * from %1% where %2% = ? order by weight desc limit %3%;");
+  std::string table = choose_src(snap, sp_str, pinyin_list);
   bool need_filtering = false;
   if (all_entire_pinyin) { // 拼音分词全部是全拼
-    sql = boost::str(boost::format(base_sql) % table % "key" % sp_str % default_candicate_page_limit);
+    query = SqlQuery{boost::str(boost::format(base_sql) % table % "key" % default_candicate_page_limit), {sp_str}};
   } else if (all_jp) { // 拼音分词全部是简拼
-    sql = boost::str(boost::format(base_sql) % table % "jp" % sp_str % default_candicate_page_limit);
+    query = SqlQuery{boost::str(boost::format(base_sql) % table % "jp" % default_candicate_page_limit), {sp_str}};
   } else if (jp_cnt == 1) { // 拼音分词只有一个是简拼
     std::string sql_param0("");
     std::string sql_param1("");
@@ -303,46 +880,96 @@ std::pair<std::string, bool> DictionaryUlPb::build_sql(const std::string &sp_str
         sql_param1 += pinyin_list[i];
       }
     }
-    sql = boost::str(boost::format("select * from %1% where key >= '%2%' and key <= '%3%' order by weight desc limit %4%;") % table % sql_param0 % sql_param1 % default_candicate_page_limit);
+    query = SqlQuery{boost::str(boost::format("select * from %1% where key >= ? and key <= ? order by weight desc limit %2%;") % table % default_candicate_page_limit), {sql_param0, sql_param1}};
   } else { // 既不是纯粹的完整的拼音，也不是纯粹的简拼，并且简拼的数量严格大于 1
     need_filtering = true;
     std::string sql_param("");
     for (std::string &cur_pinyin : pinyin_list) {
       sql_param += cur_pinyin.substr(0, 1);
     }
-    // TODO: not adding weight desc
-    sql = boost::str(boost::format("select * from %1% where jp = '%2%';") % table % sql_param); // do not use limit, we need retrive all data and then filter
+    // 所有同简拼的行本来就都要读出来过滤，排序不多花多少；merge_overlay 和 cursor 都要按 weight 从大到小
+    query = SqlQuery{boost::str(boost::format("select * from %1% where jp = ? order by weight desc;") % table), {sql_param}}; // do not use limit, we need retrive all data and then filter
   }
-  return std::make_pair(sql, need_filtering);
+  return std::make_pair(query, need_filtering);
 }
 
-std::string DictionaryUlPb::build_sql_for_creating_word(const std::string &sp_str) {
-  std::string base_sql = "select * from(select * from %1% where key = '%2%' order by weight desc limit %3%)";
-  std::string res_sql = boost::str(boost::format(base_sql) % choose_tbl(sp_str.substr(0, 2), 1) % sp_str.substr(0, 2) % default_candicate_page_limit);
-  std::string trimed_sp_str = sp_str.substr(0, 8); // 最多只到 4 字词语
-  for (size_t i = 4; i <= sp_str.size(); i += 2) {
-    res_sql = boost::str(boost::format(base_sql) % choose_tbl(sp_str.substr(0, i), i / 2) % sp_str.substr(0, i) % default_candicate_page_limit) + " union all " + res_sql;
+SqlQuery DictionaryUlPb::build_sql_for_creating_word_prefix(const DictSnapshot &snap, const std::string &prefix) {
+  std::string base_sql = "select * from(select * from %1% where key = ? order by weight desc limit %2%)";
+  return SqlQuery{boost::str(boost::format(base_sql) % choose_tbl(snap, prefix, (std::max<size_t>(prefix.size(), 2)) / 2) % default_candicate_page_limit), {prefix}};
+}
+
+SqlQuery DictionaryUlPb::build_sql_for_checking_word(const DictSnapshot &snap, std::string key, std::string jp, std::string value) {
+  std::string table = choose_tbl(snap, key, jp.size());
+  std::string base_sql = "select 1 from %1% where key = ? and value = ?;";
+  return SqlQuery{boost::str(boost::format(base_sql) % table), {key, value}};
+}
+
+SqlQuery DictionaryUlPb::build_sql_for_inserting_word(const DictSnapshot &snap, std::string key, std::string jp, std::string value) {
+  std::string table = choose_tbl(snap, key, jp.size());
+  if (snap.helpcode_columns) {
+    // 和 fanime-gendict 一样，查不到辅助码的字留空
+    auto assets = PinyinUtil::assets();
+    auto first = assets->helpcode_keymap.find(PinyinUtil::get_first_han_char(value));
+    auto last = assets->helpcode_keymap.find(PinyinUtil::get_last_han_char(value));
+    std::string base_sql = "insert into %1% (key, jp, value, weight, hc_first, hc_last) values (?, ?, ?, %2%, ?, ?);";
+    return SqlQuery{boost::str(boost::format(base_sql) % table % 10000), {key, jp, value, first == assets->helpcode_keymap.end() ? "" : first->second, last == assets->helpcode_keymap.end() ? "" : last->second}};
   }
-  return res_sql;
+  std::string base_sql = "insert into %1% (key, jp, value, weight) values (?, ?, ?, %2%);";
+  return SqlQuery{boost::str(boost::format(base_sql) % table % 10000), {key, jp, value}}; // 默认权重 weight 是 10,000
 }
 
-std::string DictionaryUlPb::build_sql_for_checking_word(std::string key, std::string jp, std::string value) {
-  std::string table = choose_tbl(key, jp.size());
-  std::string base_sql = "select 1 from %1% where key = '%2%' and value = '%3%';";
-  return boost::str(boost::format(base_sql) % table % key % value); // 默认权重 weight 是 10,000
+/*
+  和造词一样，长的前缀在前面，每个前缀只取匹配辅助码的行
+  多字词只看首尾两个字辅助码的第一个字母，hc_first 用范围查询，这样 (key, hc_first, hc_last) 索引可以用上
+*/
+SqlQuery DictionaryUlPb::build_sql_for_fullhelpcode(const DictSnapshot &snap, const std::string &sp_str, const std::string &helpcode) {
+  std::string base_sql = "select * from(select * from %1% where key = ? and %2% order by weight desc limit %3%)";
+  std::string first_only = "hc_first = ?";
+  std::string first_and_last = "hc_first >= ? and hc_first < ? and substr(hc_last, 1, 1) = ?";
+  SqlQuery query;
+  for (size_t len = sp_str.size(); len >= 2; len -= 2) {
+    std::string table = choose_tbl(snap, sp_str.substr(0, len), len / 2);
+    if (snap.shard_scheme == Shard::Scheme::LenSyllable) {
+      auto it = snap.shard_tables.find(table.substr(0, table.size() - 1));
+      if (it == snap.shard_tables.end() || std::find(it->second.begin(), it->second.end(), table) == it->second.end())
+        continue;
+    }
+    std::string sql = boost::str(boost::format(base_sql) % table % (len == 2 ? first_only : first_and_last) % default_candicate_page_limit);
+    query.sql += (query.sql.empty() ? "" : " union all ") + sql;
+    query.params.push_back(sp_str.substr(0, len));
+    if (len == 2) {
+      query.params.push_back(helpcode);
+    } else {
+      query.params.push_back(helpcode.substr(0, 1));
+      query.params.push_back(std::string(1, static_cast<char>(helpcode[0] + 1)));
+      query.params.push_back(helpcode.substr(1, 1));
+    }
+  }
+  return query;
 }
 
-std::string DictionaryUlPb::build_sql_for_inserting_word(std::string key, std::string jp, std::string value) {
-  std::string table = choose_tbl(key, jp.size());
-  std::string base_sql = "insert into %1% (key, jp, value, weight) values ('%2%', '%3%', '%4%', '%5%');";
-  return boost::str(boost::format(base_sql) % table % key % jp % value % 10000); // 默认权重 weight 是 10,000
+SqlQuery DictionaryUlPb::build_sql_for_max_weight(const DictSnapshot &snap, std::string key, std::string jp) {
+  std::string table = choose_tbl(snap, key, jp.size());
+  std::string base_sql = "select MAX(weight) from %1% where key = ?;";
+  return SqlQuery{boost::str(boost::format(base_sql) % table), {key}};
 }
 
-std::string DictionaryUlPb::choose_tbl(const std::string &sp_str, size_t word_len) {
-  std::string base_tbl("tbl_%1%_%2%");
-  if (word_len >= 8)
-    return boost::str(boost::format(base_tbl) % "others" % sp_str[0]);
-  return boost::str(boost::format(base_tbl) % word_len % sp_str[0]);
+std::string DictionaryUlPb::choose_tbl(const DictSnapshot &snap, const std::string &sp_str, size_t word_len) { return Shard::table_for(snap.shard_scheme, sp_str, word_len); }
+
+std::string DictionaryUlPb::choose_src(const DictSnapshot &snap, const std::string &sp_str, const std::vector<std::string> &pinyin_list) {
+  if (snap.shard_scheme == Shard::Scheme::LenInitial || pinyin_list[0].size() == 2)
+    return choose_tbl(snap, sp_str, pinyin_list.size());
+  // 只有声母，合并所有以这个声母开头的表
+  std::string prefix = Shard::table_prefix(pinyin_list.size(), sp_str[0]);
+  auto it = snap.shard_tables.find(prefix);
+  if (it == snap.shard_tables.end() || it->second.empty())
+    return prefix;
+  if (it->second.size() == 1)
+    return it->second[0];
+  std::string src("(");
+  for (size_t i = 0; i < it->second.size(); i++)
+    src += (i ? " union all select * from " : "select * from ") + it->second[i];
+  return src + ")";
 }
 
 bool DictionaryUlPb::do_validate(std::string key, std::string jp, std::string value) {
@@ -358,6 +985,20 @@ std::string fromUtf16(const ime_pinyin::char16 *buf, size_t len) {
 }
 
 std::string DictionaryUlPb::search_sentence_from_ime_engine(const std::string &user_pinyin) {
+  if (client) {
+    std::string sentence;
+    if (daemon_ok(client->search_sentence(user_pinyin, sentence)))
+      return sentence;
+  }
+  return search_sentence_local(user_pinyin);
+}
+
+std::string DictionaryUlPb::search_sentence_local(const std::string &user_pinyin) {
+  // 正在重新打开谷歌输入法引擎的话直接放弃，不能让按键等待
+  std::unique_lock<std::mutex> lock(decoder_mutex, std::try_to_lock);
+  if (!lock.owns_lock())
+    return "";
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(im_search));
   std::string pinyin_str = user_pinyin;
   const char *pinyin = pinyin_str.c_str();
   size_t cand_cnt = ime_pinyin::im_search(pinyin, strlen(pinyin));
@@ -371,5 +1012,6 @@ std::string DictionaryUlPb::search_sentence_from_ime_engine(const std::string &u
       ++len;
     msg = fromUtf16(buf, len);
   }
+  FANIME_PROBE(im_search, pinyin, msg.c_str(), FanimeTrace::elapsed_ns(start_ns));
   return msg;
 }
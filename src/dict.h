@@ -8,10 +8,43 @@
 #include <fstream>
 #include <sqlite3.h>
 #include <memory>
+#include <atomic>
+#include <mutex>
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 
 #include "log.h"
+#include "dict_client.h"
+#include "user_overlay.h"
+#include "shard.h"
+#include "shard_executor.h"
+#include "typo_index.h"
+#include "key_filter.h"
+#include "candidate_cursor.h"
+#include "sql_query.h"
+
+/*
+  一份打开的词库以及从词库里读出来的元数据，热加载时整体替换
+  查询开始时拿到一份 shared_ptr，正在进行的查询即使遇到替换也会在旧的上面完成，最后一个引用释放时才关闭
+*/
+struct DictSnapshot {
+  sqlite3 *db = nullptr;
+  Shard::Scheme shard_scheme = Shard::Scheme::LenInitial;
+  // LenSyllable 时，Shard::table_prefix -> 词库里面实际存在的表
+  std::unordered_map<std::string, std::vector<std::string>> shard_tables;
+  // 每张表都有 hc_first 和 hc_last 两列(首字和尾字的辅助码)，见 fanime-gendict --helpcode
+  bool helpcode_columns = false;
+  // 同一个词库文件上的只读连接，并发执行互相独立的分表查询，shard_workers=0 时为空
+  std::unique_ptr<ShardExecutor> executor;
+  // 词库目录下面的 typo_index.bin，typo_correction=0 或者没有这个文件时为空
+  std::unique_ptr<TypoIndex> typo_index;
+  // 词库里面的 fanime_key_filter 表，key_filter=0 或者旧的词库没有这张表时为空
+  std::unique_ptr<KeyFilter> key_filter;
+
+  ~DictSnapshot();
+};
+
+class MemoryStats;
 
 class DictionaryUlPb {
 public:
@@ -25,7 +58,32 @@ public:
 e table
   */
   std::vector<WordItem> generate(const std::string code);
+  // 调用者已经按音节切好了 code(见 QueryContext)，不用再切一次
+  std::vector<WordItem> generate(const std::string code, const std::vector<std::string> &pinyin_list);
+  /*
+    和 generate 的结果相同，但是按需从词库里面取，翻页的时候才取后面的
+  */
+  std::shared_ptr<CandidateCursor> generate_cursor(const std::string &code, const std::vector<std::string> &pinyin_list);
   std::vector<DictionaryUlPb::WordItem> generate_for_creating_word(const std::string code);
+  /*
+    和 generate_for_creating_word 的结果相同，但是每个前缀一个 cursor，长的前缀在前面，按需从词库里面取
+  */
+  std::vector<std::shared_ptr<CandidateCursor>> generate_cursors_for_creating_word(const std::string &code);
+  /*
+    code 查不到的时候，把它当成打错了一个字母，改正成 typo_index.bin 里面最可能的几个 key 再查
+    每个 key 最多取 cnt 个，最可能的 key 在前面；没有索引、使用 fanime-dictd 的时候返回空
+  */
+  std::vector<WordItem> generate_corrections(const std::string &code, size_t cnt);
+  /*
+    完整辅助码: pinyin_list 以及它的每个前缀对应的词里面，和 helpcode 匹配的那些
+      - 单字: 辅助码就是 helpcode
+      - 多字: 首字辅助码的第一个字母和尾字辅助码的第一个字母
+    词库里面有辅助码列的时候直接在索引上查，只取出匹配的行
+    和调用者自己过滤不完全一样: 那边是每个前缀先取 default_candicate_page_limit 行再过滤，
+    这里是先过滤再每个前缀取 default_candicate_page_limit 行，所以权重排在后面的匹配的词也能查到
+    Return: false 表示不能这样查(使用 fanime-dictd、旧的词库、拼音里面有简拼)，调用者自己过滤
+  */
+  bool generate_with_fullhelpcode(const std::vector<std::string> &pinyin_list, const std::string &helpcode, std::vector<WordItem> &candidate_list);
   int create_word(std::string pinyin, std::string word);
   // 一次到顶
   int update_weight_by_word(std::string word);
@@ -37,62 +95,185 @@ e table
 
   std::string search_sentence_from_ime_engine(const std::string &user_pinyin);
 
+  /*
+    输入法进程里使用，config.txt 里面打开了 use_dictd 的话优先去 fanime-dictd 查询，守护进程不可用时退回到本地
+  */
   DictionaryUlPb();
+  /*
+    只在本地查询，fanime-dictd 自己以及各种工具使用
+  */
+  explicit DictionaryUlPb(const std::string &db_path);
   ~DictionaryUlPb();
 
+  /*
+    用户造词和调整权重写到 overlay 里面，而不是写到基础词库，查询时合并 overlay 的结果
+    fanime-dictd 在处理每个请求之前设置成对应用户的 overlay
+  */
+  void set_overlay(UserOverlay *user_overlay) { overlay = user_overlay; }
+  /*
+    force 为 false 时由 overlay 自己决定要不要写(见 UserOverlay::maybe_checkpoint)，空闲的时候定期调用
+  */
+  void checkpoint_overlay(bool force = false);
+
+  /*
+    重新打开 sqlite 词库和谷歌输入法引擎，可以在后台线程调用
+    Return: 新的词库是否打开成功，失败时继续使用旧的
+  */
+  bool reload();
+
+  // 每次查询最多取多少行，见 FetchTuner
+  void set_candidate_limit(int limit) { default_candicate_page_limit = limit; }
+
+  /*
+    generate 会执行的 sql 以及要不要再用正则过滤，只拼 sql 不查询，fanime-corebench 使用
+  */
+  std::pair<SqlQuery, bool> explain_sql(const std::string &code, std::vector<std::string> pinyin_list);
+  /*
+    在主线程调用: 把 codes 要执行的 sql 拼好交给 warm_up，使用 fanime-dictd 的时候返回空
+    拼 sql 要读 shard_tables，造词的时候主线程会往里面加表，所以不能放到后台线程
+  */
+  std::vector<SqlQuery> warm_up_queries(const std::vector<std::string> &codes);
+  /*
+    启动之后在后台线程调用: 在自己的只读连接上把 queries 查一遍，查询用到的词库页读进 page cache
+    不碰谷歌输入法引擎: 它只有一个全局的 decoder_mutex，前台的造句拿不到锁就会跳过
+    Return: 查到了多少行
+  */
+  size_t warm_up(const std::vector<SqlQuery> &queries);
+  // sqlite 的 page cache、overlay、分表的元数据、谷歌输入法引擎各占多少内存，见 MemoryStats
+  void memory_usage(MemoryStats &stats);
+  // 超过 memory_budget_mb 的时候调用，释放所有连接的 page cache，之后的查询再从 page cache / mmap 读回来
+  void release_memory();
+  // 写到 stats.txt 里面的: key_filter 挡掉了多少查询、误报了多少
+  void dump_stats(std::ostream &out);
+
 private:
   std::ifstream inputFile;
   std::string db_path;
-  sqlite3 *db = nullptr;
-  std::unordered_map<std::string, std::vector<std::string>> dict_map;
+  std::atomic<std::shared_ptr<DictSnapshot>> snapshot;
+  // 谷歌输入法引擎是全局状态，重新打开的时候不能同时查询
+  std::mutex decoder_mutex;
+  std::unique_ptr<DictClient> client;
+  UserOverlay *overlay = nullptr;
+  // 输入法进程自己的 overlay(user_overlay.txt)，user_overlay=0 时为空，用户学习直接写到基础词库；
+  // use_dictd=1 时是守护进程给这个用户用的 overlay_<uid>.txt，只在守护进程不可用的时候用
+  std::unique_ptr<UserOverlay> own_overlay;
+  // 正在用本地词库代替 fanime-dictd
+  bool falling_back = false;
+  // 用户学习都写到 overlay 的时候基础词库只读打开，还可以 mmap
+  bool read_only_base = false;
+  int64_t mmap_bytes = 0;
+  /*
+    本地词库和谷歌输入法引擎已经打开，reload 在热加载的线程里面读，fall_back 的时候 ensure_local 在主线程写
+    local_mutex 让 ensure_local 和 reload 不会同时打开它们；不用 decoder_mutex 是因为 open_decoder 自己要拿
+  */
+  std::atomic<bool> local_ready{false};
+  std::mutex local_mutex;
   std::string log_path;
-  std::unique_ptr<Log> logger;
+  std::shared_ptr<Log> logger;
   int default_candicate_page_limit = 80;
+  int typo_max_corrections = 3;
 
   static std::vector<std::string> alpha_list;
   static std::vector<std::string> single_han_list;
 
+  /*
+    打开本地的 sqlite 词库和谷歌输入法引擎，使用 fanime-dictd 时只有在守护进程不可用时才会打开
+  */
+  void ensure_local();
+  /*
+    fanime-dictd 不可用的时候改用本地词库，第一次切过去的时候先读入守护进程写的 overlay
+  */
+  void fall_back();
+  /*
+    包一下 DictClient 的返回值: 失败的时候 fall_back；
+    fallback 之后守护进程又能用了，就把本地学到的写到 overlay 文件里面给它合并
+  */
+  bool daemon_ok(bool ok);
+  std::vector<WordItem> generate_local(const std::string &code, std::vector<std::string> pinyin_list);
+  std::shared_ptr<CandidateCursor> generate_cursor_local(const std::string &code, std::vector<std::string> pinyin_list);
+  std::vector<WordItem> generate_for_creating_word_local(const std::string &code);
+  int create_word_local(std::string pinyin, std::string word);
+  int update_weight_by_word_local(std::string word);
+  std::string search_sentence_local(const std::string &user_pinyin);
+  void merge_overlay(std::vector<WordItem> &candidate_list, std::vector<WordItem> overlay_list);
+  int select_max_weight(sqlite3 *db, const SqlQuery &query);
+  std::shared_ptr<DictSnapshot> open_snapshot();
+  void open_decoder();
+
   /*
     generate list for single char
   */
   void generate_for_single_char(std::vector<WordItem> &candidate_list, std::string code);
-  void filter_key_value_list(std::vector<WordItem> &candidate_list, const std::vector<std::string> &pinyin_list, const std::vector<WordItem> &key_value_weight_list);
+  /*
+    需要过滤的查询只按简拼查，这里生成过滤 key 用的正则
+  */
+  std::string build_filter_regex(const std::vector<std::string> &pinyin_list);
   /*
     Return: list of value data in database table
   */
-  std::vector<std::string> select_data(std::string sql_str);
+  std::vector<std::string> select_data(sqlite3 *db, const SqlQuery &query);
   /*
     Return: list of complete item data in database table
   */
-  std::vector<WordItem> select_complete_data(std::string sql_str);
+  std::vector<WordItem> select_complete_data(sqlite3 *db, const SqlQuery &query);
+  /*
+    互相独立的几条查询，有 executor 的时候并发执行，否则在 snap.db 上依次执行
+    Return: 和 sqls 一一对应
+  */
+  std::vector<std::vector<WordItem>> select_each(const DictSnapshot &snap, const std::vector<SqlQuery> &sqls);
+  // 造词时每个前缀的 select_each，和 prefixes 一一对应
+  std::vector<std::vector<WordItem>> select_prefixes(const DictSnapshot &snap, const std::vector<std::string> &prefixes);
   /*
     Return: list of key and value data in database table
   */
-  std::vector<std::pair<std::string, std::string>> select_key_and_value(std::string sql_str);
+  std::vector<std::pair<std::string, std::string>> select_key_and_value(sqlite3 *db, const SqlQuery &query);
   /*
     Return:
   */
-  int check_data(std::string sql_str);
+  int check_data(sqlite3 *db, const SqlQuery &query);
   /*
     Return: list of complete item data in database table
   */
-  int insert_data(std::string sql_str);
+  int insert_data(sqlite3 *db, const SqlQuery &query);
 
   /*
     Return
    */
-  int update_data(std::string sql_str);
+  int update_data(sqlite3 *db, const SqlQuery &query);
   /*
     Return:
       - generated sql
       - whether needed to filter
   */
-  std::pair<std::string, bool> build_sql(const std::string &sp_str, std::vector<std::string> &pinyin_list);
-  std::string build_sql_for_creating_word(const std::string &sp_str);
-  std::string build_sql_for_checking_word(std::string key, std::string jp, std::string value);
-  std::string build_sql_for_inserting_word(std::string key, std::string jp, std::string value);
-  std::string build_sql_for_updating_word(std::string value);
-  std::string choose_tbl(const std::string &sp_str, size_t word_len);
+  std::pair<SqlQuery, bool> build_sql(const DictSnapshot &snap, const std::string &sp_str, std::vector<std::string> &pinyin_list);
+  // 造词时的一个前缀
+  SqlQuery build_sql_for_creating_word_prefix(const DictSnapshot &snap, const std::string &prefix);
+  SqlQuery build_sql_for_checking_word(const DictSnapshot &snap, std::string key, std::string jp, std::string value);
+  SqlQuery build_sql_for_inserting_word(const DictSnapshot &snap, std::string key, std::string jp, std::string value);
+  SqlQuery build_sql_for_updating_word(const DictSnapshot &snap, std::string value);
+  SqlQuery build_sql_for_max_weight(const DictSnapshot &snap, std::string key, std::string jp);
+  // 没有可以查的表的时候返回空
+  SqlQuery build_sql_for_fullhelpcode(const DictSnapshot &snap, const std::string &sp_str, const std::string &helpcode);
+  /*
+    sp_str 的第一个音节必须是完整的双拼，用于写入以及完整拼音的查询
+  */
+  std::string choose_tbl(const DictSnapshot &snap, const std::string &sp_str, size_t word_len);
+  /*
+    查询用的数据来源，第一个音节只有声母时可能是多张表的 union all
+  */
+  std::string choose_src(const DictSnapshot &snap, const std::string &sp_str, const std::vector<std::string> &pinyin_list);
+  void load_shard_scheme(DictSnapshot &snap);
+  void load_helpcode_columns(DictSnapshot &snap);
+  void load_key_filter(DictSnapshot &snap);
+  /*
+    按照 build_sql 的方式查询 sp_str，key_filter 说一定查不到的时候返回 false
+    一个简拼夹在中间的范围查询不是按某一个 key 或者 jp 查的，总是返回 true
+    probed: 是不是真的问过了 key_filter，查完一行都没有的话算误报
+  */
+  bool may_have_rows(const DictSnapshot &snap, const std::string &sp_str, const std::vector<std::string> &pinyin_list, bool &probed);
+  // 造词的一个前缀，按 key 查
+  bool may_have_key(const DictSnapshot &snap, const std::string &key, bool &probed);
+  void ensure_shard_table(DictSnapshot &snap, const std::string &table);
   bool do_validate(std::string key, std::string jp, std::string value);
 };
 #endif
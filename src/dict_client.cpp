@@ -0,0 +1,168 @@
+#include "dict_client.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// 连接断开之后，隔多久再去尝试连接守护进程
+const auto RETRY_INTERVAL = std::chrono::seconds(5);
+
+bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool read_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(fd, buf, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+} // namespace
+
+DictClient::DictClient(const std::string &socket_path, int timeout_ms) : socket_path(socket_path), timeout_ms(timeout_ms) {}
+
+DictClient::~DictClient() { disconnect(); }
+
+bool DictClient::ensure_connected() {
+  if (fd >= 0)
+    return true;
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_retry)
+    return false;
+  next_retry = now + RETRY_INTERVAL;
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+    return false;
+  std::strcpy(addr.sun_path, socket_path.c_str());
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  timeval tv{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    disconnect();
+    return false;
+  }
+  return true;
+}
+
+void DictClient::disconnect() {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool DictClient::call(const DictProtocol::Writer &request, std::string &reply) {
+  if (!ensure_connected())
+    return false;
+  std::string frame = request.frame();
+  uint32_t len = 0;
+  if (!write_all(fd, frame.data(), frame.size()) || !read_all(fd, reinterpret_cast<char *>(&len), sizeof(len)) || len == 0 || len > DictProtocol::MAX_FRAME_SIZE) {
+    disconnect();
+    return false;
+  }
+  reply.resize(len);
+  if (!read_all(fd, reply.data(), len)) {
+    disconnect();
+    return false;
+  }
+  if (static_cast<uint8_t>(reply[0]) != DictProtocol::STATUS_OK)
+    reply.clear();
+  else
+    reply.erase(0, 1);
+  return true;
+}
+
+bool DictClient::generate(const std::string &code, std::vector<DictProtocol::WordItem> &items) {
+  DictProtocol::Writer request;
+  request.put_u8(DictProtocol::OP_GENERATE);
+  request.put_string(code);
+  std::string reply;
+  if (!call(request, reply))
+    return false;
+  DictProtocol::Reader reader(reply);
+  if (reply.empty() || !reader.get_items(items))
+    items.clear();
+  return true;
+}
+
+bool DictClient::generate_for_creating_word(const std::string &code, std::vector<DictProtocol::WordItem> &items) {
+  DictProtocol::Writer request;
+  request.put_u8(DictProtocol::OP_GENERATE_FOR_CREATING_WORD);
+  request.put_string(code);
+  std::string reply;
+  if (!call(request, reply))
+    return false;
+  DictProtocol::Reader reader(reply);
+  if (reply.empty() || !reader.get_items(items))
+    items.clear();
+  return true;
+}
+
+bool DictClient::create_word(const std::string &pinyin, const std::string &word, int &status) {
+  DictProtocol::Writer request;
+  request.put_u8(DictProtocol::OP_CREATE_WORD);
+  request.put_string(pinyin);
+  request.put_string(word);
+  std::string reply;
+  if (!call(request, reply))
+    return false;
+  DictProtocol::Reader reader(reply);
+  int32_t res;
+  if (!reply.empty() && reader.get_i32(res))
+    status = res;
+  return true;
+}
+
+bool DictClient::update_weight_by_word(const std::string &pinyin, const std::string &word, int &status) {
+  DictProtocol::Writer request;
+  request.put_u8(DictProtocol::OP_UPDATE_WEIGHT);
+  request.put_string(pinyin);
+  request.put_string(word);
+  std::string reply;
+  if (!call(request, reply))
+    return false;
+  DictProtocol::Reader reader(reply);
+  int32_t res;
+  if (!reply.empty() && reader.get_i32(res))
+    status = res;
+  return true;
+}
+
+bool DictClient::search_sentence(const std::string &pinyin, std::string &sentence) {
+  DictProtocol::Writer request;
+  request.put_u8(DictProtocol::OP_SEARCH_SENTENCE);
+  request.put_string(pinyin);
+  std::string reply;
+  if (!call(request, reply))
+    return false;
+  DictProtocol::Reader reader(reply);
+  if (reply.empty() || !reader.get_string(sentence))
+    sentence.clear();
+  return true;
+}
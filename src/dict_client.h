@@ -0,0 +1,38 @@
+#ifndef FAN_DICT_CLIENT_H
+#define FAN_DICT_CLIENT_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "dict_protocol.h"
+
+/*
+  fanime-dictd 的客户端，只有守护进程不可用(连不上、读写出错、超时)的时候返回 false，由 DictionaryUlPb 退回到本地查询
+  守护进程回了 STATUS_ERROR(例如参数不合法)的时候返回 true，结果为空，status 不变；不能因为一个错误的请求就把整个词库加载到本地
+*/
+class DictClient {
+public:
+  DictClient(const std::string &socket_path, int timeout_ms);
+  ~DictClient();
+
+  bool generate(const std::string &code, std::vector<DictProtocol::WordItem> &items);
+  bool generate_for_creating_word(const std::string &code, std::vector<DictProtocol::WordItem> &items);
+  bool create_word(const std::string &pinyin, const std::string &word, int &status);
+  bool update_weight_by_word(const std::string &pinyin, const std::string &word, int &status);
+  bool search_sentence(const std::string &pinyin, std::string &sentence);
+  bool connected() const { return fd >= 0; }
+  // 尝试连接，失败之后在一段时间内不会重试
+  bool ensure_connected();
+
+private:
+  std::string socket_path;
+  int timeout_ms;
+  int fd = -1;
+  std::chrono::steady_clock::time_point next_retry;
+
+  // 回了 STATUS_ERROR 的时候 reply 为空
+  bool call(const DictProtocol::Writer &request, std::string &reply);
+  void disconnect();
+};
+
+#endif // FAN_DICT_CLIENT_H
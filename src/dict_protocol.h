@@ -0,0 +1,159 @@
+#ifndef FAN_DICT_PROTOCOL_H
+#define FAN_DICT_PROTOCOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/*
+  fanime-dictd 和输入法进程之间的二进制协议，只在本机的 Unix domain socket 上使用，所以直接用本机字节序
+
+  一帧: u32 payload 长度 | payload
+  请求 payload: u8 op | 参数
+  响应 payload: u8 status | 返回值
+
+  - string: u16 长度 + 字节
+  - WordItem 列表: u16 个数 + 每一项 (string key, string value, i32 weight)
+*/
+namespace DictProtocol {
+
+enum Op : uint8_t {
+  OP_GENERATE = 1,                   // string code -> items
+  OP_GENERATE_FOR_CREATING_WORD = 2, // string code -> items
+  OP_CREATE_WORD = 3,                // string pinyin, string word -> i32
+  OP_UPDATE_WEIGHT = 4,              // string pinyin, string word -> i32
+  OP_SEARCH_SENTENCE = 5,            // string pinyin -> string
+};
+
+enum Status : uint8_t {
+  STATUS_OK = 0,
+  STATUS_ERROR = 1,
+};
+
+static const uint32_t MAX_FRAME_SIZE = 1 << 20;
+
+using WordItem = std::tuple<std::string, std::string, int>;
+
+class Writer {
+public:
+  void put_u8(uint8_t v) { buf.push_back(static_cast<char>(v)); }
+  void put_u16(uint16_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void put_i32(int32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof(v)); }
+  void put_string(const std::string &s) {
+    uint16_t len = s.size() > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(s.size());
+    put_u16(len);
+    buf.append(s.data(), len);
+  }
+  void put_items(const std::vector<WordItem> &items) {
+    uint16_t cnt = items.size() > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(items.size());
+    put_u16(cnt);
+    for (uint16_t i = 0; i < cnt; i++) {
+      put_string(std::get<0>(items[i]));
+      put_string(std::get<1>(items[i]));
+      put_i32(std::get<2>(items[i]));
+    }
+  }
+  // 加上帧头
+  std::string frame() const {
+    uint32_t len = buf.size();
+    std::string res(reinterpret_cast<const char *>(&len), sizeof(len));
+    return res + buf;
+  }
+  const std::string &payload() const { return buf; }
+
+private:
+  std::string buf;
+};
+
+/*
+  所有的 get_* 在越界时返回 false，调用方据此认为对端出错
+*/
+class Reader {
+public:
+  Reader(const char *data, size_t size) : data(data), size(size) {}
+  explicit Reader(const std::string &s) : data(s.data()), size(s.size()) {}
+
+  bool get_u8(uint8_t &v) { return get_raw(&v, sizeof(v)); }
+  bool get_u16(uint16_t &v) { return get_raw(&v, sizeof(v)); }
+  bool get_i32(int32_t &v) { return get_raw(&v, sizeof(v)); }
+  bool get_string(std::string &s) {
+    uint16_t len;
+    if (!get_u16(len) || pos + len > size)
+      return false;
+    s.assign(data + pos, len);
+    pos += len;
+    return true;
+  }
+  bool get_items(std::vector<WordItem> &items) {
+    uint16_t cnt;
+    if (!get_u16(cnt))
+      return false;
+    items.reserve(items.size() + cnt);
+    for (uint16_t i = 0; i < cnt; i++) {
+      std::string key, value;
+      int32_t weight;
+      if (!get_string(key) || !get_string(value) || !get_i32(weight))
+        return false;
+      items.emplace_back(std::move(key), std::move(value), weight);
+    }
+    return true;
+  }
+
+private:
+  const char *data;
+  size_t size;
+  size_t pos = 0;
+
+  bool get_raw(void *out, size_t n) {
+    if (pos + n > size)
+      return false;
+    std::memcpy(out, data + pos, n);
+    pos += n;
+    return true;
+  }
+};
+
+/*
+  socket 所有用户都可以连接，请求里面的参数都不可信，fanime-dictd 对不合法的直接回 STATUS_ERROR，不去查询
+  用户自己能改的 overlay 文件也一样不可信，读的时候用同样的规则过滤
+*/
+// 和谷歌输入法引擎的 im_set_max_lens 一样
+static const size_t MAX_CODE_LEN = 64;
+static const size_t MAX_WORD_CHARS = 32;
+
+// 双拼的输入码只有小写字母
+inline bool valid_code(const std::string &code) { return !code.empty() && code.size() <= MAX_CODE_LEN && std::all_of(code.begin(), code.end(), [](char c) { return c >= 'a' && c <= 'z'; }); }
+
+// 造句用的全拼，音节之间用 ' 隔开，每个音节最多 6 个字母
+inline bool valid_sentence_pinyin(const std::string &pinyin) { return !pinyin.empty() && pinyin.size() <= MAX_CODE_LEN * 7 && std::all_of(pinyin.begin(), pinyin.end(), [](char c) { return (c >= 'a' && c <= 'z') || c == '\''; }); }
+
+inline bool is_han(uint32_t cp) { return cp == 0x3007 || (cp >= 0x3400 && cp <= 0x4dbf) || (cp >= 0x4e00 && cp <= 0x9fff) || (cp >= 0xf900 && cp <= 0xfaff) || (cp >= 0x20000 && cp <= 0x323af); }
+
+// 合法的 UTF-8(最短编码)，并且每个字都是汉字
+inline bool valid_word(const std::string &word) {
+  size_t i = 0, cnt = 0;
+  while (i < word.size()) {
+    unsigned char c = word[i];
+    size_t len = (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 0;
+    if (len == 0 || i + len > word.size())
+      return false;
+    uint32_t cp = len == 3 ? c & 0x0f : c & 0x07;
+    for (size_t j = 1; j < len; j++) {
+      unsigned char next = word[i + j];
+      if ((next & 0xc0) != 0x80)
+        return false;
+      cp = (cp << 6) | (next & 0x3f);
+    }
+    if (!is_han(cp) || ++cnt > MAX_WORD_CHARS)
+      return false;
+    i += len;
+  }
+  return cnt > 0;
+}
+
+} // namespace DictProtocol
+
+#endif // FAN_DICT_PROTOCOL_H
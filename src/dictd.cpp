@@ -0,0 +1,338 @@
+/*
+  fanime-dictd: 在多用户共享的机器上，让所有的 fcitx5 进程共用一份基础词库和谷歌输入法引擎
+
+  - 基础词库只读，所有用户共享同一份 sqlite 页缓存
+  - 每个用户的造词和调整过的权重放在各自的 overlay 文件里，用 SO_PEERCRED 拿到的 uid 区分
+  - 单线程 poll 循环，sqlite 和谷歌输入法引擎本来就不是为并发设计的
+  - 收到 SIGHUP 时重新打开词库、谷歌输入法引擎的词库和 pinyin.txt/helpcode.txt，不需要重启
+
+  Usage: fanime-dictd [--socket PATH] [--db PATH] [--overlay-dir DIR]
+*/
+#include "dict.h"
+#include "dict_protocol.h"
+#include "config.h"
+#include "user_overlay.h"
+#include "pinyin_utils.h"
+#include "./global.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Connection {
+  int fd;
+  uid_t uid;
+  gid_t gid;
+  std::string in_buf;
+  std::string out_buf;
+};
+
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t reload_requested = 0;
+
+void handle_signal(int) { running = 0; }
+void handle_reload_signal(int) { reload_requested = 1; }
+
+/*
+  pinyin.txt、helpcode.txt 和谷歌输入法引擎的词库一样，都从词库所在的目录读，启动和 SIGHUP 的时候都是
+  默认的 PinyinUtil::assets() 读的是运行守护进程的用户自己的数据目录，和 --db 不一定是同一个
+*/
+void load_assets_beside(const std::string &db_path) { PinyinUtil::publish_assets(PinyinUtil::load_assets(db_path.substr(0, db_path.rfind('/')))); }
+
+class DictServer {
+public:
+  DictServer(const std::string &db_path, const std::string &overlay_dir) : dict(db_path), db_path(db_path), overlay_dir(overlay_dir) {}
+
+  void reload() {
+    load_assets_beside(db_path);
+    if (!dict.reload())
+      std::cerr << "cannot reload " << db_path << ", keep using the old one" << std::endl;
+  }
+
+  std::string handle(uid_t uid, gid_t gid, const char *data, size_t size) {
+    DictProtocol::Reader reader(data, size);
+    DictProtocol::Writer reply;
+    uint8_t op;
+    std::string arg0, arg1;
+    if (!reader.get_u8(op)) {
+      reply.put_u8(DictProtocol::STATUS_ERROR);
+      return reply.frame();
+    }
+    dict.set_overlay(overlay_for(uid, gid));
+    switch (op) {
+    case DictProtocol::OP_GENERATE:
+      if (!reader.get_string(arg0) || !DictProtocol::valid_code(arg0))
+        break;
+      reply.put_u8(DictProtocol::STATUS_OK);
+      reply.put_items(dict.generate(arg0));
+      return reply.frame();
+    case DictProtocol::OP_GENERATE_FOR_CREATING_WORD:
+      if (!reader.get_string(arg0) || !DictProtocol::valid_code(arg0))
+        break;
+      reply.put_u8(DictProtocol::STATUS_OK);
+      reply.put_items(dict.generate_for_creating_word(arg0));
+      return reply.frame();
+    case DictProtocol::OP_CREATE_WORD:
+      if (!reader.get_string(arg0) || !reader.get_string(arg1) || !DictProtocol::valid_code(arg0) || !DictProtocol::valid_word(arg1))
+        break;
+      reply.put_u8(DictProtocol::STATUS_OK);
+      reply.put_i32(dict.create_word(arg0, arg1));
+      return reply.frame();
+    case DictProtocol::OP_UPDATE_WEIGHT:
+      if (!reader.get_string(arg0) || !reader.get_string(arg1) || !DictProtocol::valid_code(arg0) || !DictProtocol::valid_word(arg1))
+        break;
+      GlobalIME::pinyin = arg0;
+      reply.put_u8(DictProtocol::STATUS_OK);
+      reply.put_i32(dict.update_weight_by_word(arg1));
+      return reply.frame();
+    case DictProtocol::OP_SEARCH_SENTENCE:
+      if (!reader.get_string(arg0) || !DictProtocol::valid_sentence_pinyin(arg0))
+        break;
+      reply.put_u8(DictProtocol::STATUS_OK);
+      reply.put_string(dict.search_sentence_from_ime_engine(arg0));
+      return reply.frame();
+    default:
+      break;
+    }
+    DictProtocol::Writer error_reply;
+    error_reply.put_u8(DictProtocol::STATUS_ERROR);
+    return error_reply.frame();
+  }
+
+  // 每次 poll 回来调用，每个用户的 overlay 自己决定要不要写；退出的时候 UserOverlay 的析构函数写掉剩下的
+  void checkpoint() {
+    for (auto &[uid, overlay] : overlays)
+      overlay->maybe_checkpoint();
+  }
+
+private:
+  DictionaryUlPb dict;
+  std::string db_path;
+  std::string overlay_dir;
+  std::map<uid_t, std::unique_ptr<UserOverlay>> overlays;
+
+  /*
+    每个用户一个 <overlay_dir>/<uid>/ 目录，0700，属于这个用户，用户自己的输入法进程在守护进程不可用的时候也写这里
+    overlay_dir 本身只有守护进程能写(见 main)，用户没法事先在里面放符号链接；
+    用户目录里面的文件由 UserOverlay 以这个用户的身份读写
+  */
+  UserOverlay *overlay_for(uid_t uid, gid_t gid) {
+    auto &overlay = overlays[uid];
+    if (!overlay) {
+      std::string user_dir = overlay_dir + "/" + std::to_string(uid);
+      if (mkdir(user_dir.c_str(), 0700) != 0 && errno != EEXIST)
+        std::cerr << "cannot create " << user_dir << ": " << std::strerror(errno) << std::endl;
+      overlay = std::make_unique<UserOverlay>(user_dir + "/overlay.txt");
+      struct stat st;
+      if (geteuid() == 0 && lstat(user_dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (st.st_uid != uid)
+          lchown(user_dir.c_str(), uid, gid);
+        overlay->set_owner(uid, gid);
+      }
+      overlay->load();
+    } else {
+      // 守护进程不可用的时候用户自己的输入法进程会写同一个文件
+      overlay->refresh();
+    }
+    return overlay.get();
+  }
+};
+
+int listen_on(const std::string &socket_path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "socket path is too long: " << socket_path << std::endl;
+    return -1;
+  }
+  std::strcpy(addr.sun_path, socket_path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+  unlink(socket_path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    std::cerr << "cannot listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+    close(fd);
+    return -1;
+  }
+  // 所有用户都可以连接，用户之间靠 uid 隔开
+  chmod(socket_path.c_str(), 0666);
+  return fd;
+}
+
+/*
+  一个连接的 in_buf 最多放得下一个最大的请求帧
+  回复积压到 MAX_OUT_BUF 说明对端只发不收，直接断开，不让一个连接把守护进程的内存吃光
+*/
+const size_t MAX_IN_BUF = sizeof(uint32_t) + DictProtocol::MAX_FRAME_SIZE;
+const size_t MAX_OUT_BUF = 4 * DictProtocol::MAX_FRAME_SIZE;
+// 每次 poll 醒来每个连接最多 recv 这么多次，一个连接一直在发也不会饿死别的连接
+const int MAX_READS_PER_WAKEUP = 16;
+
+// 处理 in_buf 里面所有完整的帧。Return: false 表示对端出错，连接需要关闭
+bool process_frames(DictServer &server, Connection &conn) {
+  size_t pos = 0;
+  bool ok = true;
+  while (conn.in_buf.size() - pos >= sizeof(uint32_t)) {
+    uint32_t len;
+    std::memcpy(&len, conn.in_buf.data() + pos, sizeof(len));
+    // 帧头一收完整就检查，不等整帧
+    if (len > DictProtocol::MAX_FRAME_SIZE) {
+      ok = false;
+      break;
+    }
+    if (conn.in_buf.size() - pos - sizeof(len) < len)
+      break;
+    conn.out_buf += server.handle(conn.uid, conn.gid, conn.in_buf.data() + pos + sizeof(len), len);
+    pos += sizeof(len) + len;
+    if (conn.out_buf.size() > MAX_OUT_BUF) {
+      ok = false;
+      break;
+    }
+  }
+  conn.in_buf.erase(0, pos);
+  return ok;
+}
+
+// Return: false 表示连接需要关闭
+bool flush(Connection &conn) {
+  while (!conn.out_buf.empty()) {
+    ssize_t n = send(conn.fd, conn.out_buf.data(), conn.out_buf.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (n <= 0)
+      return false;
+    conn.out_buf.erase(0, n);
+  }
+  return true;
+}
+
+bool read_from(DictServer &server, Connection &conn) {
+  char buf[4096];
+  // 帧头检查过了，in_buf 满的时候里面一定有一个完整的帧，process_frames 之后就会腾出来
+  for (int reads = 0; reads < MAX_READS_PER_WAKEUP && conn.in_buf.size() < MAX_IN_BUF;) {
+    ssize_t n = recv(conn.fd, buf, std::min(sizeof(buf), MAX_IN_BUF - conn.in_buf.size()), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0)
+      return false;
+    reads++;
+    conn.in_buf.append(buf, n);
+    if (!process_frames(server, conn))
+      return false;
+  }
+  return flush(conn);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string socket_path = FanimeConfig::instance().get_string("dictd_socket", "/run/fanime-dictd/dictd.sock");
+  std::string db_path = FanimeConfig::data_dir() + "/cutted_flyciku_with_jp.db";
+  // 和输入法进程的 dictd_overlay_dir 要一样
+  std::string overlay_dir = FanimeConfig::instance().get_string("dictd_overlay_dir", "/var/lib/fanime-dictd");
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--socket")
+      socket_path = argv[i + 1];
+    else if (opt == "--db")
+      db_path = argv[i + 1];
+    else if (opt == "--overlay-dir")
+      overlay_dir = argv[i + 1];
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--socket PATH] [--db PATH] [--overlay-dir DIR]" << std::endl;
+      return 1;
+    }
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGHUP, handle_reload_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  // 用户的目录都建在这里面，别的用户能写的话可以在里面放好符号链接，让以 root 运行的守护进程去改别的文件
+  struct stat overlay_st;
+  if (stat(overlay_dir.c_str(), &overlay_st) != 0 || !S_ISDIR(overlay_st.st_mode) || (overlay_st.st_mode & (S_IWGRP | S_IWOTH)) || overlay_st.st_uid != geteuid()) {
+    std::cerr << "overlay dir must be a directory owned by the daemon and not writable by others: " << overlay_dir << std::endl;
+    return 1;
+  }
+
+  load_assets_beside(db_path);
+  DictServer server(db_path, overlay_dir);
+  int listen_fd = listen_on(socket_path);
+  if (listen_fd < 0)
+    return 1;
+
+  std::vector<Connection> connections;
+  while (running) {
+    if (reload_requested) {
+      reload_requested = 0;
+      server.reload();
+    }
+    std::vector<pollfd> fds;
+    fds.push_back({listen_fd, POLLIN, 0});
+    for (const auto &conn : connections)
+      fds.push_back({conn.fd, static_cast<short>(POLLIN | (conn.out_buf.empty() ? 0 : POLLOUT)), 0});
+    if (poll(fds.data(), fds.size(), 1000) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    server.checkpoint();
+    std::vector<Connection> alive;
+    for (size_t i = 0; i < connections.size(); i++) {
+      auto &conn = connections[i];
+      short revents = fds[i + 1].revents;
+      bool ok = true;
+      if (revents & (POLLERR | POLLNVAL))
+        ok = false;
+      if (ok && (revents & (POLLIN | POLLHUP)))
+        ok = read_from(server, conn);
+      if (ok && (revents & POLLOUT))
+        ok = flush(conn);
+      if (ok)
+        alive.push_back(std::move(conn));
+      else
+        close(conn.fd);
+    }
+    connections = std::move(alive);
+
+    if (fds[0].revents & POLLIN) {
+      while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0)
+          break;
+        ucred cred{};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+          close(fd);
+          continue;
+        }
+        connections.push_back(Connection{fd, cred.uid, cred.gid, "", ""});
+      }
+    }
+  }
+
+  for (const auto &conn : connections)
+    close(conn.fd);
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  return 0;
+}
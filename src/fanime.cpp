@@ -11,14 +11,28 @@
 #include <fcitx/userinterfacemanager.h>
 #include <punctuation_public.h>
 #include <quickphrase_public.h>
+#include <fstream>
 #include <string>
 #include <utility>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <array>
+#include <algorithm>
 #include <boost/locale.hpp>
 #include <boost/range/algorithm/count.hpp>
 #include <boost/circular_buffer.hpp>
 #include "./global.h"
+#include "config.h"
+#include "trace.h"
+#include "helpcode_kernel.h"
+#include <sys/inotify.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdio>
 
 #ifdef FAN_DEBUG
 #include <chrono>
@@ -27,6 +41,15 @@
 namespace {
 
 static const int CANDIDATE_SIZE = 8; // 候选框默认的 size，不许超过 9，不许小于 4
+static const size_t SENTENCE_CNT = 3;  // 词库里面直接查不到的时候最多给出几个整句
+
+// 数据目录下面的 next_word.bin，没有或者格式不对的时候返回 nullptr，只用用户层
+std::shared_ptr<const NextWordIndex> open_next_word_index() {
+  auto index = std::make_shared<NextWordIndex>();
+  if (!index->open(FanimeConfig::data_dir() + "/next_word.bin"))
+    return nullptr;
+  return index;
+}
 
 bool checkAlpha(const std::string &s) { return s.size() == 1 && isalpha(s[0]); }
 
@@ -41,13 +64,42 @@ template <class R, class... Args> struct function_traits<R (*)(Args...)> {
 
 template <class T> using second_argument_type = typename std::tuple_element<1, typename function_traits<T>::argument_types>::type;
 
+// keyEvent 有很多出口，在析构的时候触发 key_end，打开了 keystroke_trace 的话顺便记一条
+class KeyTraceScope {
+public:
+  KeyTraceScope(FanimeState &state, FanimeEngine *engine, const fcitx::KeyEvent &event);
+  ~KeyTraceScope();
+
+private:
+  FanimeState &state_;
+  FanimeEngine *engine_;
+  const fcitx::InputBuffer &buffer_;
+  uint64_t start_ns_;
+  KeystrokeTrace::KeyClass key_class_ = KeystrokeTrace::OTHER;
+};
+
 static const std::array<fcitx::Key, 11> selectionKeys = {fcitx::Key{FcitxKey_1}, fcitx::Key{FcitxKey_2}, fcitx::Key{FcitxKey_3}, fcitx::Key{FcitxKey_4}, fcitx::Key{FcitxKey_5}, fcitx::Key{FcitxKey_6}, fcitx::Key{FcitxKey_7}, fcitx::Key{FcitxKey_8}, fcitx::Key{FcitxKey_9}, fcitx::Key{FcitxKey_0}, fcitx::Key{FcitxKey_space}};
 
 class FanimeCandidateWord : public fcitx::CandidateWord {
 public:
-  FanimeCandidateWord(FanimeEngine *engine, std::string text) : engine_(engine) { setText(fcitx::Text(std::move(text))); }
+  FanimeCandidateWord(FanimeEngine *engine) : engine_(engine) {}
+
+  /*
+    候选框里面的位置换成另一个候选项，文字和原来一样的话不用重新构造 fcitx::Text
+    index 是在 current_candidates 里面的下标，用来统计用户一般在第几页上屏
+  */
+  void update(const std::string &text, size_t index) {
+    index_ = index;
+    if (text != text_) {
+      text_ = text;
+      setText(fcitx::Text(text_));
+    }
+  }
 
   void select(fcitx::InputContext *inputContext) const override {
+    FanimeEngine::fetch_tuner.record_commit(index_, FanimeEngine::pure_pinyin.size());
+    FanimeEngine::keystroke_trace.set_select(index_);
+    engine_->tune_fetching();
     std::string text_to_commit = text().toString();
     size_t start_pos = text_to_commit.find('(');
     if (start_pos != std::string::npos) {
@@ -63,7 +115,7 @@ public:
         FanimeEngine::seg_pinyin = FanimeEngine::seg_pinyin.substr(0, FanimeEngine::seg_pinyin.size() - 2);
       // 使用完整辅助码的情况下时的去尾
       if (engine_->get_use_fullhelpcode()) {
-        FanimeEngine::seg_pinyin = PinyinUtil::pinyin_segmentation(engine_->get_raw_pinyin());
+        FanimeEngine::seg_pinyin = state->query_context()->seg_pinyin_prefix(engine_->get_raw_pinyin().size());
         engine_->set_use_fullhelpcode(false);
       }
       std::string tmp_seg_pinyin = FanimeEngine::seg_pinyin;
@@ -86,37 +138,67 @@ public:
           FanimeEngine::seg_pinyin = FanimeEngine::seg_pinyin.substr(0, FanimeEngine::seg_pinyin.size() - 2);
         // 使用完整辅助码的情况下时的去尾
         if (engine_->get_use_fullhelpcode()) {
-          FanimeEngine::seg_pinyin = PinyinUtil::pinyin_segmentation(engine_->get_raw_pinyin());
+          FanimeEngine::seg_pinyin = state->query_context()->seg_pinyin_prefix(engine_->get_raw_pinyin().size());
           engine_->set_use_fullhelpcode(false);
         }
         std::string pure_pinyin = boost::algorithm::replace_all_copy(FanimeEngine::seg_pinyin, "'", "");
         FanimeEngine::word_pinyin += pure_pinyin;
         FanimeEngine::word_to_be_created += text_to_commit;
-        // insert to database
+        // insert to database，写之前清理缓存
+        state->drop_cursors();
+        uint64_t start_ns = FanimeTrace::now_ns(FanimeEngine::keystroke_trace.enabled());
         FanimeEngine::fan_dict.create_word(FanimeEngine::word_pinyin, FanimeEngine::word_to_be_created);
+        FanimeEngine::keystroke_trace.add_learn_ns(FanimeTrace::elapsed_ns(start_ns));
         inputContext->commitString(FanimeEngine::word_to_be_created);
-        // 清理缓存
-        FanimeEngine::cached_buffer.clear();
+        FanimeEngine::next_word.commit(FanimeEngine::word_to_be_created);
+        FanimeEngine::sentence_composer.reset();
       } else {
         inputContext->commitString(text_to_commit);
+        FanimeEngine::next_word.commit(text_to_commit);
+        FanimeEngine::warm_cache.record(FanimeEngine::pure_pinyin);
         if (GlobalIME::need_to_update_weight) {
           GlobalIME::pinyin = engine_->pure_pinyin;
           // FCITX_INFO() << "fany come here: " << GlobalIME::pinyin << " " << text_to_commit;
+          state->drop_cursors();
+          uint64_t start_ns = FanimeTrace::now_ns(FanimeEngine::keystroke_trace.enabled());
           FanimeEngine::fan_dict.update_weight_by_word(text_to_commit);
+          FanimeEngine::keystroke_trace.add_learn_ns(FanimeTrace::elapsed_ns(start_ns));
+          FanimeEngine::sentence_composer.reset();
         }
       }
       state->reset();
+      state->show_predictions();
     }
   }
 
+private:
+  FanimeEngine *engine_;
+  size_t index_ = 0;
+  std::string text_;
+};
+
+/*
+  预测的下一个词，选了之后接着预测再下一个
+*/
+class FanimePredictionWord : public fcitx::CandidateWord {
+public:
+  FanimePredictionWord(FanimeEngine *engine, std::string text) : engine_(engine) { setText(fcitx::Text(std::move(text))); }
+
+  void select(fcitx::InputContext *inputContext) const override {
+    std::string text_to_commit = text().toString();
+    inputContext->commitString(text_to_commit);
+    FanimeEngine::next_word.commit(text_to_commit);
+    inputContext->propertyFor(engine_->factory())->show_predictions();
+  }
+
 private:
   FanimeEngine *engine_;
 };
 
 class FanimeCandidateList : public fcitx::CandidateList, public fcitx::PageableCandidateList, public fcitx::CursorMovableCandidateList {
 public:
-  FanimeCandidateList(FanimeEngine *engine, fcitx::InputContext *ic, const std::string &code);
-  const fcitx::Text &label(int idx) const override { return labels_[idx]; }
+  FanimeCandidateList(FanimeEngine *engine, fcitx::InputContext *ic, std::shared_ptr<const QueryContext> ctx);
+  const fcitx::Text &label(int idx) const override { return labels()[idx]; }
   const fcitx::CandidateWord &candidate(int idx) const override { return *candidates_[idx]; }
   int size() const override { return cand_size_; }
   fcitx::CandidateLayoutHint layoutHint() const override { return fcitx::CandidateLayoutHint::NotSet; }
@@ -131,31 +213,80 @@ public:
   void nextCandidate() override { cursor_ = (cursor_ + 1) % CANDIDATE_SIZE; }
   int cursorIndex() const override { return cursor_; }
 
+  /*
+    generate 到期之后还没准备好的候选项，在 deadline_ns 之前接着做一点
+    已经显示的候选项不动，只补上当前页空着的位置，数字键选中的一直是原来那个
+    Return: 还有没有没做完的
+  */
+  bool progress(uint64_t deadline_ns);
+  bool pending() const { return FanimeEngine::candidate_ranker.has_pending() || pending_plain_ || pending_sentence_; }
+  /*
+    输入码变了之后原地重新生成，候选框里面一直是这一个列表，不用每次按键都重新构造列表和候选项
+    翻页、光标和没做完的都回到新构造的时候一样
+  */
+  void regenerate(std::shared_ptr<const QueryContext> ctx);
+  // 不再接着取还没准备好的普通查询，见 FanimeState::drop_cursors
+  void drop_pending() {
+    pending_plain_.reset();
+    pending_sentence_ = false;
+  }
+
+  // 辅助码注释的缓存，算在 stats.txt 里面；收缩内存的时候清空
+  static void memory_usage(MemoryStats &stats);
+  static void release_memory();
+
 private:
   FanimeEngine *engine_;
   fcitx::InputContext *ic_;
-  fcitx::Text labels_[CANDIDATE_SIZE];
   std::unique_ptr<FanimeCandidateWord> candidates_[CANDIDATE_SIZE];
+  std::shared_ptr<const QueryContext> ctx_;
   std::string code_;
   int cursor_ = 0;
   int cand_size_ = CANDIDATE_SIZE;
-  static std::unique_ptr<Log> logger_;
+  // 到期还没取到第一行的普通查询，取完发现是空的还要造句
+  std::shared_ptr<CandidateCursor> pending_plain_;
+  bool pending_sentence_ = false;
+  static std::shared_ptr<Log> logger_;
+  /*
+    词 -> 词加上辅助码注释，同一个词在前后几次按键、翻来翻去的时候都只算一次
+    辅助码表重新加载之后整个清空；超过 ANNOTATION_CACHE_SIZE 个也清空，不做 LRU
+  */
+  static constexpr size_t ANNOTATION_CACHE_SIZE = 4096;
+  static std::unordered_map<std::string, std::string> annotations_;
+  static std::weak_ptr<const PinyinAssets> annotated_assets_;
+
+  // "1. " 到 "8. "，所有的列表共用
+  static const std::array<fcitx::Text, CANDIDATE_SIZE> &labels();
+  static const std::string &annotate(const std::string &word);
+  // 把 current_candidates 里面第 page 页放到候选框里面
+  void show_page(int page);
 
   // generate words
   int generate();
-  void generate_from_cache();
+  std::vector<DictionaryUlPb::WordItem> compose_sentences(uint64_t deadline_ns);
+  void generate_from_cache(size_t cnt, uint64_t deadline_ns = 0);
   void generate_from_cache_for_pure_pinyin();
   void handle_fullhelpcode();
   void handle_fullhelpcode_during_creating();
-  bool will_trigger_singlehelpcode_mode();
+  bool handle_fullhelpcode_in_dict();
   void handle_singlehelpcode();
   void handle_singlehelpcode_during_creating();
 };
 
-FanimeCandidateList::FanimeCandidateList(FanimeEngine *engine, fcitx::InputContext *ic, const std::string &code) : engine_(engine), ic_(ic), code_(code) {
-  boost::algorithm::to_lower(code_);
+FanimeCandidateList::FanimeCandidateList(FanimeEngine *engine, fcitx::InputContext *ic, std::shared_ptr<const QueryContext> ctx) : engine_(engine), ic_(ic) {
   setPageable(this);
   setCursorMovable(this);
+  for (auto &candidate : candidates_)
+    candidate = std::make_unique<FanimeCandidateWord>(engine_);
+  regenerate(std::move(ctx));
+}
+
+void FanimeCandidateList::regenerate(std::shared_ptr<const QueryContext> ctx) {
+  ctx_ = std::move(ctx);
+  code_ = ctx_->code();
+  cursor_ = 0;
+  pending_plain_.reset();
+  pending_sentence_ = false;
   // #ifdef FAN_DEBUG
   auto start = std::chrono::high_resolution_clock::now();
   // #endif
@@ -163,15 +294,51 @@ FanimeCandidateList::FanimeCandidateList(FanimeEngine *engine, fcitx::InputConte
                            // #ifdef FAN_DEBUG
   auto end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double, std::milli> duration_ms = end - start;
+  FANIME_PROBE(generate, code_.c_str(), FanimeEngine::current_candidates.size(), static_cast<uint64_t>(duration_ms.count() * 1000000));
+  FanimeEngine::keystroke_trace.add_generate_ns(static_cast<uint64_t>(duration_ms.count() * 1000000));
   // FCITX_INFO() << "fany generate time: " << duration_ms.count();
   if (duration_ms.count() > 5)
-    logger_->info("time warning: " + std::to_string(duration_ms.count()) + " " + code);
+    logger_->info("time warning: " + std::to_string(duration_ms.count()) + " " + code_);
   // #endif
-  for (int i = 0; i < cand_size_; i++) { // generate indices of candidate window
-    const char label[2] = {static_cast<char>('0' + (i + 1)), '\0'};
-    labels_[i].append(label);
-    labels_[i].append(". ");
+}
+
+const std::array<fcitx::Text, CANDIDATE_SIZE> &FanimeCandidateList::labels() {
+  static const std::array<fcitx::Text, CANDIDATE_SIZE> labels = [] {
+    std::array<fcitx::Text, CANDIDATE_SIZE> res;
+    for (int i = 0; i < CANDIDATE_SIZE; i++) { // generate indices of candidate window
+      const char label[2] = {static_cast<char>('0' + (i + 1)), '\0'};
+      res[i].append(label);
+      res[i].append(". ");
+    }
+    return res;
+  }();
+  return labels;
+}
+
+std::unordered_map<std::string, std::string> FanimeCandidateList::annotations_;
+std::weak_ptr<const PinyinAssets> FanimeCandidateList::annotated_assets_;
+
+const std::string &FanimeCandidateList::annotate(const std::string &word) {
+  auto assets = PinyinUtil::assets();
+  if (annotated_assets_.lock() != assets || annotations_.size() >= ANNOTATION_CACHE_SIZE) {
+    annotations_.clear();
+    annotated_assets_ = assets;
   }
+  auto it = annotations_.find(word);
+  if (it == annotations_.end())
+    it = annotations_.emplace(word, word + PinyinUtil::compute_helpcodes(word)).first;
+  return it->second;
+}
+
+void FanimeCandidateList::memory_usage(MemoryStats &stats) {
+  size_t bytes = MemoryStats::table_bytes(annotations_);
+  for (const auto &[word, annotated] : annotations_)
+    bytes += MemoryStats::heap_bytes(word) + MemoryStats::heap_bytes(annotated);
+  stats.record("candidate_annotations", bytes, annotations_.size());
+}
+
+void FanimeCandidateList::release_memory() {
+  std::unordered_map<std::string, std::string>().swap(annotations_);
 }
 
 void FanimeCandidateList::prev() {
@@ -180,48 +347,34 @@ void FanimeCandidateList::prev() {
   }
   int cur_page = engine_->get_cand_page_idx() - 1;
   engine_->set_cand_page_idx(cur_page);
-  long unsigned int vec_size = FanimeEngine::current_candidates.size() - cur_page * CANDIDATE_SIZE > CANDIDATE_SIZE ? CANDIDATE_SIZE : FanimeEngine::current_candidates.size();
-  for (long unsigned int i = 0; i < CANDIDATE_SIZE; i++) {
-    if (i < vec_size) {
-      std::string cur_han_words = std::get<1>(FanimeEngine::current_candidates[i + cur_page * CANDIDATE_SIZE]);
-      candidates_[i] = std::make_unique<FanimeCandidateWord>(engine_, cur_han_words + PinyinUtil::compute_helpcodes(cur_han_words));
-    }
-  }
-  if (vec_size == 0) {
-    candidates_[0] = std::make_unique<FanimeCandidateWord>(engine_, "😍");
-  }
-  cand_size_ = vec_size;
-  for (int i = 0; i < cand_size_; i++) { // generate indices of candidate window
-    const char label[2] = {static_cast<char>('0' + (i + 1)), '\0'};
-    labels_[i].clear();
-    labels_[i].append(label);
-    labels_[i].append(". ");
-  }
+  show_page(cur_page);
 }
 
 void FanimeCandidateList::next() {
+  // 翻页之前把没做完的先做完，后面几页的顺序和不限时间的时候一样
+  while (progress(0))
+    ;
   if (!hasNext()) {
     return;
   }
   int cur_page = engine_->get_cand_page_idx() + 1;
   engine_->set_cand_page_idx(cur_page);
-  long unsigned int vec_size = FanimeEngine::current_candidates.size() - cur_page * CANDIDATE_SIZE > CANDIDATE_SIZE ? CANDIDATE_SIZE : FanimeEngine::current_candidates.size() - cur_page * CANDIDATE_SIZE;
-  for (long unsigned int i = 0; i < CANDIDATE_SIZE; i++) {
-    if (i < vec_size) {
-      std::string cur_han_words = std::get<1>(FanimeEngine::current_candidates[i + cur_page * CANDIDATE_SIZE]);
-      candidates_[i] = std::make_unique<FanimeCandidateWord>(engine_, cur_han_words + PinyinUtil::compute_helpcodes(cur_han_words));
-    }
-  }
+  FanimeEngine::fetch_tuner.record_page(cur_page);
+  // 这一页、预取的几页和再下一页的第一个
+  FanimeEngine::candidate_ranker.fill(FanimeEngine::current_candidates, (cur_page + 1 + FanimeEngine::fetch_tuner.prefetch_pages()) * CANDIDATE_SIZE + 1);
+  show_page(cur_page);
+}
+
+void FanimeCandidateList::show_page(int page) {
+  size_t start = static_cast<size_t>(page) * CANDIDATE_SIZE;
+  size_t total = FanimeEngine::current_candidates.size();
+  size_t vec_size = total > start ? std::min(total - start, static_cast<size_t>(CANDIDATE_SIZE)) : 0;
+  for (size_t i = 0; i < vec_size; i++)
+    candidates_[i]->update(annotate(std::get<1>(FanimeEngine::current_candidates[start + i])), start + i);
   if (vec_size == 0) {
-    candidates_[0] = std::make_unique<FanimeCandidateWord>(engine_, "😍");
+    candidates_[0]->update("😍", start);
   }
   cand_size_ = vec_size;
-  for (int i = 0; i < cand_size_; i++) { // generate indices of candidate window
-    const char label[2] = {static_cast<char>('0' + (i + 1)), '\0'};
-    labels_[i].clear();
-    labels_[i].append(label);
-    labels_[i].append(". ");
-  }
 }
 
 bool FanimeCandidateList::hasPrev() const {
@@ -232,6 +385,12 @@ bool FanimeCandidateList::hasPrev() const {
 }
 
 bool FanimeCandidateList::hasNext() const {
+  // 只看状态，合并在 generate、next 和 progress 里面做，它们都会合并到下一页的第一个，或者来源取完了，或者挂起了
+  // 还有没准备好的先当作有，准备好之后会再问一次
+  if (pending())
+    return true;
+  if (FanimeEngine::current_candidates.size() <= static_cast<size_t>(engine_->get_cand_page_idx() + 1) * CANDIDATE_SIZE && !FanimeEngine::candidate_ranker.exhausted())
+    return true;
   int total_page = static_cast<int>(FanimeEngine::current_candidates.size()) / CANDIDATE_SIZE;
   if (static_cast<int>(FanimeEngine::current_candidates.size()) % CANDIDATE_SIZE > 0 && FanimeEngine::current_candidates.size() > CANDIDATE_SIZE) {
     total_page += 1;
@@ -242,127 +401,192 @@ bool FanimeCandidateList::hasNext() const {
   return false;
 }
 
-std::unique_ptr<Log> FanimeCandidateList::logger_ = std::make_unique<Log>(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/app.log");
+std::shared_ptr<Log> FanimeCandidateList::logger_ = Log::shared(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/app.log");
 
 int FanimeCandidateList::generate() {
+  FanimeEngine::candidate_ranker.reset();
   FanimeEngine::pure_pinyin = code_;
-  FanimeEngine::seg_pinyin = PinyinUtil::pinyin_segmentation(code_);
-  FanimeEngine::supposed_han_cnt = boost::count(FanimeEngine::seg_pinyin, '\'') + 1;
-  FanimeEngine::can_create_word = PinyinUtil::is_all_complete_pinyin(FanimeEngine::pure_pinyin, FanimeEngine::seg_pinyin) || will_trigger_singlehelpcode_mode() || engine_->get_use_fullhelpcode();
+  FanimeEngine::seg_pinyin = ctx_->seg_pinyin();
+  FanimeEngine::supposed_han_cnt = ctx_->segments().size();
+  // 整句的输入码词库里面不会有，只造句；奇数码的时候最后一码也当作下一个字的声母，不当作辅助码
+  bool sentence_only = !FanimeEngine::during_creating && !engine_->get_use_fullhelpcode() && engine_->sentence_only(code_.size());
+  bool use_singlehelpcode = ctx_->helpcode_mode() == QueryContext::HelpcodeMode::Single && !sentence_only;
+  FanimeEngine::can_create_word = ctx_->all_complete() || use_singlehelpcode || engine_->get_use_fullhelpcode();
+  FetchTuner::Mode mode = FetchTuner::Mode::Plain;
+  if (FanimeEngine::during_creating)
+    mode = FetchTuner::Mode::Creating;
+  else if (engine_->get_use_fullhelpcode())
+    mode = FetchTuner::Mode::FullHelpcode;
+  else if (use_singlehelpcode)
+    mode = FetchTuner::Mode::SingleHelpcode;
+  FanimeEngine::fetch_tuner.begin(mode, code_.size());
 
   if (FanimeEngine::during_creating) {
     // 处理辅助码的情况，如果有辅助码，就筛一下
     if (engine_->get_use_fullhelpcode()) {
       handle_fullhelpcode_during_creating();
-      FanimeEngine::supposed_han_cnt = boost::count(PinyinUtil::pinyin_segmentation(engine_->get_raw_pinyin()), '\'') + 1;
-    } else if (will_trigger_singlehelpcode_mode()) {
+      FanimeEngine::supposed_han_cnt = ctx_->supposed_han_cnt();
+    } else if (use_singlehelpcode) {
       FanimeEngine::current_candidates = FanimeEngine::fan_dict.generate_for_creating_word(code_.substr(0, code_.size() - 1));
       handle_singlehelpcode_during_creating();
-      FanimeEngine::supposed_han_cnt -= 1;
+      FanimeEngine::supposed_han_cnt = ctx_->supposed_han_cnt();
     } else {
-      FanimeEngine::current_candidates = FanimeEngine::fan_dict.generate_for_creating_word(code_);
+      // 每个前缀一个来源，长的在前面
+      int tier = 0;
+      for (auto &cursor : FanimeEngine::fan_dict.generate_cursors_for_creating_word(code_))
+        FanimeEngine::candidate_ranker.add_source(tier++, std::move(cursor));
+      FanimeEngine::candidate_ranker.fill(FanimeEngine::current_candidates, FanimeEngine::fetch_tuner.first_fill(), engine_->generate_deadline_ns());
     }
   } else {
     if (engine_->get_use_fullhelpcode()) {
       handle_fullhelpcode();
-      FanimeEngine::supposed_han_cnt = boost::count(PinyinUtil::pinyin_segmentation(engine_->get_raw_pinyin()), '\'') + 1;
-    } else if (will_trigger_singlehelpcode_mode()) { // 默认的单码辅助
+      FanimeEngine::supposed_han_cnt = ctx_->supposed_han_cnt();
+    } else if (sentence_only) {
+      // 造句是增量的，缓存里面前缀的结果也只扫一遍缓存，每次按键的开销和总长度无关
+      uint64_t deadline_ns = engine_->generate_deadline_ns();
+      FanimeEngine::current_candidates = compose_sentences(deadline_ns);
+      generate_from_cache(FanimeEngine::fetch_tuner.first_fill(), deadline_ns);
+    } else if (use_singlehelpcode) { // 默认的单码辅助
       handle_singlehelpcode();
-      FanimeEngine::supposed_han_cnt -= 1;
+      FanimeEngine::supposed_han_cnt = ctx_->supposed_han_cnt();
     } else {
-      bool need_query = true;
-      for (auto item : FanimeEngine::cached_buffer) {
-        if (item.first == code_) {
-          FanimeEngine::current_candidates = item.second;
-          need_query = false;
-          break;
-        }
-      }
-      if (need_query) {
-        FanimeEngine::current_candidates = FanimeEngine::fan_dict.generate(code_);
-      }
-      if (FanimeEngine::current_candidates.size() > 0)
-        FanimeEngine::cached_buffer.push_front(std::make_pair(code_, FanimeEngine::current_candidates));
-      else {
-        std::string quanpin_seg_str = PinyinUtil::convert_seg_shuangpin_to_seg_complete_pinyin(PinyinUtil::pinyin_segmentation(code_));
-        // FCITX_INFO() << "quanpin google: " << quanpin_seg_str;
-        // FCITX_INFO() << "quanpin google: " << engine_->get_raw_pinyin();
-        std::string sentence = FanimeEngine::fan_dict.search_sentence_from_ime_engine(quanpin_seg_str); // 使用谷歌拼音输入法引擎进行造句
+      bool ready = true;
+      uint64_t deadline_ns = engine_->generate_deadline_ns();
+      auto cursor = FanimeEngine::lookup_plain(code_, ctx_->pinyin_list(), deadline_ns, &ready);
+      if (!ready) {
+        // 到期还不知道有没有结果(一般是要用正则过滤的简拼)，缓存里面更短的拼音的结果先显示出来
+        pending_plain_ = cursor;
+        FanimeEngine::candidate_ranker.add_source(0, cursor, true);
+      } else if (cursor) {
+        FanimeEngine::candidate_ranker.add_source(0, cursor);
+      } else if (deadline_ns && FanimeTrace::now_ns(true) > deadline_ns) {
+        // 造句也不便宜，已经到期了就放到下一次事件循环
         FanimeEngine::current_candidates.clear();
-        FanimeEngine::current_candidates.push_back(std::make_tuple(engine_->get_raw_pinyin(), sentence, 0));
+        pending_sentence_ = true;
+      } else {
+        FanimeEngine::current_candidates = compose_sentences(deadline_ns);
       }
-      generate_from_cache();
+      generate_from_cache(FanimeEngine::fetch_tuner.first_fill(), deadline_ns);
     }
   }
 
   engine_->set_cand_page_idx(0);
-  long unsigned int vec_size = FanimeEngine::current_candidates.size() > CANDIDATE_SIZE ? CANDIDATE_SIZE : FanimeEngine::current_candidates.size();
   // 放到实际的候选列表里面去
-  for (long unsigned int i = 0; i < CANDIDATE_SIZE; i++) {
-    if (i < vec_size) {
-      std::string cur_han_words = std::get<1>(FanimeEngine::current_candidates[i]);
-      candidates_[i] = std::make_unique<FanimeCandidateWord>(engine_, cur_han_words + PinyinUtil::compute_helpcodes(cur_han_words));
+  show_page(0);
+  if (cand_size_ == 0) {
+    candidates_[0]->update(code_, 0);
+    return 1;
+  }
+  return cand_size_;
+}
+
+/*
+  当前查询的结果(已经加到 candidate_ranker 里面的，或者 current_candidates)排在最前面，依次补上更短的拼音子串已经缓存的结果，用来给接下来的造词使用
+  只合并出前 cnt 个，剩下的留在 candidate_ranker 里面，翻页的时候再合并
+*/
+void FanimeCandidateList::generate_from_cache(size_t cnt, uint64_t deadline_ns) {
+  auto &ranker = FanimeEngine::candidate_ranker;
+  ranker.add_source(0, std::move(FanimeEngine::current_candidates));
+  FanimeEngine::current_candidates.clear();
+  // 除了最后一个音节，每个音节结束的位置都是一个子串
+  std::vector<bool> boundary(code_.size() + 1, false);
+  const auto &segments = ctx_->segments();
+  for (size_t i = 0; i + 1 < segments.size(); i++)
+    boundary[segments[i].start + segments[i].len] = true;
+  int tier = 1;
+  for (const auto &cursor : FanimeEngine::cached_prefixes(code_, boundary))
+    ranker.add_source(tier++, cursor);
+  ranker.fill(FanimeEngine::current_candidates, cnt, deadline_ns);
+}
+
+/*
+  词库里面直接查不到的时候造句: 先用本地词库，不行再用谷歌输入法引擎
+  打开了 typo_correction 的时候，改正一个字母之后查得到的词排在造句前面，有改正结果就不用谷歌输入法引擎兜底
+  到期的时候词图还没补完就什么都不返回，设置 pending_sentence_，progress 里面接着补
+*/
+std::vector<DictionaryUlPb::WordItem> FanimeCandidateList::compose_sentences(uint64_t deadline_ns) {
+  std::vector<DictionaryUlPb::WordItem> sentences;
+  if (FanimeEngine::sentence_composer.enabled()) {
+    // 用本地词库造句，词图跟着输入增量更新
+    uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(compose));
+    for (auto &sentence : FanimeEngine::sentence_composer.compose(FanimeEngine::fan_dict, ctx_->pinyin_list(), SENTENCE_CNT, deadline_ns))
+      sentences.push_back(std::make_tuple(engine_->get_raw_pinyin(), std::move(sentence), 0));
+    FANIME_PROBE(compose, code_.c_str(), sentences.empty() ? "" : std::get<1>(sentences[0]).c_str(), FanimeEngine::sentence_composer.last_lookups(), FanimeTrace::elapsed_ns(start_ns));
+    if (!FanimeEngine::sentence_composer.finished()) {
+      pending_sentence_ = true;
+      return sentences;
     }
   }
-  if (vec_size == 0) {
-    candidates_[0] = std::make_unique<FanimeCandidateWord>(engine_, code_);
-    return 1;
+  std::vector<DictionaryUlPb::WordItem> corrected = FanimeEngine::fan_dict.generate_corrections(code_, CANDIDATE_SIZE);
+  if (sentences.empty() && corrected.empty()) {
+    std::string quanpin_seg_str = PinyinUtil::convert_seg_shuangpin_to_seg_complete_pinyin(ctx_->seg_pinyin());
+    // FCITX_INFO() << "quanpin google: " << quanpin_seg_str;
+    // FCITX_INFO() << "quanpin google: " << engine_->get_raw_pinyin();
+    std::string sentence = FanimeEngine::fan_dict.search_sentence_from_ime_engine(quanpin_seg_str); // 使用谷歌拼音输入法引擎进行造句
+    sentences.push_back(std::make_tuple(engine_->get_raw_pinyin(), sentence, 0));
   }
-  return vec_size;
+  corrected.insert(corrected.end(), std::make_move_iterator(sentences.begin()), std::make_move_iterator(sentences.end()));
+  return corrected;
 }
 
-void FanimeCandidateList::generate_from_cache() {
-  // 如果没查到或者已经查到的也不合适，就补上拼音子串的结果用来给接下来的造词使用
-  std::string seg_pinyin = PinyinUtil::pinyin_segmentation(code_);
-  while (true) {
-    size_t pos = seg_pinyin.rfind('\'');
-    if (pos != std::string::npos) {
-      seg_pinyin = seg_pinyin.substr(0, pos);
-      std::string pure_pinyin = boost::algorithm::replace_all_copy(seg_pinyin, "'", "");
-      for (auto item : FanimeEngine::cached_buffer)
-        if (item.first == pure_pinyin) {
-          FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), item.second.begin(), item.second.end());
-          break;
-        }
-    } else
-      break;
+/*
+  一次只做一件事: 等普通查询的第一行、造句、接着取挂起的来源，做完就把当前页空着的位置补上
+  排在已经显示的候选项后面，所以造句的结果不一定在第一个
+*/
+bool FanimeCandidateList::progress(uint64_t deadline_ns) {
+  auto &ranker = FanimeEngine::candidate_ranker;
+  if (pending_plain_ && pending_plain_->fetch_before(1, deadline_ns)) {
+    pending_sentence_ = pending_plain_->rows().empty();
+    pending_plain_.reset();
+  } else if (pending_sentence_ && !pending_plain_) {
+    // 到期还没造完的话 compose_sentences 会再设置上
+    pending_sentence_ = false;
+    ranker.add_source(0, compose_sentences(deadline_ns));
   }
+  ranker.resume(deadline_ns);
+  int page = engine_->get_cand_page_idx();
+  ranker.fill(FanimeEngine::current_candidates, (page + 1) * CANDIDATE_SIZE + 1, deadline_ns);
+  if (static_cast<size_t>(cand_size_) < CANDIDATE_SIZE && FanimeEngine::current_candidates.size() > static_cast<size_t>(page * CANDIDATE_SIZE))
+    show_page(page);
+  return pending();
 }
 
 void FanimeCandidateList::generate_from_cache_for_pure_pinyin() {
   // 如果没查到或者已经查到的也不合适，就补上拼音子串的结果用来给接下来的造词使用
-  std::string seg_pinyin = PinyinUtil::pinyin_segmentation(code_);
-  std::string pinyin = code_;
-  while (pinyin.size()) {
-    for (auto item : FanimeEngine::cached_buffer) {
-      if (item.first == pinyin) {
-        FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), item.second.begin(), item.second.end());
-        break;
-      }
-    }
-    pinyin = pinyin.substr(0, pinyin.size() - 2);
+  std::vector<bool> boundary(code_.size() + 1, false);
+  for (size_t len = code_.size() % 2 ? 1 : 2; len <= code_.size(); len += 2)
+    boundary[len] = true;
+  for (const auto &cursor : FanimeEngine::cached_prefixes(code_, boundary)) {
+    const auto &rows = cursor->all();
+    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), rows.begin(), rows.end());
   }
 }
 
 void FanimeCandidateList::handle_fullhelpcode() {
-  std::vector<DictionaryUlPb::WordItem> tmp_cand_list;
-  bool need_to_query = true;
-  for (auto item : FanimeEngine::cached_buffer)
+  if (handle_fullhelpcode_in_dict())
+    return;
+  // 热加载时会替换辅助码表，这里拿到的这一份在函数返回前都有效
+  auto assets = PinyinUtil::assets();
+  const auto &helpcode_keymap = assets->helpcode_keymap;
+  std::shared_ptr<CandidateCursor> cursor;
+  for (const auto &item : FanimeEngine::cached_buffer)
     if (item.first == engine_->get_raw_pinyin()) {
-      tmp_cand_list = item.second;
-      need_to_query = false;
+      cursor = item.second;
       break;
     }
-  if (need_to_query)
-    tmp_cand_list = FanimeEngine::fan_dict.generate(engine_->get_raw_pinyin());
+  if (!cursor)
+    cursor = FanimeEngine::fan_dict.generate_cursor(engine_->get_raw_pinyin(), ctx_->pinyin_list_prefix(engine_->get_raw_pinyin().size()));
   /* 把辅助码过滤前的结果加入缓存，不能把辅助码带上 */
-  FanimeEngine::cached_buffer.push_front(std::make_pair(engine_->get_raw_pinyin(), tmp_cand_list));
+  FanimeEngine::cached_buffer.push_front(std::make_pair(engine_->get_raw_pinyin(), cursor));
+  // 辅助码要在全部结果里面筛
+  std::vector<DictionaryUlPb::WordItem> tmp_cand_list = cursor->all();
 
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(helpcode_filter));
   if (engine_->get_raw_pinyin().size() == 2) { // 单字
     for (const auto &cand : tmp_cand_list) {
       std::string cur_han_words = std::get<1>(cand);
       std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char] == code_.substr(2, 2)) {
+      if (helpcode_keymap.count(first_han_char) && helpcode_keymap.at(first_han_char) == code_.substr(2, 2)) {
         FanimeEngine::current_candidates.push_back(cand);
       }
     }
@@ -378,34 +602,53 @@ void FanimeCandidateList::handle_fullhelpcode() {
       size_t han_cnt = PinyinUtil::cnt_han_chars(cur_han_words);
       if (han_cnt == 1) {
         std::string first_han_char = cur_han_words;
-        if (PinyinUtil::helpcode_keymap.count(first_han_char)                            //
-            && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 2] //
-            && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
+        if (helpcode_keymap.count(first_han_char)                               //
+            && helpcode_keymap.at(first_han_char)[0] == code_[code_.size() - 2] //
+            && helpcode_keymap.at(first_han_char)[1] == code_[code_.size() - 1]) {
           FanimeEngine::current_candidates.push_back(cand);
         }
       } else {
         std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
         std::string last_han_char = PinyinUtil::get_last_han_char(cur_han_words);
-        if (PinyinUtil::helpcode_keymap.count(first_han_char)                            //
-            && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 2] //
-            && PinyinUtil::helpcode_keymap.count(last_han_char)                          //
-            && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
+        if (helpcode_keymap.count(first_han_char)                               //
+            && helpcode_keymap.at(first_han_char)[0] == code_[code_.size() - 2] //
+            && helpcode_keymap.count(last_han_char)                             //
+            && helpcode_keymap.at(last_han_char)[0] == code_[code_.size() - 1]) {
           FanimeEngine::current_candidates.push_back(cand);
         }
       }
     }
   }
+  FANIME_PROBE(helpcode_filter, code_.c_str(), tmp_cand_list.size(), FanimeEngine::current_candidates.size(), FanimeTrace::elapsed_ns(start_ns));
+}
+
+/*
+  词库里面有辅助码列的话，直接查出匹配的，不用先把所有的候选项都取出来再过滤
+*/
+bool FanimeCandidateList::handle_fullhelpcode_in_dict() {
+  if (code_.size() != engine_->get_raw_pinyin().size() + 2)
+    return false;
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(helpcode_filter));
+  if (!FanimeEngine::fan_dict.generate_with_fullhelpcode(ctx_->pinyin_list_prefix(engine_->get_raw_pinyin().size()), code_.substr(code_.size() - 2), FanimeEngine::current_candidates))
+    return false;
+  FANIME_PROBE(helpcode_filter, code_.c_str(), FanimeEngine::current_candidates.size(), FanimeEngine::current_candidates.size(), FanimeTrace::elapsed_ns(start_ns));
+  return true;
 }
 
 void FanimeCandidateList::handle_fullhelpcode_during_creating() {
+  if (handle_fullhelpcode_in_dict())
+    return;
+  auto assets = PinyinUtil::assets();
+  const auto &helpcode_keymap = assets->helpcode_keymap;
   std::vector<DictionaryUlPb::WordItem> tmp_cand_list_with_helpcode_trimed = FanimeEngine::fan_dict.generate_for_creating_word(engine_->get_raw_pinyin());
   FanimeEngine::current_candidates.clear();
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(helpcode_filter));
 
   if (engine_->get_raw_pinyin().size() == 2) { // 单字
     for (const auto &cand : tmp_cand_list_with_helpcode_trimed) {
       std::string cur_han_words = std::get<1>(cand);
       std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char] == code_.substr(2, 2)) {
+      if (helpcode_keymap.count(first_han_char) && helpcode_keymap.at(first_han_char) == code_.substr(2, 2)) {
         FanimeEngine::current_candidates.push_back(cand);
       }
     }
@@ -415,183 +658,179 @@ void FanimeCandidateList::handle_fullhelpcode_during_creating() {
       size_t han_cnt = PinyinUtil::cnt_han_chars(cur_han_words);
       if (han_cnt == 1) {
         std::string first_han_char = cur_han_words;
-        if (PinyinUtil::helpcode_keymap.count(first_han_char)                            //
-            && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 2] //
-            && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
+        if (helpcode_keymap.count(first_han_char)                               //
+            && helpcode_keymap.at(first_han_char)[0] == code_[code_.size() - 2] //
+            && helpcode_keymap.at(first_han_char)[1] == code_[code_.size() - 1]) {
           FanimeEngine::current_candidates.push_back(cand);
         }
       } else {
         std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
         std::string last_han_char = PinyinUtil::get_last_han_char(cur_han_words);
-        if (PinyinUtil::helpcode_keymap.count(first_han_char)                            //
-            && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 2] //
-            && PinyinUtil::helpcode_keymap.count(last_han_char)                          //
-            && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
+        if (helpcode_keymap.count(first_han_char)                               //
+            && helpcode_keymap.at(first_han_char)[0] == code_[code_.size() - 2] //
+            && helpcode_keymap.count(last_han_char)                             //
+            && helpcode_keymap.at(last_han_char)[0] == code_[code_.size() - 1]) {
           FanimeEngine::current_candidates.push_back(cand);
         }
       }
     }
   }
+  FANIME_PROBE(helpcode_filter, code_.c_str(), tmp_cand_list_with_helpcode_trimed.size(), FanimeEngine::current_candidates.size(), FanimeTrace::elapsed_ns(start_ns));
 }
 
-bool FanimeCandidateList::will_trigger_singlehelpcode_mode() {
-  // 至少三码才能三码
-  if (code_.size() < 3 || code_.size() % 2 != 1)
-    return false;
-  std::string seg_pinyin = PinyinUtil::pinyin_segmentation(code_);
-  bool really = true;
-  for (size_t i = 2; i < seg_pinyin.size(); i += 3) {
-    if (seg_pinyin[i] != '\'') {
-      really = false;
-      break;
-    }
-  }
-  return really;
-}
-
+/*
+  单码辅助不放到词库的辅助码列上去查: 它不是过滤，只是重新排序，
+  首字、尾字、其它字匹配的分几组排在前面，没匹配上的也还要排在最后，本来就要把这些行全部取出来；
+  而且这些行是不带辅助码的那个输入码的结果，上一个按键的时候已经在缓存里面了，不用再查词库
+*/
 void FanimeCandidateList::handle_singlehelpcode() {
+  auto assets = PinyinUtil::assets();
 #ifdef FAN_DEBUG
   auto start = std::chrono::high_resolution_clock::now();
 #endif
-  generate_from_cache();
+  generate_from_cache(SIZE_MAX);
 #ifdef FAN_DEBUG
   auto end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double, std::milli> duration_ms = end - start;
   FCITX_INFO() << "fany cache time: " << duration_ms.count();
 #endif
-  std::vector<DictionaryUlPb::WordItem> tmp_cand_list_with_helpcode_trimed = FanimeEngine::current_candidates;
+  std::vector<DictionaryUlPb::WordItem> tmp_cand_list_with_helpcode_trimed = std::move(FanimeEngine::current_candidates);
   FanimeEngine::current_candidates.clear();
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(helpcode_filter));
   size_t most_matched_han_cnt = (code_.size() - 1) / 2;
-  std::vector<DictionaryUlPb::WordItem> first_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> last_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> other_first_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> other_last_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> not_matched_list;
   // 1. 先根据辅助码进行筛选
-  for (const auto &cand : tmp_cand_list_with_helpcode_trimed) {
-    std::string cur_han_words = std::get<1>(cand);
-    size_t han_cnt = PinyinUtil::cnt_han_chars(cur_han_words);
-    std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
-    std::string last_han_char = PinyinUtil::get_last_han_char(cur_han_words);
-    if (han_cnt == most_matched_han_cnt) { // 拼音和汉字刚好是 2:1 的关系
-      /* 不管是单字还是多字，都先匹配第一个辅助码 */
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 1]) {
-        first_helpcode_matched_list.push_back(cand);
-      }
-      /* 单字，第二个辅助码匹配的也可以 */
-      else if (han_cnt == 1 && PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
-        last_helpcode_matched_list.push_back(cand);
-      }
-      /* 多字，使最后一个字的第一个辅助码也可以成为辅助码 */
-      else if (PinyinUtil::helpcode_keymap.count(last_han_char) && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
-        last_helpcode_matched_list.push_back(cand);
-      }
-    } else {
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 1]) {
-        other_first_helpcode_matched_list.push_back(cand);
-      }
-      /* 单字，第二个辅助码匹配的也可以 */
-      else if (han_cnt == 1 && PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
-        other_last_helpcode_matched_list.push_back(cand);
-      }
-      /* 多字，使最后一个字的第一个辅助码也可以成为辅助码 */
-      else if (PinyinUtil::helpcode_keymap.count(last_han_char) && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
-        other_last_helpcode_matched_list.push_back(cand);
-      } else {
-        not_matched_list.push_back(cand);
-      }
-    }
-  }
-  if (first_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), first_helpcode_matched_list.begin(), first_helpcode_matched_list.end());
-  if (last_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), last_helpcode_matched_list.begin(), last_helpcode_matched_list.end());
-  if (other_first_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), other_first_helpcode_matched_list.begin(), other_first_helpcode_matched_list.end());
-  if (other_last_helpcode_matched_list.size() > 0) {
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), other_last_helpcode_matched_list.begin(), other_last_helpcode_matched_list.end());
-  }
+  size_t cand_cnt = tmp_cand_list_with_helpcode_trimed.size();
+  std::array<std::vector<DictionaryUlPb::WordItem>, HelpcodeColumns::BUCKET_CNT> lists;
+  HelpcodeColumns::split(std::move(tmp_cand_list_with_helpcode_trimed), *assets, code_[code_.size() - 1], most_matched_han_cnt, lists);
+  FANIME_PROBE(helpcode_filter, code_.c_str(), cand_cnt, lists[HelpcodeColumns::FIRST].size() + lists[HelpcodeColumns::LAST].size() + lists[HelpcodeColumns::OTHER_FIRST].size() + lists[HelpcodeColumns::OTHER_LAST].size(), FanimeTrace::elapsed_ns(start_ns));
+  auto &ranker = FanimeEngine::candidate_ranker;
+  ranker.reset();
+  ranker.add_source(0, std::move(lists[HelpcodeColumns::FIRST]));
+  ranker.add_source(1, std::move(lists[HelpcodeColumns::LAST]));
+  ranker.add_source(2, std::move(lists[HelpcodeColumns::OTHER_FIRST]));
+  ranker.add_source(3, std::move(lists[HelpcodeColumns::OTHER_LAST]));
   // 2. 然后当作不完整的拼音来进行模糊查询得到的结果紧随着放在后面
 #ifdef FAN_DEBUG
   // start = std::chrono::high_resolution_clock::now();
 #endif
-  auto tmp_cand_list = FanimeEngine::fan_dict.generate(code_);
+  // 最后一个字母当作简拼的时候一般要用正则过滤，按需去取，到期还没取到的话前面几组先显示出来
+  auto tmp_cand_cursor = FanimeEngine::fan_dict.generate_cursor(code_, ctx_->pinyin_list());
 #ifdef FAN_DEBUG
   // end = std::chrono::high_resolution_clock::now();
   // duration_ms = end - start;
   // FCITX_INFO() << "fany dict generate time: " << duration_ms.count() << " " << code_;
 #endif
-  FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), tmp_cand_list.begin(), tmp_cand_list.end());
+  ranker.add_source(4, std::move(tmp_cand_cursor));
   // 3. 把第一步中筛掉的那些数据排在最后
-  if (not_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), not_matched_list.begin(), not_matched_list.end());
+  ranker.add_source(5, std::move(lists[HelpcodeColumns::NOT_MATCHED]));
+  ranker.fill(FanimeEngine::current_candidates, FanimeEngine::fetch_tuner.first_fill(), engine_->generate_deadline_ns());
 }
 
 void FanimeCandidateList::handle_singlehelpcode_during_creating() {
+  auto assets = PinyinUtil::assets();
   std::vector<DictionaryUlPb::WordItem> tmp_cand_list_with_helpcode_trimed = FanimeEngine::fan_dict.generate_for_creating_word(code_.substr(0, code_.size() - 1));
   FanimeEngine::current_candidates.clear();
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(helpcode_filter));
   size_t most_matched_han_cnt = (code_.size() - 1) / 2;
-  std::vector<DictionaryUlPb::WordItem> first_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> last_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> other_first_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> other_last_helpcode_matched_list;
-  std::vector<DictionaryUlPb::WordItem> not_matched_list;
   // 1. 先根据辅助码进行筛选
-  for (const auto &cand : tmp_cand_list_with_helpcode_trimed) {
-    std::string cur_han_words = std::get<1>(cand);
-    size_t han_cnt = PinyinUtil::cnt_han_chars(cur_han_words);
-    std::string first_han_char = PinyinUtil::get_first_han_char(cur_han_words);
-    std::string last_han_char = PinyinUtil::get_last_han_char(cur_han_words);
-    if (han_cnt == most_matched_han_cnt) {
-      /* 不管是单字还是多字，都先匹配第一个辅助码 */
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 1]) {
-        first_helpcode_matched_list.push_back(cand);
-      }
-      /* 单字，第二个辅助码匹配的也可以 */
-      else if (han_cnt == 1 && PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
-        last_helpcode_matched_list.push_back(cand);
-      }
-      /* 多字，使最后一个字也可以成为辅助码 */
-      else if (PinyinUtil::helpcode_keymap.count(last_han_char) && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
-        last_helpcode_matched_list.push_back(cand);
-      }
-    } else {
-      if (PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][0] == code_[code_.size() - 1]) {
-        other_first_helpcode_matched_list.push_back(cand);
-      }
-      /* 单字，第二个辅助码匹配的也可以 */
-      else if (han_cnt == 1 && PinyinUtil::helpcode_keymap.count(first_han_char) && PinyinUtil::helpcode_keymap[first_han_char][1] == code_[code_.size() - 1]) {
-        other_last_helpcode_matched_list.push_back(cand);
-      }
-      /* 多字，使最后一个字也可以成为辅助码 */
-      else if (PinyinUtil::helpcode_keymap.count(last_han_char) && PinyinUtil::helpcode_keymap[last_han_char][0] == code_[code_.size() - 1]) {
-        other_last_helpcode_matched_list.push_back(cand);
-      } else {
-        not_matched_list.push_back(cand);
-      }
-    }
-  }
-  if (first_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), first_helpcode_matched_list.begin(), first_helpcode_matched_list.end());
-  if (last_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), last_helpcode_matched_list.begin(), last_helpcode_matched_list.end());
-  if (other_first_helpcode_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), other_first_helpcode_matched_list.begin(), other_first_helpcode_matched_list.end());
-  if (other_last_helpcode_matched_list.size() > 0) {
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), other_last_helpcode_matched_list.begin(), other_last_helpcode_matched_list.end());
-  }
+  size_t cand_cnt = tmp_cand_list_with_helpcode_trimed.size();
+  std::array<std::vector<DictionaryUlPb::WordItem>, HelpcodeColumns::BUCKET_CNT> lists;
+  HelpcodeColumns::split(std::move(tmp_cand_list_with_helpcode_trimed), *assets, code_[code_.size() - 1], most_matched_han_cnt, lists);
+  FANIME_PROBE(helpcode_filter, code_.c_str(), cand_cnt, lists[HelpcodeColumns::FIRST].size() + lists[HelpcodeColumns::LAST].size() + lists[HelpcodeColumns::OTHER_FIRST].size() + lists[HelpcodeColumns::OTHER_LAST].size(), FanimeTrace::elapsed_ns(start_ns));
+  auto &ranker = FanimeEngine::candidate_ranker;
+  ranker.reset();
+  ranker.add_source(0, std::move(lists[HelpcodeColumns::FIRST]));
+  ranker.add_source(1, std::move(lists[HelpcodeColumns::LAST]));
+  ranker.add_source(2, std::move(lists[HelpcodeColumns::OTHER_FIRST]));
+  ranker.add_source(3, std::move(lists[HelpcodeColumns::OTHER_LAST]));
   // 2. 然后当作不完整的拼音来进行模糊查询得到的结果紧随着放在后面
-  auto tmp_cand_list = FanimeEngine::fan_dict.generate(code_);
-  FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), tmp_cand_list.begin(), tmp_cand_list.end());
+  ranker.add_source(4, FanimeEngine::fan_dict.generate_cursor(code_, ctx_->pinyin_list()));
   // 3. 把第一步中筛掉的那些数据排在最后
-  if (not_matched_list.size() > 0)
-    FanimeEngine::current_candidates.insert(FanimeEngine::current_candidates.end(), not_matched_list.begin(), not_matched_list.end());
+  ranker.add_source(5, std::move(lists[HelpcodeColumns::NOT_MATCHED]));
+  ranker.fill(FanimeEngine::current_candidates, FanimeEngine::fetch_tuner.first_fill(), engine_->generate_deadline_ns());
+}
+
+/*
+  按键的种类要看按键之前的状态: 有候选项的时候数字键是选词，没有的时候是标点
+*/
+KeyTraceScope::KeyTraceScope(FanimeState &state, FanimeEngine *engine, const fcitx::KeyEvent &event) : state_(state), engine_(engine), buffer_(state.getBuffer()), start_ns_(FanimeTrace::now_ns(FANIME_PROBE_ENABLED(key_end))) {
+  FANIME_PROBE(key_begin, buffer_.userInput().c_str(), static_cast<int>(event.key().sym()));
+  if (!FanimeEngine::keystroke_trace.enabled())
+    return;
+  FanimeEngine::keystroke_trace.begin_key();
+  const auto &key = event.key();
+  bool has_candidates = static_cast<bool>(state.getIc().inputPanel().candidateList());
+  if (has_candidates && (key.keyListIndex(selectionKeys) >= 0 || key.check(FcitxKey_comma) || key.check(FcitxKey_period)))
+    key_class_ = KeystrokeTrace::SELECT;
+  else if (has_candidates && (key.checkKeyList(engine->instance()->globalConfig().defaultPrevPage()) || key.check(FcitxKey_minus)))
+    key_class_ = KeystrokeTrace::PREV_PAGE;
+  else if (has_candidates && (key.checkKeyList(engine->instance()->globalConfig().defaultNextPage()) || key.check(FcitxKey_equal) || key.check(FcitxKey_Tab)))
+    key_class_ = KeystrokeTrace::NEXT_PAGE;
+  else if (checkAlpha(key.keySymToString(key.sym())))
+    key_class_ = std::isupper(static_cast<unsigned char>(key.keySymToString(key.sym())[0])) ? KeystrokeTrace::HELPCODE : KeystrokeTrace::LETTER;
+  else if (buffer_.empty())
+    key_class_ = KeystrokeTrace::PUNCTUATION;
+  else if (key.check(FcitxKey_BackSpace))
+    key_class_ = KeystrokeTrace::BACKSPACE;
+  else if (key.check(FcitxKey_Return))
+    key_class_ = KeystrokeTrace::RETURN;
+  else if (key.check(FcitxKey_Escape))
+    key_class_ = KeystrokeTrace::ESCAPE;
+}
+
+KeyTraceScope::~KeyTraceScope() {
+  FANIME_PROBE(key_end, buffer_.userInput().c_str(), FanimeTrace::elapsed_ns(start_ns_), FanimeEngine::current_candidates.size());
+  if (!FanimeEngine::keystroke_trace.enabled())
+    return;
+  // 只记输入码的结构，不记字母
+  uint8_t flags = 0;
+  size_t syllable_cnt = 0;
+  uint16_t initial_mask = 0;
+  if (!buffer_.empty()) {
+    const auto &ctx = state_.query_context();
+    if (ctx->helpcode_mode() == QueryContext::HelpcodeMode::Single) {
+      flags |= KeystrokeTrace::SINGLE_HELPCODE;
+      if (key_class_ == KeystrokeTrace::LETTER)
+        key_class_ = KeystrokeTrace::HELPCODE;
+    }
+    syllable_cnt = ctx->segments().size();
+    for (size_t i = 0; i < syllable_cnt && i < 16; i++)
+      if (ctx->segments()[i].kind == QueryContext::SyllableKind::Initial)
+        initial_mask |= static_cast<uint16_t>(1u << i);
+  }
+  if (FanimeEngine::during_creating)
+    flags |= KeystrokeTrace::CREATING;
+  if (engine_->get_use_fullhelpcode())
+    flags |= KeystrokeTrace::FULL_HELPCODE;
+  if (state_.update_pending())
+    flags |= KeystrokeTrace::DEFERRED;
+  auto *candidate_list = dynamic_cast<FanimeCandidateList *>(state_.getIc().inputPanel().candidateList().get());
+  if (candidate_list && candidate_list->pending())
+    flags |= KeystrokeTrace::PROGRESSIVE;
+  FanimeEngine::keystroke_trace.end_key(key_class_, flags, buffer_.size(), syllable_cnt, initial_mask, FanimeEngine::current_candidates.size());
 }
 
 } // namespace
 
-std::unique_ptr<::Log> FanimeState::logger = std::make_unique<Log>(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/app.log");
+std::shared_ptr<::Log> FanimeState::logger = Log::shared(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/app.log");
 void FanimeState::keyEvent(fcitx::KeyEvent &event) {
+  KeyTraceScope trace_scope(*this, engine_, event);
+  // 选词、翻页要对着最新的输入码的候选项，接着输入拼音或者退格的时候不用
+  if (!checkAlpha(event.key().keySymToString(event.key().sym())) && !event.key().check(FcitxKey_BackSpace))
+    flushUpdate();
+  if (predicting_) {
+    // 只有数字键是选预测的词，空格、标点、字母都和没有预测的时候一样
+    int idx = event.key().keyListIndex(selectionKeys);
+    auto candidateList = ic_->inputPanel().candidateList();
+    if (candidateList && idx >= 0 && idx < static_cast<int>(selectionKeys.size()) - 1 && idx < candidateList->size()) {
+      event.accept();
+      candidateList->candidate(idx).select(ic_);
+      return;
+    }
+    dismiss_predictions();
+    if (event.key().check(FcitxKey_Escape))
+      return event.filterAndAccept();
+  }
   // 如果候选列表不为空，那么，要么按下数字键 commit 候选项，要么翻页
   if (auto candidateList = ic_->inputPanel().candidateList()) {
     // 数字键的情况
@@ -609,10 +848,12 @@ void FanimeState::keyEvent(fcitx::KeyEvent &event) {
     if (idx >= 0 && idx < candidateList->size() + 1) {
       event.accept();
       candidateList->candidate(idx).select(ic_);
-      if (event.key().check(FcitxKey_comma))
-        ic_->commitString("，");
-      if (event.key().check(FcitxKey_period))
-        ic_->commitString("。");
+      if (event.key().check(FcitxKey_comma) || event.key().check(FcitxKey_period)) {
+        ic_->commitString(event.key().check(FcitxKey_comma) ? "，" : "。");
+        // 标点之后不再接着预测
+        FanimeEngine::next_word.break_context();
+        dismiss_predictions();
+      }
       return;
     }
     // 翻页键的情况，全局默认的是上箭头和下箭头
@@ -667,6 +908,7 @@ void FanimeState::keyEvent(fcitx::KeyEvent &event) {
         return;
       }
       */
+      FanimeEngine::next_word.break_context();
       if (!punc.empty()) {
         event.filterAndAccept();
         if (event.key().check(FcitxKey_grave)) {
@@ -694,11 +936,12 @@ void FanimeState::keyEvent(fcitx::KeyEvent &event) {
       if (!buffer_.size())
         // 清理状态
         reset();
-      updateUI();
+      scheduleUpdate();
       return event.filterAndAccept();
     }
     if (event.key().check(FcitxKey_Return)) {
       ic_->commitString(buffer_.userInput());
+      FanimeEngine::next_word.break_context();
       reset();
       return event.filterAndAccept();
     }
@@ -719,14 +962,14 @@ void FanimeState::keyEvent(fcitx::KeyEvent &event) {
 
   // Clear state first
   reset_fullhelpcode_mode();
-  std::string cur_code = buffer_.userInput();
-  // FCITX_INFO() << "cur_code: " << cur_code;
-  if (is_trigger_fullhelpcode_mode(cur_code)) {
+  auto ctx = query_context();
+  // FCITX_INFO() << "cur_code: " << ctx->input();
+  if (ctx->helpcode_mode() == QueryContext::HelpcodeMode::Full) {
     engine_->set_use_fullhelpcode(true);
-    engine_->set_raw_pinyin(cur_code.substr(0, cur_code.size() - 2));
+    engine_->set_raw_pinyin(ctx->raw_pinyin());
   }
 
-  updateUI();
+  scheduleUpdate();
   return event.filterAndAccept();
 }
 
@@ -737,24 +980,31 @@ void FanimeState::setCode(std::string code) {
 }
 
 void FanimeState::updateUI() {
+  settle_pending_update();
+  // 上一个候选列表没做完的不用再做了
+  if (progress_timer_)
+    progress_timer_->setEnabled(false);
   auto &inputPanel = ic_->inputPanel(); // also need to track the initialization of ic_
-  inputPanel.reset();
+  // 还在输入的时候候选框里面的列表原地重新生成，preedit 下面都会重新设置
+  auto *reused = buffer_.size() > 0 ? dynamic_cast<FanimeCandidateList *>(inputPanel.candidateList().get()) : nullptr;
+  if (!reused)
+    inputPanel.reset();
+  predicting_ = false;
   FanimeEngine::current_candidates.clear();
+  FanimeEngine::candidate_ranker.reset();
   if (buffer_.size() > 0) {
-    inputPanel.setCandidateList(std::make_unique<FanimeCandidateList>(engine_, ic_, buffer_.userInput()));
-    // 嵌在候选框中的 preedit
-    std::string aux("");
-    if (engine_->get_use_fullhelpcode())
-      aux = "🪓"; // 作个标记(辅助码的“斧”)
-    fcitx::Text preedit(FanimeEngine::word_to_be_created + PinyinUtil::pinyin_segmentation(buffer_.userInput()) + aux);
-    inputPanel.setPreedit(preedit);
-    // 嵌在具体的应用中的 preedit
-    // fcitx::Text clientPreedit(FanimeEngine::word_to_be_created + PinyinUtil::extract_preview(ic_->inputPanel().candidateList()->candidate(0).text().toString()), fcitx::TextFormatFlag::Underline);
-    fcitx::Text clientPreedit(buffer_.userInput(), fcitx::TextFormatFlag::Underline);
-    // TODO: 这里无论如何设置，在 chrome 中不生效，鉴定为 chrome 系列的问题，当然，firefox 也有类似的问题，不尽相同。以后有机会可以去看看能否提个 PR
-    // clientPreedit.setCursor(PinyinUtil::extract_preview(ic_->inputPanel().candidateList()->candidate(0).text().toString()).size());
-    clientPreedit.setCursor(0);
-    inputPanel.setClientPreedit(clientPreedit); // 嵌在应用程序中的
+    auto ctx = query_context();
+    FanimeCandidateList *candidate_list = reused;
+    if (reused) {
+      reused->regenerate(ctx);
+    } else {
+      auto new_list = std::make_unique<FanimeCandidateList>(engine_, ic_, ctx);
+      candidate_list = new_list.get();
+      inputPanel.setCandidateList(std::move(new_list));
+    }
+    if (candidate_list->pending())
+      scheduleProgress();
+    set_preedit(*ctx);
   } else {
     fcitx::Text clientPreedit(buffer_.userInput());
     inputPanel.setClientPreedit(clientPreedit); // 嵌在应用程序中的
@@ -763,7 +1013,122 @@ void FanimeState::updateUI() {
   ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
 }
 
+void FanimeState::set_preedit(const QueryContext &ctx) {
+  auto &inputPanel = ic_->inputPanel();
+  // 嵌在候选框中的 preedit
+  std::string aux("");
+  if (engine_->get_use_fullhelpcode())
+    aux = "🪓"; // 作个标记(辅助码的“斧”)
+  fcitx::Text preedit(FanimeEngine::word_to_be_created + ctx.seg_input() + aux);
+  inputPanel.setPreedit(preedit);
+  // 嵌在具体的应用中的 preedit
+  // fcitx::Text clientPreedit(FanimeEngine::word_to_be_created + PinyinUtil::extract_preview(ic_->inputPanel().candidateList()->candidate(0).text().toString()), fcitx::TextFormatFlag::Underline);
+  fcitx::Text clientPreedit(buffer_.userInput(), fcitx::TextFormatFlag::Underline);
+  // TODO: 这里无论如何设置，在 chrome 中不生效，鉴定为 chrome 系列的问题，当然，firefox 也有类似的问题，不尽相同。以后有机会可以去看看能否提个 PR
+  // clientPreedit.setCursor(PinyinUtil::extract_preview(ic_->inputPanel().candidateList()->candidate(0).text().toString()).size());
+  clientPreedit.setCursor(0);
+  inputPanel.setClientPreedit(clientPreedit); // 嵌在应用程序中的
+}
+
+/*
+  候选框里面先留着上一次的候选项，只更新 preedit
+  定时器在最后一次按键之后 coalesce_quiet_us 触发，但是不会晚于第一个推迟的按键之后 coalesce_deadline_us
+*/
+void FanimeState::scheduleUpdate() {
+  if (engine_->coalesce_quiet_us() == 0 || buffer_.empty()) {
+    updateUI();
+    return;
+  }
+  auto ctx = query_context();
+  uint64_t now = fcitx::now(CLOCK_MONOTONIC);
+  if (update_pending_)
+    skipped_ctxs_.push_back(std::move(pending_ctx_));
+  else
+    pending_since_ = now;
+  pending_ctx_ = ctx;
+  update_pending_ = true;
+  set_preedit(*ctx);
+  ic_->updatePreedit();
+  ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
+
+  uint64_t deadline = std::min(now + engine_->coalesce_quiet_us(), pending_since_ + engine_->coalesce_deadline_us());
+  if (!update_timer_) {
+    update_timer_ = engine_->instance()->eventLoop().addTimeEvent(CLOCK_MONOTONIC, deadline, 0, [this](fcitx::EventSourceTime *, uint64_t) {
+      flushUpdate();
+      return true;
+    });
+  } else {
+    update_timer_->setTime(deadline);
+  }
+  update_timer_->setOneShot();
+}
+
+void FanimeState::flushUpdate() {
+  if (update_pending_)
+    updateUI();
+}
+
+/*
+  时间是现在，下一次事件循环就会触发，排在已经到了的按键后面
+*/
+void FanimeState::scheduleProgress() {
+  uint64_t now = fcitx::now(CLOCK_MONOTONIC);
+  if (!progress_timer_) {
+    progress_timer_ = engine_->instance()->eventLoop().addTimeEvent(CLOCK_MONOTONIC, now, 0, [this](fcitx::EventSourceTime *, uint64_t) {
+      progress();
+      return true;
+    });
+  } else {
+    progress_timer_->setTime(now);
+  }
+  progress_timer_->setOneShot();
+}
+
+void FanimeState::progress() {
+  // 新的候选项马上就要生成了，旧的不用再补
+  if (update_pending_)
+    return;
+  auto *candidate_list = dynamic_cast<FanimeCandidateList *>(ic_->inputPanel().candidateList().get());
+  if (!candidate_list)
+    return;
+  uint64_t start_ns = FanimeTrace::now_ns(FanimeEngine::keystroke_trace.enabled());
+  if (candidate_list->progress(engine_->generate_deadline_ns()))
+    scheduleProgress();
+  FanimeEngine::keystroke_trace.add_generate_ns(FanimeTrace::elapsed_ns(start_ns));
+  ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
+}
+
+/*
+  被跳过的那些输入码要是每次都生成的话会进缓存，之后的造词会用到(见 generate_from_cache)，这里补上
+  只有查询，不合并、不显示，结果也是按需去取的
+*/
+void FanimeState::settle_pending_update() {
+  if (!update_pending_)
+    return;
+  for (const auto &ctx : skipped_ctxs_)
+    if (!FanimeEngine::during_creating && ctx->helpcode_mode() == QueryContext::HelpcodeMode::None && !engine_->sentence_only(ctx->code().size()))
+      FanimeEngine::lookup_plain(ctx->code(), ctx->pinyin_list());
+  drop_pending_update();
+}
+
+void FanimeState::drop_pending_update() {
+  update_pending_ = false;
+  if (update_timer_)
+    update_timer_->setEnabled(false);
+  skipped_ctxs_.clear();
+  pending_ctx_.reset();
+}
+
+void FanimeState::drop_cursors() {
+  FanimeEngine::cached_buffer.clear();
+  FanimeEngine::candidate_ranker.reset();
+  if (auto *candidate_list = dynamic_cast<FanimeCandidateList *>(ic_->inputPanel().candidateList().get()))
+    candidate_list->drop_pending();
+}
+
 void FanimeState::reset() {
+  // 缓存马上就要清掉了，跳过的输入码也不用再补
+  drop_pending_update();
   buffer_.clear();
   engine_->set_use_fullhelpcode(false);
   engine_->set_raw_pinyin("");
@@ -775,28 +1140,41 @@ void FanimeState::reset() {
   updateUI();
 }
 
-/**
- * @brief
- *
- * @return true
-     需要满足
-       - 最后一位的字符为大写
-       - 排除最后两位的字符之后的字符串是纯粹完整的双拼，即，能够无损地转成全拼
- * @return false
- */
-bool FanimeState::is_trigger_fullhelpcode_mode(std::string code) {
-  // 至少四码才能全码辅助
-  if (code.size() < 4 || !code.size() % 2)
-    return false;
-  if (!isupper(static_cast<unsigned char>(code.back()))) {
-    return false;
-  }
-  std::string pure_pinyin = code.substr(0, code.size() - 2);
-  std::string seg_pinyin = PinyinUtil::pinyin_segmentation(pure_pinyin);
-  if (!PinyinUtil::is_all_complete_pinyin(pure_pinyin, seg_pinyin)) {
-    return false;
+void FanimeState::show_predictions() {
+  if (!FanimeEngine::next_word.enabled() || !buffer_.empty())
+    return;
+  uint64_t start_ns = FanimeTrace::now_ns(FanimeEngine::keystroke_trace.enabled());
+  auto words = FanimeEngine::next_word.predict(CANDIDATE_SIZE);
+  FanimeEngine::keystroke_trace.add_generate_ns(FanimeTrace::elapsed_ns(start_ns));
+  if (words.empty()) {
+    dismiss_predictions();
+    return;
   }
-  return true;
+  auto candidate_list = std::make_unique<fcitx::CommonCandidateList>();
+  candidate_list->setPageSize(CANDIDATE_SIZE);
+  for (auto &word : words)
+    candidate_list->append<FanimePredictionWord>(engine_, std::move(word));
+  ic_->inputPanel().reset();
+  ic_->inputPanel().setCandidateList(std::move(candidate_list));
+  predicting_ = true;
+  ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
+}
+
+void FanimeState::dismiss_predictions() {
+  if (!predicting_)
+    return;
+  predicting_ = false;
+  ic_->inputPanel().reset();
+  ic_->updateUserInterface(fcitx::UserInterfaceComponent::InputPanel);
+}
+
+/*
+  缓冲区变了才重新构造，同一次按键里面多次调用拿到的是同一个
+*/
+const std::shared_ptr<const QueryContext> &FanimeState::query_context() {
+  if (!query_ctx_ || query_ctx_->input() != buffer_.userInput())
+    query_ctx_ = QueryContext::build(buffer_.userInput(), query_ctx_.get());
+  return query_ctx_;
 }
 
 bool FanimeState::reset_fullhelpcode_mode() {
@@ -811,8 +1189,15 @@ fcitx::InputBuffer &FanimeState::getBuffer() { return buffer_; }
 //~:D FanimeEngine
 //
 DictionaryUlPb FanimeEngine::fan_dict = DictionaryUlPb();
-boost::circular_buffer<std::pair<std::string, std::vector<DictionaryUlPb::WordItem>>> FanimeEngine::cached_buffer(20);
+boost::circular_buffer<std::pair<std::string, std::shared_ptr<CandidateCursor>>> FanimeEngine::cached_buffer(20);
 std::vector<DictionaryUlPb::WordItem> FanimeEngine::current_candidates;
+CandidateRanker FanimeEngine::candidate_ranker;
+FetchTuner FanimeEngine::fetch_tuner(CANDIDATE_SIZE);
+SentenceComposer FanimeEngine::sentence_composer;
+KeystrokeTrace FanimeEngine::keystroke_trace;
+NextWordPredictor FanimeEngine::next_word;
+WarmCache FanimeEngine::warm_cache;
+MemoryStats FanimeEngine::memory_stats;
 size_t FanimeEngine::current_page_idx;
 std::string FanimeEngine::pure_pinyin("");
 std::string FanimeEngine::seg_pinyin("");
@@ -822,7 +1207,288 @@ std::string FanimeEngine::word_to_be_created;
 std::string FanimeEngine::word_pinyin("");
 bool FanimeEngine::during_creating = false;
 
-FanimeEngine::FanimeEngine(fcitx::Instance *instance) : instance_(instance), factory_([this](fcitx::InputContext &ic) { return new FanimeState(this, &ic); }) { instance->inputContextManager().registerProperty("fanimeState", &factory_); }
+FanimeEngine::FanimeEngine(fcitx::Instance *instance) : instance_(instance), factory_([this](fcitx::InputContext &ic) { return new FanimeState(this, &ic); }) {
+  instance->inputContextManager().registerProperty("fanimeState", &factory_);
+  watch_data_dir();
+  fetch_tuner.load(FanimeConfig::data_dir() + "/fetch_tuner.txt");
+  apply_fetch_tuning();
+  auto &config = FanimeConfig::instance();
+  if (config.get_bool("coalesce_typing", true)) {
+    coalesce_quiet_us_ = static_cast<uint64_t>(std::max(0, config.get_int("coalesce_quiet_ms", 5))) * 1000;
+    coalesce_deadline_us_ = static_cast<uint64_t>(std::max(0, config.get_int("coalesce_deadline_ms", 50))) * 1000;
+  }
+  generate_budget_ns_ = static_cast<uint64_t>(std::max(0, config.get_int("generate_budget_ms", 3))) * 1000000;
+  sentence_only_len_ = static_cast<size_t>(std::max(0, config.get_int("sentence_only_len", 24)));
+  if (next_word.enabled()) {
+    next_word.set_index(open_next_word_index());
+    next_word.load_user(FanimeConfig::data_dir() + "/next_word_user.txt");
+  }
+  start_warm_up();
+}
+
+FanimeEngine::~FanimeEngine() {
+  data_dir_watcher_.reset();
+  reload_timer_.reset();
+  if (warm_thread_.joinable())
+    warm_thread_.join();
+  if (warm_save_thread_.joinable())
+    warm_save_thread_.join();
+  if (reload_thread_.joinable())
+    reload_thread_.join();
+  if (inotify_fd_ >= 0)
+    close(inotify_fd_);
+  save_fetch_tuning();
+  save_warm_cache(false);
+  fan_dict.checkpoint_overlay(true);
+  if (next_word.enabled())
+    next_word.save_user(FanimeConfig::data_dir() + "/next_word_user.txt");
+}
+
+uint64_t FanimeEngine::generate_deadline_ns() const { return generate_budget_ns_ ? FanimeTrace::now_ns(true) + generate_budget_ns_ : 0; }
+
+std::shared_ptr<CandidateCursor> FanimeEngine::lookup_plain(const std::string &code, const std::vector<std::string> &pinyin_list, uint64_t deadline_ns, bool *ready) {
+  std::shared_ptr<CandidateCursor> cursor;
+  for (const auto &item : cached_buffer) {
+    if (item.first == code) {
+      cursor = item.second;
+      break;
+    }
+  }
+  if (!cursor) {
+    // 这里只会取出第一行，剩下的等合并候选项的时候按需去取
+    cursor = fan_dict.generate_cursor(code, pinyin_list);
+  }
+  bool decided = cursor->fetch_before(1, deadline_ns);
+  if (ready)
+    *ready = decided;
+  // 还没取到的也放进缓存，最后是空的也没关系，下次用的时候还是返回 nullptr
+  if (decided && cursor->rows().empty())
+    return nullptr;
+  cached_buffer.push_front(std::make_pair(code, cursor));
+  return cursor;
+}
+
+/*
+  缓存里面每一项只看一次，不用对每个子串都把缓存扫一遍，输入码再长也只和缓存的大小有关
+  同一个子串有好几项的时候和 lookup_plain 一样用最新的那个
+*/
+std::vector<std::shared_ptr<CandidateCursor>> FanimeEngine::cached_prefixes(const std::string &code, const std::vector<bool> &boundary) {
+  std::vector<std::shared_ptr<CandidateCursor>> by_len(code.size() + 1);
+  for (const auto &item : cached_buffer) {
+    size_t len = item.first.size();
+    if (len <= code.size() && boundary[len] && !by_len[len] && code.compare(0, len, item.first) == 0)
+      by_len[len] = item.second;
+  }
+  std::vector<std::shared_ptr<CandidateCursor>> cursors;
+  for (size_t len = code.size(); len > 0; len--)
+    if (by_len[len])
+      cursors.push_back(std::move(by_len[len]));
+  return cursors;
+}
+
+void FanimeEngine::apply_fetch_tuning() {
+  if (cached_buffer.capacity() != fetch_tuner.cache_capacity())
+    cached_buffer.set_capacity(fetch_tuner.cache_capacity());
+  fan_dict.set_candidate_limit(fetch_tuner.fetch_limit());
+}
+
+/*
+  学到的参数和 stats.txt 一起写，stats.txt 是给人看的
+*/
+void FanimeEngine::save_fetch_tuning() {
+  fetch_tuner.save(FanimeConfig::data_dir() + "/fetch_tuner.txt");
+  std::ofstream stats_file(FanimeConfig::data_dir() + "/stats.txt", std::ios::trunc);
+  fetch_tuner.dump(stats_file);
+  fan_dict.dump_stats(stats_file);
+  collect_memory();
+  memory_stats.dump(stats_file);
+}
+
+void FanimeEngine::collect_memory() {
+  if (auto assets = PinyinUtil::assets()) {
+    size_t keymap_bytes = MemoryStats::table_bytes(assets->helpcode_keymap);
+    for (const auto &[han_char, helpcode] : assets->helpcode_keymap)
+      keymap_bytes += MemoryStats::heap_bytes(han_char) + MemoryStats::heap_bytes(helpcode);
+    memory_stats.record("helpcode_keymap", keymap_bytes, assets->helpcode_keymap.size());
+    memory_stats.record("helpcode_bmp", assets->helpcode_bmp.capacity() * sizeof(uint16_t), assets->helpcode_bmp.size());
+    size_t quanpin_bytes = MemoryStats::table_bytes(assets->quanpin_set);
+    for (const auto &quanpin : assets->quanpin_set)
+      quanpin_bytes += MemoryStats::heap_bytes(quanpin);
+    memory_stats.record("quanpin_set", quanpin_bytes, assets->quanpin_set.size());
+  }
+  size_t cached_bytes = cached_buffer.capacity() * sizeof(cached_buffer[0]);
+  for (const auto &[code, cursor] : cached_buffer)
+    cached_bytes += MemoryStats::heap_bytes(code) + (cursor ? cursor->memory_bytes() : 0);
+  memory_stats.record("cached_buffer", cached_bytes, cached_buffer.size());
+  memory_stats.record("current_candidates", MemoryStats::heap_bytes(current_candidates), current_candidates.size());
+  memory_stats.record("sentence_composer", sentence_composer.memory_bytes(), sentence_composer.cache_size());
+  FanimeCandidateList::memory_usage(memory_stats);
+  if (next_word.enabled()) {
+    memory_stats.record("next_word_user", next_word.user_memory_bytes(), next_word.user_size());
+    if (next_word.index())
+      memory_stats.record("next_word_index", next_word.index()->mapped_bytes(), next_word.index()->size(), true);
+  }
+  // std::ofstream 的缓冲区是 BUFSIZ
+  memory_stats.record("loggers", Log::shared_cnt() * BUFSIZ, Log::shared_cnt());
+  fan_dict.memory_usage(memory_stats);
+}
+
+/*
+  上屏的时候调用，这时候缓存里面的查询结果都可以丢掉，之后的按键再查一次；
+  sqlite 的 page cache 释放之后还能从 mmap 的页里面读回来，最后把 free 掉的堆还给系统 RSS 才会降下来
+*/
+void FanimeEngine::trim_memory() {
+  cached_buffer.clear();
+  current_candidates.shrink_to_fit();
+  sentence_composer.reset();
+  FanimeCandidateList::release_memory();
+  fan_dict.release_memory();
+  malloc_trim(0);
+  if (!memory_stats.record_trim())
+    Log::shared(FanimeConfig::data_dir() + "/app.log")->warning("memory trim left anon " + std::to_string(memory_stats.anon() >> 20) + " MB, over budget " + std::to_string(memory_stats.budget() >> 20) + " MB");
+}
+
+/*
+  上一次记下来的区间先 fadvise，内核异步读；再把最常用的输入码查一遍，B 树上真正走过的页也都进 page cache
+  后台线程降低优先级，不和按键抢 CPU；sql 在主线程拼好，之后 record 和造词加表都不会和这里冲突
+*/
+void FanimeEngine::start_warm_up() {
+  if (!warm_cache.enabled())
+    return;
+  warm_cache.load(FanimeConfig::data_dir() + "/warm_cache.txt");
+  warm_thread_ = std::thread([queries = fan_dict.warm_up_queries(warm_cache.hot_codes())]() {
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 10);
+    warm_cache.prefault(FanimeConfig::data_dir());
+    fan_dict.warm_up(queries);
+  });
+}
+
+/*
+  谷歌输入法引擎启动的时候把 dict_pinyin.dat 整个读到堆里面，不用记它的区间
+*/
+void FanimeEngine::save_warm_cache(bool background) {
+  if (!warm_cache.enabled())
+    return;
+  if (!background) {
+    warm_cache.save(FanimeConfig::data_dir() + "/warm_cache.txt", FanimeConfig::data_dir(), {"cutted_flyciku_with_jp.db"});
+    return;
+  }
+  if (warm_saving_)
+    return;
+  if (warm_save_thread_.joinable())
+    warm_save_thread_.join();
+  warm_saving_ = true;
+  // record 只在主线程，拷一份之后后台线程不用加锁
+  warm_save_thread_ = std::thread([this, snapshot = warm_cache]() {
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 10);
+    snapshot.save(FanimeConfig::data_dir() + "/warm_cache.txt", FanimeConfig::data_dir(), {"cutted_flyciku_with_jp.db"});
+    warm_saving_ = false;
+  });
+}
+
+void FanimeEngine::tune_fetching() {
+  apply_fetch_tuning();
+  fan_dict.checkpoint_overlay();
+  if (memory_stats.has_budget() && memory_stats.should_trim())
+    trim_memory();
+  if (fetch_tuner.commit_cnt() % 100 == 0) {
+    save_fetch_tuning();
+    save_warm_cache(true);
+    if (next_word.enabled())
+      next_word.save_user(FanimeConfig::data_dir() + "/next_word_user.txt");
+    keystroke_trace.flush();
+  }
+}
+
+/*
+  只关心写完(IN_CLOSE_WRITE)和改名进来(IN_MOVED_TO)的文件，
+  所以替换词库的时候最好先写到同一目录下的临时文件，再 mv 过去，这样不会读到写了一半的文件
+*/
+void FanimeEngine::watch_data_dir() {
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0)
+    return;
+  if (inotify_add_watch(inotify_fd_, FanimeConfig::data_dir().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+    return;
+  }
+  data_dir_watcher_ = instance_->eventLoop().addIOEvent(inotify_fd_, fcitx::IOEventFlag::In, [this](fcitx::EventSourceIO *, int, fcitx::IOEventFlags) {
+    on_data_dir_event();
+    return true;
+  });
+}
+
+void FanimeEngine::on_data_dir_event() {
+  alignas(inotify_event) char buf[4096];
+  bool changed = false;
+  ssize_t len;
+  while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+    for (char *ptr = buf; ptr < buf + len;) {
+      auto *event = reinterpret_cast<inotify_event *>(ptr);
+      std::string name = event->len ? event->name : "";
+      if (name == "cutted_flyciku_with_jp.db" || name == "dict_pinyin.dat" || name == "typo_index.bin") {
+        pending_dict_reload_ = true;
+        changed = true;
+      } else if (name == "pinyin.txt" || name == "helpcode.txt") {
+        pending_assets_reload_ = true;
+        changed = true;
+      } else if (name == "next_word.bin" && next_word.enabled()) {
+        pending_next_word_reload_ = true;
+        changed = true;
+      }
+      ptr += sizeof(inotify_event) + event->len;
+    }
+  }
+  if (!changed)
+    return;
+  // 拷贝文件的时候可能连续来好几个事件，等安静下来再加载
+  uint64_t deadline = fcitx::now(CLOCK_MONOTONIC) + 500000;
+  if (reload_timer_) {
+    reload_timer_->setTime(deadline);
+    reload_timer_->setOneShot();
+    return;
+  }
+  reload_timer_ = instance_->eventLoop().addTimeEvent(CLOCK_MONOTONIC, deadline, 0, [this](fcitx::EventSourceTime *timer, uint64_t) {
+    if (reloading_) {
+      // 上一次还没加载完，稍后再试
+      timer->setTime(fcitx::now(CLOCK_MONOTONIC) + 500000);
+      timer->setOneShot();
+      return true;
+    }
+    start_reload();
+    return true;
+  });
+}
+
+/*
+  加载在后台线程里面完成，新的数据准备好之后原子地替换掉旧的，正在进行的查询继续使用旧的
+  缓存的候选项可能来自旧的词库，所以替换完成之后回到主线程清掉缓存
+*/
+void FanimeEngine::start_reload() {
+  if (reload_thread_.joinable())
+    reload_thread_.join();
+  bool dict_changed = pending_dict_reload_;
+  bool assets_changed = pending_assets_reload_;
+  bool next_word_changed = pending_next_word_reload_;
+  pending_dict_reload_ = pending_assets_reload_ = pending_next_word_reload_ = false;
+  reloading_ = true;
+  reload_thread_ = std::thread([this, dict_changed, assets_changed, next_word_changed]() {
+    if (assets_changed)
+      PinyinUtil::publish_assets(PinyinUtil::load_assets(FanimeConfig::data_dir()));
+    if (dict_changed)
+      fan_dict.reload();
+    // next_word 只在主线程用，打开之后回到主线程再换
+    std::shared_ptr<const NextWordIndex> next_word_index = next_word_changed ? open_next_word_index() : nullptr;
+    instance_->eventDispatcher().schedule([next_word_changed, next_word_index]() {
+      FanimeEngine::cached_buffer.clear();
+      FanimeEngine::sentence_composer.reset();
+      if (next_word_changed)
+        FanimeEngine::next_word.set_index(next_word_index);
+    });
+    reloading_ = false;
+  });
+}
 
 void FanimeEngine::activate(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) {
   FCITX_UNUSED(entry);
@@ -862,6 +1528,8 @@ void FanimeEngine::keyEvent(const fcitx::InputMethodEntry &entry, fcitx::KeyEven
 
 void FanimeEngine::reset(const fcitx::InputMethodEntry &, fcitx::InputContextEvent &event) {
   auto *state = event.inputContext()->propertyFor(&factory_);
+  // 换了窗口或者输入框，前面上屏的词不再是上下文
+  next_word.break_context();
   set_use_fullhelpcode(false);
   set_raw_pinyin("");
   state->reset();
@@ -9,9 +9,20 @@
 #include <fcitx/inputmethodengine.h>
 #include <fcitx/inputpanel.h>
 #include <fcitx/instance.h>
+#include <fcitx-utils/event.h>
 #include <boost/circular_buffer.hpp>
 #include <iconv.h>
+#include <atomic>
+#include <thread>
 #include "dict.h"
+#include "query_context.h"
+#include "candidate_ranker.h"
+#include "fetch_tuner.h"
+#include "keystroke_trace.h"
+#include "sentence_composer.h"
+#include "next_word.h"
+#include "warm_cache.h"
+#include "memory_stats.h"
 #include "log.h"
 
 class FanimeEngine;
@@ -23,27 +34,83 @@ public:
   void keyEvent(fcitx::KeyEvent &keyEvent);
   void setCode(std::string code);
   void updateUI();
+  /*
+    输入拼音字母和退格的时候调用: preedit 马上更新，候选项推迟到停下来再生成，见 FanimeEngine::coalesce_quiet_us
+    中间被跳过的输入码只把查询结果放进缓存，最后的候选项和每次都生成的时候一样
+  */
+  void scheduleUpdate();
+  // 有推迟的候选项的话马上生成
+  void flushUpdate();
+  bool update_pending() const { return update_pending_; }
+  /*
+    候选项在 FanimeEngine::generate_budget_ns 之内没有全部准备好的时候调用
+    之后每次事件循环空下来做一点，做完一点就原地更新候选框，见 FanimeCandidateList::progress
+  */
+  void scheduleProgress();
   // 清除 buffer，更新 UI
   void reset();
+  /*
+    放掉缓存和候选列表里面所有的 CandidateCursor，它们的 sqlite statement 还开着；
+    user_overlay=0 的时候造词、调整权重直接写基础词库，同一个连接上边读边写结果没有定义，写之前调用
+    上屏之后反正马上要 reset，所以不管写到哪里都先放掉
+  */
+  void drop_cursors();
+  /*
+    上屏之后、buffer 为空的时候调用，候选框里面显示 FanimeEngine::next_word 预测的下一个词
+    数字键选择(选了之后接着预测)，别的键先关掉候选框，再和平常一样处理
+  */
+  void show_predictions();
   fcitx::InputContext &getIc();
   fcitx::InputBuffer &getBuffer();
+  // 当前输入码的 QueryContext，输入码变了之后从上一次的增量构造
+  const std::shared_ptr<const QueryContext> &query_context();
 
 private:
   FanimeEngine *engine_;
   fcitx::InputContext *ic_;
   fcitx::InputBuffer buffer_{{fcitx::InputBufferOption::AsciiOnly, fcitx::InputBufferOption::FixedCursor}};
   bool use_fullhelpcode_ = false;
-  static std::unique_ptr<::Log> logger;
-  
-  bool is_trigger_fullhelpcode_mode(std::string code);
+  std::shared_ptr<const QueryContext> query_ctx_;
+  static std::shared_ptr<::Log> logger;
+  // 推迟的候选项生成
+  std::unique_ptr<fcitx::EventSourceTime> update_timer_;
+  bool update_pending_ = false;
+  uint64_t pending_since_ = 0;
+  std::shared_ptr<const QueryContext> pending_ctx_;
+  std::vector<std::shared_ptr<const QueryContext>> skipped_ctxs_;
+  // 还没准备好的候选项
+  std::unique_ptr<fcitx::EventSourceTime> progress_timer_;
+  // 候选框里面是预测的下一个词
+  bool predicting_ = false;
+
   bool reset_fullhelpcode_mode();
+  void set_preedit(const QueryContext &ctx);
+  void settle_pending_update();
+  void drop_pending_update();
+  void progress();
+  void dismiss_predictions();
 };
 
 class FanimeEngine : public fcitx::InputMethodEngineV2 {
 public:
   static DictionaryUlPb fan_dict;
-  static boost::circular_buffer<std::pair<std::string, std::vector<DictionaryUlPb::WordItem>>> cached_buffer;
+  // 每个 code 的查询结果，翻页或者之后的按键用到了才接着从词库里面取
+  static boost::circular_buffer<std::pair<std::string, std::shared_ptr<CandidateCursor>>> cached_buffer;
   static std::vector<DictionaryUlPb::WordItem> current_candidates;
+  // current_candidates 后面还没有合并出来的候选项
+  static CandidateRanker candidate_ranker;
+  // 根据翻页和上屏的统计调整取多少候选项、缓存多大
+  static FetchTuner fetch_tuner;
+  // 词库里面直接查不到的时候用来造句
+  static SentenceComposer sentence_composer;
+  // 打开 keystroke_trace 之后记录每个按键的耗时
+  static KeystrokeTrace keystroke_trace;
+  // 打开 next_word_prediction 之后，上屏之后预测下一个词
+  static NextWordPredictor next_word;
+  // 最常上屏的输入码和词库常驻内存的区间，下次启动的时候预读
+  static WarmCache warm_cache;
+  // 各个子系统占了多少内存，和 fetch_tuner 一起写到 stats.txt；设置了 memory_budget_mb 的话超过之后收缩
+  static MemoryStats memory_stats;
   static size_t current_page_idx;
   static std::string pure_pinyin;
   static std::string seg_pinyin;
@@ -54,6 +121,7 @@ public:
   static bool during_creating;
 
   FanimeEngine(fcitx::Instance *instance);
+  ~FanimeEngine();
 
   void activate(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) override;
   void deactivate(const fcitx::InputMethodEntry &entry, fcitx::InputContextEvent &event) override;
@@ -74,6 +142,31 @@ public:
   void set_raw_pinyin(std::string pinyin) { raw_pinyin = pinyin; }
   int get_cand_page_idx() { return cand_page_idx_; }
   void set_cand_page_idx(int page_idx) { cand_page_idx_ = page_idx; }
+  // 每次上屏之后调用，按照 fetch_tuner 最新的结果调整，隔一段时间保存一次
+  void tune_fetching();
+  /*
+    普通的(没有辅助码、不在造词的)输入码的查询结果，缓存里面有的话直接用，查到了的话放到缓存最前面
+    deadline_ns 不为 0 的时候，到期还不知道有没有结果就把 ready 置为 false，返回的 cursor 也先放进缓存，之后接着取
+    Return: 没有查到结果的时候返回 nullptr
+  */
+  static std::shared_ptr<CandidateCursor> lookup_plain(const std::string &code, const std::vector<std::string> &pinyin_list, uint64_t deadline_ns = 0, bool *ready = nullptr);
+  /*
+    缓存里面 code 的前缀的查询结果，只要长度 len 满足 boundary[len] 的前缀(boundary 有 code.size() + 1 项)，长的在前面
+  */
+  static std::vector<std::shared_ptr<CandidateCursor>> cached_prefixes(const std::string &code, const std::vector<bool> &boundary);
+  // 超过 sentence_only_len 个字母的输入码不再整个去词库里面查，只造句
+  bool sentence_only(size_t code_len) const { return sentence_only_len_ && code_len > sentence_only_len_; }
+  /*
+    连续按键的时候，距离上一次按键 coalesce_quiet_us 之内没有新的按键才生成候选项，
+    但是距离第一个还没生成的按键最多推迟 coalesce_deadline_us；为 0 时每次按键都马上生成
+  */
+  uint64_t coalesce_quiet_us() const { return coalesce_quiet_us_; }
+  uint64_t coalesce_deadline_us() const { return coalesce_deadline_us_; }
+  /*
+    生成候选项的时间预算，从现在开始算的期限(FanimeTrace::now_ns 的时间)，为 0 时不限时间
+    到期还没取到的来源先挂起，第一页用已经有的候选项先显示出来
+  */
+  uint64_t generate_deadline_ns() const;
 
 private:
   FCITX_ADDON_DEPENDENCY_LOADER(chttrans, instance_->addonManager());
@@ -86,6 +179,36 @@ private:
   bool use_fullhelpcode_ = false;
   std::string raw_pinyin;
   int cand_page_idx_;
+  uint64_t coalesce_quiet_us_ = 0;
+  uint64_t coalesce_deadline_us_ = 0;
+  uint64_t generate_budget_ns_ = 0;
+  size_t sentence_only_len_ = 0;
+
+  // 数据目录里面的文件被替换之后，在后台线程重新加载，不需要重启 fcitx5
+  int inotify_fd_ = -1;
+  std::unique_ptr<fcitx::EventSourceIO> data_dir_watcher_;
+  std::unique_ptr<fcitx::EventSourceTime> reload_timer_;
+  std::thread reload_thread_;
+  std::atomic<bool> reloading_{false};
+  bool pending_dict_reload_ = false;
+  bool pending_assets_reload_ = false;
+  bool pending_next_word_reload_ = false;
+  // 启动的时候预读词库
+  std::thread warm_thread_;
+  // 定期在后台写 warm_cache.txt，mincore 不放在上屏的路上；上一次还没写完的话这一次跳过
+  std::thread warm_save_thread_;
+  std::atomic<bool> warm_saving_{false};
+
+  void watch_data_dir();
+  void on_data_dir_event();
+  void start_reload();
+  void apply_fetch_tuning();
+  void save_fetch_tuning();
+  void start_warm_up();
+  // background 为 true 的时候拷一份在后台线程写，退出的时候在当前线程写
+  void save_warm_cache(bool background);
+  void collect_memory();
+  void trim_memory();
 };
 
 class FanimeEngineFactory : public fcitx::AddonFactory {
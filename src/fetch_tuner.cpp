@@ -0,0 +1,216 @@
+#include "fetch_tuner.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include "config.h"
+
+namespace {
+
+const char *MODE_NAMES[] = {"plain", "single_helpcode", "full_helpcode", "creating"};
+
+// 数据不够的时候和以前写死的值保持一致
+const int DEFAULT_FIRST_PAGES = 2;
+const int DEFAULT_LIMIT = 80;
+const size_t DEFAULT_CACHE = 20;
+// 至少要有这么多样本才开始调整
+const double MIN_COMMITS = 20;
+const double MIN_PAGING = 10;
+const double MIN_LISTS = 200;
+// 每隔这么多次上屏把计数减半
+const size_t DECAY_INTERVAL = 2000;
+
+template <size_t N> double sum(const std::array<double, N> &counts, size_t from = 0) { return std::accumulate(counts.begin() + from, counts.end(), 0.0); }
+
+} // namespace
+
+FetchTuner::FetchTuner(int page_size) : page_size(page_size) {
+  auto &config = FanimeConfig::instance();
+  enabled = config.get_bool("adaptive_fetch", true);
+  min_limit = config.get_int("adaptive_min_limit", DEFAULT_LIMIT);
+  max_limit = std::max(min_limit, config.get_int("adaptive_max_limit", 200));
+  min_cache = config.get_int("adaptive_min_cache", 10);
+  max_cache = std::max(min_cache, config.get_int("adaptive_max_cache", 60));
+  max_prefetch = std::max(0, config.get_int("adaptive_max_prefetch", 3));
+  cur = &buckets[0];
+}
+
+size_t FetchTuner::bucket_index(Mode mode, size_t code_len) { return static_cast<size_t>(mode) * (MAX_CODE_LEN + 1) + std::min<size_t>(code_len, MAX_CODE_LEN); }
+
+void FetchTuner::begin(Mode mode, size_t code_len) {
+  cur = &buckets[bucket_index(mode, code_len)];
+  cur->views[0] += 1;
+}
+
+void FetchTuner::record_page(int page) {
+  if (page <= 0)
+    return;
+  cur->views[std::min(page, MAX_PAGE)] += 1;
+}
+
+void FetchTuner::record_commit(size_t index, size_t code_len) {
+  cur->commits[std::min<size_t>(index / page_size, MAX_PAGE)] += 1;
+  commit_code_lens[std::min<size_t>(code_len, MAX_CODE_LEN)] += 1;
+  if (++total_commits % DECAY_INTERVAL == 0)
+    decay();
+}
+
+void FetchTuner::decay() {
+  for (auto &bucket : buckets) {
+    for (auto &each : bucket.views)
+      each /= 2;
+    for (auto &each : bucket.commits)
+      each /= 2;
+  }
+  for (auto &each : commit_code_lens)
+    each /= 2;
+}
+
+/*
+  95% 的上屏都发生在前几页，第一次就把这几页合并出来
+*/
+int FetchTuner::first_pages(const Bucket &bucket) const {
+  double total = sum(bucket.commits);
+  if (!enabled || total < MIN_COMMITS)
+    return DEFAULT_FIRST_PAGES;
+  int pages = 1;
+  double covered = bucket.commits[0];
+  while (covered < total * 0.95 && pages <= MAX_PAGE)
+    covered += bucket.commits[pages++];
+  return std::clamp(pages, 1, 1 + max_prefetch);
+}
+
+/*
+  已经开始翻页之后再往下翻一页的比例是 r 的话，平均还会再翻 r / (1 - r) 页
+*/
+int FetchTuner::prefetch_pages(const Bucket &bucket) const {
+  if (!enabled || bucket.views[1] < MIN_PAGING)
+    return 0;
+  double paged = sum(bucket.views, 1) - bucket.views[MAX_PAGE];
+  double continued = sum(bucket.views, 2);
+  double ratio = std::min(continued / paged, 0.99);
+  return std::clamp(static_cast<int>(ratio / (1 - ratio)), 0, max_prefetch);
+}
+
+size_t FetchTuner::first_fill() const { return static_cast<size_t>(first_pages(*cur) * page_size + 1); }
+
+int FetchTuner::prefetch_pages() const { return prefetch_pages(*cur); }
+
+/*
+  超过 1% 的候选列表会翻到的最深的那一页，再多留一页
+*/
+int FetchTuner::fetch_limit() const {
+  std::array<double, MAX_PAGE + 1> views{};
+  for (const auto &bucket : buckets)
+    for (int p = 0; p <= MAX_PAGE; p++)
+      views[p] += bucket.views[p];
+  if (!enabled || views[0] < MIN_LISTS)
+    return std::clamp(DEFAULT_LIMIT, min_limit, max_limit);
+  int deepest = 0;
+  for (int p = 1; p <= MAX_PAGE; p++)
+    if (views[p] > views[0] * 0.01)
+      deepest = p;
+  return std::clamp((deepest + 2) * page_size, min_limit, max_limit);
+}
+
+/*
+  一次输入过程中每个前缀都会占一项，在缓存里面命中的还会再占一项
+*/
+size_t FetchTuner::cache_capacity() const {
+  double total = sum(commit_code_lens);
+  if (!enabled || total < MIN_COMMITS)
+    return std::clamp<size_t>(DEFAULT_CACHE, min_cache, max_cache);
+  int len = 0;
+  double covered = commit_code_lens[0];
+  while (covered < total * 0.95 && len < MAX_CODE_LEN)
+    covered += commit_code_lens[++len];
+  return std::clamp<size_t>(len * 2, min_cache, max_cache);
+}
+
+/*
+  每行: views|commits <mode> <code_len> <MAX_PAGE + 1 个计数>，或者 code_len <MAX_CODE_LEN + 1 个计数>
+*/
+bool FetchTuner::load(const std::string &path) {
+  std::ifstream tuner_file(path);
+  if (!tuner_file.is_open())
+    return false;
+  std::string line;
+  while (std::getline(tuner_file, line)) {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind == "total_commits") {
+      fields >> total_commits;
+    } else if (kind == "views" || kind == "commits") {
+      int mode;
+      size_t code_len;
+      if (!(fields >> mode >> code_len) || mode < 0 || mode >= MODE_CNT)
+        continue;
+      auto &bucket = buckets[bucket_index(static_cast<Mode>(mode), code_len)];
+      auto &counts = kind == "views" ? bucket.views : bucket.commits;
+      for (auto &each : counts)
+        fields >> each;
+    } else if (kind == "code_len") {
+      for (auto &each : commit_code_lens)
+        fields >> each;
+    }
+  }
+  return true;
+}
+
+/*
+  和 UserOverlay::save 一样，先写临时文件再 rename
+*/
+bool FetchTuner::save(const std::string &path) const {
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream tuner_file(tmp_path, std::ios::trunc);
+    if (!tuner_file.is_open())
+      return false;
+    tuner_file << "total_commits " << total_commits << '\n';
+    for (int mode = 0; mode < MODE_CNT; mode++) {
+      for (int code_len = 0; code_len <= MAX_CODE_LEN; code_len++) {
+        const auto &bucket = buckets[bucket_index(static_cast<Mode>(mode), code_len)];
+        if (bucket.views[0] == 0 && sum(bucket.commits) == 0)
+          continue;
+        tuner_file << "views " << mode << ' ' << code_len;
+        for (double each : bucket.views)
+          tuner_file << ' ' << each;
+        tuner_file << "\ncommits " << mode << ' ' << code_len;
+        for (double each : bucket.commits)
+          tuner_file << ' ' << each;
+        tuner_file << '\n';
+      }
+    }
+    tuner_file << "code_len";
+    for (double each : commit_code_lens)
+      tuner_file << ' ' << each;
+    tuner_file << '\n';
+    if (!tuner_file.good())
+      return false;
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+void FetchTuner::dump(std::ostream &out) const {
+  out << "[fetch_tuner]\n";
+  out << "enabled=" << enabled << "\n";
+  out << "total_commits=" << total_commits << "\n";
+  out << "fetch_limit=" << fetch_limit() << " (" << min_limit << ".." << max_limit << ")\n";
+  out << "cache_capacity=" << cache_capacity() << " (" << min_cache << ".." << max_cache << ")\n";
+  for (int mode = 0; mode < MODE_CNT; mode++) {
+    for (int code_len = 0; code_len <= MAX_CODE_LEN; code_len++) {
+      const auto &bucket = buckets[bucket_index(static_cast<Mode>(mode), code_len)];
+      if (bucket.views[0] == 0)
+        continue;
+      out << MODE_NAMES[mode] << " code_len=" << code_len << " lists=" << bucket.views[0] << " commits=" << sum(bucket.commits) << " first_fill=" << first_pages(bucket) * page_size + 1 << " prefetch_pages=" << prefetch_pages(bucket) << " commit_pages=";
+      int last = MAX_PAGE;
+      while (last > 0 && bucket.commits[last] == 0)
+        last--;
+      for (int p = 0; p <= last; p++)
+        out << (p ? "," : "") << bucket.commits[p];
+      out << "\n";
+    }
+  }
+}
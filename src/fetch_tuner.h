@@ -0,0 +1,72 @@
+#ifndef FAN_FETCH_TUNER_H
+#define FAN_FETCH_TUNER_H
+
+#include <array>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/*
+  根据用户实际的翻页和上屏习惯调整每次取多少候选项、翻页时预取多少、缓存多大
+
+  - 按 (模式, code 长度) 分桶，记录每个候选列表翻到了第几页、上屏的是第几页的候选项
+  - 再记录上屏时 code 的长度，缓存至少要装得下一次输入过程中每个前缀的结果
+  - 学到的计数保存在 fetch_tuner.txt 里面，重启之后接着用；计数超过一定数量就整体减半，慢慢忘掉以前的习惯
+  - 调整的范围在 config.txt 里面配置，数据不够的时候使用原来写死的默认值:
+      adaptive_fetch=1           关掉之后一直使用默认值
+      adaptive_min_limit=80      每次查询最多取多少行(DictionaryUlPb 的 limit)
+      adaptive_max_limit=200
+      adaptive_min_cache=10      缓存多少个 code 的查询结果
+      adaptive_max_cache=60
+      adaptive_max_prefetch=3    翻页时最多多取几页
+*/
+class FetchTuner {
+public:
+  enum class Mode { Plain = 0, SingleHelpcode, FullHelpcode, Creating };
+  static constexpr int MODE_CNT = 4;
+  static constexpr int MAX_CODE_LEN = 12; // 更长的都记在 12
+  static constexpr int MAX_PAGE = 16;     // 翻得更深的都记在 16
+
+  explicit FetchTuner(int page_size);
+
+  bool load(const std::string &path);
+  bool save(const std::string &path) const;
+  void dump(std::ostream &out) const;
+
+  // 每次生成候选列表的时候调用，后面的 record_* 都记在这个桶里
+  void begin(Mode mode, size_t code_len);
+  void record_page(int page);
+  void record_commit(size_t index, size_t code_len);
+  size_t commit_cnt() const { return total_commits; }
+
+  // 第一次合并出来的候选项个数，多一个用来判断 hasNext
+  size_t first_fill() const;
+  // 翻页时除了当前这一页之外还要多取几页
+  int prefetch_pages() const;
+  int fetch_limit() const;
+  size_t cache_capacity() const;
+
+private:
+  struct Bucket {
+    // views[p]: 翻到过第 p 页的候选列表个数，views[0] 就是候选列表的个数
+    std::array<double, MAX_PAGE + 1> views{};
+    // commits[p]: 在第 p 页上屏的次数
+    std::array<double, MAX_PAGE + 1> commits{};
+  };
+
+  int page_size;
+  bool enabled;
+  int min_limit, max_limit, min_cache, max_cache, max_prefetch;
+  std::array<Bucket, MODE_CNT * (MAX_CODE_LEN + 1)> buckets{};
+  // 上屏时 code 的长度
+  std::array<double, MAX_CODE_LEN + 1> commit_code_lens{};
+  size_t total_commits = 0;
+  Bucket *cur = nullptr;
+
+  static size_t bucket_index(Mode mode, size_t code_len);
+  int first_pages(const Bucket &bucket) const;
+  int prefetch_pages(const Bucket &bucket) const;
+  void decay();
+};
+
+#endif // FAN_FETCH_TUNER_H
@@ -0,0 +1,200 @@
+#include "helpcode_kernel.h"
+#include <algorithm>
+#include "pinyin_utils.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FAN_HELPCODE_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+/*
+  BMP 范围内的字直接查 helpcode_bmp，其它的(扩展区的字、不是一个字的)再去查 helpcode_keymap
+  Return: 两个辅助码字母，低位是第一个
+*/
+uint16_t lookup_helpcode(const PinyinAssets &assets, const std::string &words, size_t index, size_t len, std::string &buf) {
+  uint32_t codepoint;
+  if (PinyinUtil::decode_bmp_char(words, index, len, codepoint))
+    return assets.helpcode_bmp[codepoint];
+  buf.assign(words, index, len);
+  auto it = assets.helpcode_keymap.find(buf);
+  if (it == assets.helpcode_keymap.end() || it->second.empty())
+    return 0;
+  return static_cast<uint8_t>(it->second[0]) | (it->second.size() > 1 ? static_cast<uint8_t>(it->second[1]) << 8 : 0);
+}
+
+// 和 PinyinUtil::get_first_char_size 一样，只是不用拷贝字符串
+size_t utf8_char_size(const std::string &words, size_t index) {
+  unsigned char lead = words[index];
+  size_t cplen = 1;
+  if ((lead & 0xf8) == 0xf0)
+    cplen = 4;
+  else if ((lead & 0xf0) == 0xe0)
+    cplen = 3;
+  else if ((lead & 0xe0) == 0xc0)
+    cplen = 2;
+  return cplen > words.size() - index ? 1 : cplen;
+}
+
+/*
+  每个候选项:
+    m_first = first == helpcode
+    m_alt = alt == helpcode
+    bucket = m_first ? FIRST : m_alt ? LAST : NOT_MATCHED
+    汉字个数不一样并且匹配了的 +2，一样但是没有匹配的 +1 (NOT_MATCHED + 1 就是 DROPPED)
+  SIMD 的版本都是按照这个式子用掩码拼出来的
+*/
+void classify_scalar(const uint8_t *first, const uint8_t *alt, const uint8_t *han_cnt, size_t from, size_t cnt, uint8_t helpcode, uint8_t exact, uint8_t *out) {
+  for (size_t i = from; i < cnt; i++) {
+    bool m_first = first[i] == helpcode;
+    bool m_alt = alt[i] == helpcode;
+    bool is_exact = han_cnt[i] == exact;
+    uint8_t bucket = m_first ? HelpcodeColumns::FIRST : m_alt ? HelpcodeColumns::LAST : HelpcodeColumns::NOT_MATCHED;
+    if (m_first || m_alt)
+      bucket += is_exact ? 0 : 2;
+    else
+      bucket += is_exact ? 1 : 0;
+    out[i] = bucket;
+  }
+}
+
+#if defined(__SSE2__)
+size_t classify_sse2(const uint8_t *first, const uint8_t *alt, const uint8_t *han_cnt, size_t cnt, uint8_t helpcode, uint8_t exact, uint8_t *out) {
+  const __m128i h = _mm_set1_epi8(static_cast<char>(helpcode));
+  const __m128i e = _mm_set1_epi8(static_cast<char>(exact));
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i two = _mm_set1_epi8(2);
+  const __m128i four = _mm_set1_epi8(4);
+  size_t i = 0;
+  for (; i + 16 <= cnt; i += 16) {
+    __m128i m_first = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(first + i)), h);
+    __m128i m_alt = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(alt + i)), h);
+    __m128i is_exact = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(han_cnt + i)), e);
+    __m128i matched = _mm_or_si128(m_first, m_alt);
+    __m128i bucket = _mm_andnot_si128(m_first, _mm_or_si128(_mm_and_si128(m_alt, one), _mm_andnot_si128(m_alt, four)));
+    bucket = _mm_add_epi8(bucket, _mm_and_si128(_mm_andnot_si128(is_exact, matched), two));
+    bucket = _mm_add_epi8(bucket, _mm_and_si128(_mm_andnot_si128(matched, is_exact), one));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), bucket);
+  }
+  return i;
+}
+#endif
+
+#if defined(FAN_HELPCODE_AVX2)
+__attribute__((target("avx2"))) size_t classify_avx2(const uint8_t *first, const uint8_t *alt, const uint8_t *han_cnt, size_t cnt, uint8_t helpcode, uint8_t exact, uint8_t *out) {
+  const __m256i h = _mm256_set1_epi8(static_cast<char>(helpcode));
+  const __m256i e = _mm256_set1_epi8(static_cast<char>(exact));
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i two = _mm256_set1_epi8(2);
+  const __m256i four = _mm256_set1_epi8(4);
+  size_t i = 0;
+  for (; i + 32 <= cnt; i += 32) {
+    __m256i m_first = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + i)), h);
+    __m256i m_alt = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(alt + i)), h);
+    __m256i is_exact = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(han_cnt + i)), e);
+    __m256i matched = _mm256_or_si256(m_first, m_alt);
+    __m256i bucket = _mm256_andnot_si256(m_first, _mm256_or_si256(_mm256_and_si256(m_alt, one), _mm256_andnot_si256(m_alt, four)));
+    bucket = _mm256_add_epi8(bucket, _mm256_and_si256(_mm256_andnot_si256(is_exact, matched), two));
+    bucket = _mm256_add_epi8(bucket, _mm256_and_si256(_mm256_andnot_si256(matched, is_exact), one));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), bucket);
+  }
+  return i;
+}
+
+bool has_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+#endif
+
+#if defined(__ARM_NEON)
+size_t classify_neon(const uint8_t *first, const uint8_t *alt, const uint8_t *han_cnt, size_t cnt, uint8_t helpcode, uint8_t exact, uint8_t *out) {
+  const uint8x16_t h = vdupq_n_u8(helpcode);
+  const uint8x16_t e = vdupq_n_u8(exact);
+  const uint8x16_t one = vdupq_n_u8(1);
+  const uint8x16_t two = vdupq_n_u8(2);
+  const uint8x16_t four = vdupq_n_u8(4);
+  size_t i = 0;
+  for (; i + 16 <= cnt; i += 16) {
+    uint8x16_t m_first = vceqq_u8(vld1q_u8(first + i), h);
+    uint8x16_t m_alt = vceqq_u8(vld1q_u8(alt + i), h);
+    uint8x16_t is_exact = vceqq_u8(vld1q_u8(han_cnt + i), e);
+    uint8x16_t matched = vorrq_u8(m_first, m_alt);
+    // vbicq_u8(a, b) 是 a & ~b
+    uint8x16_t bucket = vbicq_u8(vbslq_u8(m_alt, one, four), m_first);
+    bucket = vaddq_u8(bucket, vandq_u8(vbicq_u8(matched, is_exact), two));
+    bucket = vaddq_u8(bucket, vandq_u8(vbicq_u8(is_exact, matched), one));
+    vst1q_u8(out + i, bucket);
+  }
+  return i;
+}
+#endif
+
+} // namespace
+
+void HelpcodeColumns::build(const std::vector<WordItem> &items, const PinyinAssets &assets) {
+  first.resize(items.size());
+  alt.resize(items.size());
+  han_cnt.resize(items.size());
+  std::string buf;
+  for (size_t i = 0; i < items.size(); i++) {
+    const std::string &words = std::get<1>(items[i]);
+    // 汉字个数和首尾两个字一遍就拿到，和 PinyinUtil 里面那几个函数的结果一样
+    size_t cnt = 0, last_pos = 0;
+    for (size_t index = 0; index < words.size(); index += utf8_char_size(words, index)) {
+      last_pos = index;
+      cnt++;
+    }
+    if (cnt == 0) {
+      first[i] = alt[i] = han_cnt[i] = 0;
+      continue;
+    }
+    uint16_t first_helpcode = lookup_helpcode(assets, words, 0, utf8_char_size(words, 0), buf);
+    first[i] = first_helpcode & 0xff;
+    alt[i] = cnt == 1 ? first_helpcode >> 8 : lookup_helpcode(assets, words, last_pos, words.size() - last_pos, buf) & 0xff;
+    han_cnt[i] = static_cast<uint8_t>(std::min<size_t>(cnt, UINT8_MAX));
+  }
+}
+
+void HelpcodeColumns::classify(char helpcode, size_t exact_han_cnt, std::vector<uint8_t> &buckets) const {
+  size_t cnt = size();
+  buckets.resize(cnt);
+  uint8_t h = static_cast<uint8_t>(helpcode);
+  uint8_t exact = static_cast<uint8_t>(std::min<size_t>(exact_han_cnt, UINT8_MAX));
+  size_t done = 0;
+#if defined(FAN_HELPCODE_AVX2)
+  if (has_avx2())
+    done = classify_avx2(first.data(), alt.data(), han_cnt.data(), cnt, h, exact, buckets.data());
+#endif
+#if defined(__SSE2__)
+  done += classify_sse2(first.data() + done, alt.data() + done, han_cnt.data() + done, cnt - done, h, exact, buckets.data() + done);
+#elif defined(__ARM_NEON)
+  done = classify_neon(first.data(), alt.data(), han_cnt.data(), cnt, h, exact, buckets.data());
+#endif
+  // 剩下不够一个向量的部分
+  classify_scalar(first.data(), alt.data(), han_cnt.data(), done, cnt, h, exact, buckets.data());
+}
+
+void HelpcodeColumns::split(std::vector<WordItem> items, const PinyinAssets &assets, char helpcode, size_t exact_han_cnt, std::array<std::vector<WordItem>, BUCKET_CNT> &lists) {
+  HelpcodeColumns columns;
+  columns.build(items, assets);
+  std::vector<uint8_t> buckets;
+  columns.classify(helpcode, exact_han_cnt, buckets);
+  std::array<size_t, BUCKET_CNT> sizes{};
+  for (uint8_t bucket : buckets)
+    if (bucket < BUCKET_CNT)
+      sizes[bucket]++;
+  for (int b = 0; b < BUCKET_CNT; b++) {
+    lists[b].clear();
+    lists[b].reserve(sizes[b]);
+  }
+  for (size_t i = 0; i < items.size(); i++)
+    if (buckets[i] < BUCKET_CNT)
+      lists[buckets[i]].push_back(std::move(items[i]));
+}
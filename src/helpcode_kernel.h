@@ -0,0 +1,52 @@
+#ifndef FAN_HELPCODE_KERNEL_H
+#define FAN_HELPCODE_KERNEL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+struct PinyinAssets;
+
+/*
+  单码辅助的筛选: 把候选项按照最后一个辅助码分到几个桶里面
+
+  - 先把每个候选项的辅助码字母和汉字个数拆成几列紧凑的数组(structure-of-arrays)，查辅助码表只在这一步，常用字按码点直接查 PinyinAssets::helpcode_bmp
+  - 之后每个候选项只剩几次字节比较，用 SSE2/AVX2/NEON 一次比较 16/32 个，没有 SIMD 的时候逐个比较
+  - 分桶的规则和原来 handle_singlehelpcode 里面的一样:
+      FIRST        汉字个数刚好是拼音的一半，首字第一个辅助码匹配
+      LAST         汉字个数刚好是拼音的一半，单字第二个辅助码或者多字最后一个字第一个辅助码匹配
+      OTHER_FIRST  汉字个数不一样，其它同 FIRST
+      OTHER_LAST   汉字个数不一样，其它同 LAST
+      NOT_MATCHED  汉字个数不一样，也没有匹配的
+      DROPPED      汉字个数刚好是拼音的一半但是没有匹配的，直接丢掉
+*/
+class HelpcodeColumns {
+public:
+  using WordItem = std::tuple<std::string, std::string, int>;
+  enum Bucket : uint8_t { FIRST = 0, LAST, OTHER_FIRST, OTHER_LAST, NOT_MATCHED, DROPPED };
+  static constexpr int BUCKET_CNT = 5; // 不算 DROPPED
+
+  void build(const std::vector<WordItem> &items, const PinyinAssets &assets);
+  size_t size() const { return han_cnt.size(); }
+  /*
+    exact_han_cnt: 拼音和汉字刚好是 2:1 的时候的汉字个数
+    Return: 每个候选项所在的桶，写在 buckets 里面
+  */
+  void classify(char helpcode, size_t exact_han_cnt, std::vector<uint8_t> &buckets) const;
+
+  // 按照桶的顺序把候选项分开，桶内保持原来的顺序
+  static void split(std::vector<WordItem> items, const PinyinAssets &assets, char helpcode, size_t exact_han_cnt, std::array<std::vector<WordItem>, BUCKET_CNT> &lists);
+
+private:
+  // 首字的第一个辅助码，没有的话是 0
+  std::vector<uint8_t> first;
+  // 单字是第二个辅助码，多字是最后一个字的第一个辅助码
+  std::vector<uint8_t> alt;
+  // 汉字个数，超过 255 的记成 255
+  std::vector<uint8_t> han_cnt;
+};
+
+#endif // FAN_HELPCODE_KERNEL_H
@@ -0,0 +1,157 @@
+#include "key_filter.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const char *const CREATE_SQL = "create table if not exists fanime_key_filter (shard TEXT PRIMARY KEY, hash_cnt INTEGER, entry_cnt INTEGER, bits BLOB);";
+const char *const SAVE_SQL = "insert or replace into fanime_key_filter (shard, hash_cnt, entry_cnt, bits) values (?, ?, ?, ?);";
+
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+} // namespace
+
+/*
+  FNV-1a 再打散一下，两个哈希(h1 + i * h2)代替 HASH_CNT 个
+*/
+uint64_t KeyFilter::hash(Kind kind, const std::string &text) {
+  uint64_t h = 14695981039346656037ULL;
+  h = (h ^ static_cast<unsigned char>(kind)) * 1099511628211ULL;
+  for (unsigned char c : text)
+    h = (h ^ c) * 1099511628211ULL;
+  return mix(h);
+}
+
+bool KeyFilter::load(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "select shard, hash_cnt, entry_cnt, bits from fanime_key_filter;", -1, &stmt, 0) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  shards.clear();
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int size = sqlite3_column_bytes(stmt, 3);
+    const void *blob = sqlite3_column_blob(stmt, 3);
+    if (!blob || size <= 0 || size % sizeof(uint64_t) != 0)
+      continue;
+    Bits bits;
+    bits.hash_cnt = static_cast<uint32_t>(std::clamp(sqlite3_column_int(stmt, 1), 1, 16));
+    bits.entry_cnt = static_cast<uint64_t>(sqlite3_column_int64(stmt, 2));
+    bits.words.resize(size / sizeof(uint64_t));
+    memcpy(bits.words.data(), blob, size);
+    shards[reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))] = std::move(bits);
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+bool KeyFilter::save_bits(sqlite3_stmt *stmt, const std::string &shard, const Bits &bits) {
+  sqlite3_bind_text(stmt, 1, shard.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(stmt, 2, static_cast<int>(bits.hash_cnt));
+  sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(bits.entry_cnt));
+  sqlite3_bind_blob(stmt, 4, bits.words.data(), static_cast<int>(bits.words.size() * sizeof(uint64_t)), SQLITE_STATIC);
+  bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+  sqlite3_reset(stmt);
+  return ok;
+}
+
+bool KeyFilter::save(sqlite3 *db) const {
+  if (sqlite3_exec(db, CREATE_SQL, nullptr, nullptr, nullptr) != SQLITE_OK)
+    return false;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, SAVE_SQL, -1, &stmt, 0) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  bool ok = true;
+  for (const auto &[shard, bits] : shards)
+    ok = save_bits(stmt, shard, bits) && ok;
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+bool KeyFilter::save_shard(sqlite3 *db, const std::string &shard) const {
+  auto it = shards.find(shard);
+  if (it == shards.end() || sqlite3_exec(db, CREATE_SQL, nullptr, nullptr, nullptr) != SQLITE_OK)
+    return false;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, SAVE_SQL, -1, &stmt, 0) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  bool ok = save_bits(stmt, shard, it->second);
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+void KeyFilter::reserve(const std::string &shard, size_t entry_cnt) {
+  auto &bits = shards[shard];
+  bits.words.assign((std::max(entry_cnt, MIN_ENTRIES) * BITS_PER_ENTRY + 63) / 64, 0);
+  bits.entry_cnt = 0;
+}
+
+/*
+  造词写到一张还没有的表里面的时候，按 MIN_ENTRIES 新建；已经有的表项数超过了分配的也照样加，只是误报多一点
+*/
+void KeyFilter::add(const std::string &shard, Kind kind, const std::string &text) {
+  auto it = shards.find(shard);
+  if (it == shards.end()) {
+    reserve(shard, MIN_ENTRIES);
+    it = shards.find(shard);
+  }
+  auto &bits = it->second;
+  uint64_t h1 = hash(kind, text);
+  uint64_t h2 = mix(h1) | 1;
+  uint64_t m = bits.words.size() * 64;
+  for (uint32_t i = 0; i < bits.hash_cnt; i++) {
+    uint64_t bit = (h1 + i * h2) % m;
+    bits.words[bit / 64] |= uint64_t{1} << (bit % 64);
+  }
+  bits.entry_cnt++;
+}
+
+bool KeyFilter::may_contain(const std::string &shard, Kind kind, const std::string &text) const {
+  probes++;
+  auto it = shards.find(shard);
+  bool maybe = it != shards.end();
+  if (maybe) {
+    const auto &bits = it->second;
+    uint64_t h1 = hash(kind, text);
+    uint64_t h2 = mix(h1) | 1;
+    uint64_t m = bits.words.size() * 64;
+    for (uint32_t i = 0; i < bits.hash_cnt && maybe; i++) {
+      uint64_t bit = (h1 + i * h2) % m;
+      maybe = bits.words[bit / 64] >> (bit % 64) & 1;
+    }
+  }
+  if (!maybe)
+    misses++;
+  return maybe;
+}
+
+size_t KeyFilter::memory_bytes() const {
+  size_t bytes = shards.bucket_count() * sizeof(void *);
+  for (const auto &[shard, bits] : shards)
+    bytes += sizeof(std::pair<const std::string, Bits>) + 2 * sizeof(void *) + bits.words.capacity() * sizeof(uint64_t);
+  return bytes;
+}
+
+/*
+  miss_rate: 直接返回、没有去查 sqlite 的比例
+  fp_rate: 实际上查不到的里面，没有被挡住、还是去查了的比例
+*/
+void KeyFilter::dump(std::ostream &out) const {
+  uint64_t entry_cnt = 0;
+  for (const auto &[shard, bits] : shards)
+    entry_cnt += bits.entry_cnt;
+  out << "[key_filter]\n";
+  out << "shards=" << shards.size() << " entries=" << entry_cnt << " bytes=" << memory_bytes() << "\n";
+  out << "probes=" << probes << " misses=" << misses << " false_positives=" << false_positives << "\n";
+  out << "miss_rate=" << (probes ? static_cast<double>(misses) / probes : 0.0) << " fp_rate=" << (misses + false_positives ? static_cast<double>(false_positives) / (misses + false_positives) : 0.0) << "\n";
+}
@@ -0,0 +1,72 @@
+#ifndef FAN_KEY_FILTER_H
+#define FAN_KEY_FILTER_H
+
+#include <sqlite3.h>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+  词库里面每个分表(字数 + 第一个字母，见 Shard::table_prefix)一个 Bloom filter，记着这张表里面所有的 key 和 jp
+  查询之前先问一下: 说没有就一定没有，不用再去 sqlite 里面查；说有的时候大约 1% 是误报
+
+  - 中间状态的输入码(音节打了一半、后面跟着辅助码的)大部分一行都查不到，以前每次都要走一遍 sqlite 的索引
+  - fanime-gendict 生成词库的时候一起生成，存在 fanime_key_filter 表里面，没有这张表的旧词库不过滤
+  - 用户造词直接写到词库里面的时候(user_overlay=0)同时更新内存里面的和词库里面的这一张表的；
+    写到 overlay 的词查询的时候另外合并，不用放进来
+  - key、jp 以及 key 去掉最后一个字母(最后一个音节只打了声母的输入码，见 DictionaryUlPb::may_have_rows)
+    放在同一个 filter 里面，哈希的时候前面加一个字母区分开
+  - 每一项 BITS_PER_ENTRY 位、HASH_CNT 个哈希；和查询在同一个线程里面用，计数也是
+
+  config.txt:
+      key_filter=1    关掉之后每次都去 sqlite 里面查
+*/
+class KeyFilter {
+public:
+  enum class Kind : char { Key = 'k', Jp = 'j', Prefix = 'p' };
+  static constexpr size_t BITS_PER_ENTRY = 10;
+  static constexpr uint32_t HASH_CNT = 7;
+  // 造词的时候新建的表，先按这么多项分配
+  static constexpr size_t MIN_ENTRIES = 256;
+
+  // 从词库里面读，没有 fanime_key_filter 表的时候返回 false
+  bool load(sqlite3 *db);
+  // 整个写到词库里面，fanime-gendict 使用
+  bool save(sqlite3 *db) const;
+  // 只写一个分表的，造词之后调用
+  bool save_shard(sqlite3 *db, const std::string &shard) const;
+
+  // 这个分表有多少项，在第一次 add 之前调用，fanime-gendict 使用
+  void reserve(const std::string &shard, size_t entry_cnt);
+  void add(const std::string &shard, Kind kind, const std::string &text);
+  /*
+    Return: false 表示一定没有；分表不在 filter 里面(词库里面没有这张表)也是 false
+  */
+  bool may_contain(const std::string &shard, Kind kind, const std::string &text) const;
+  // may_contain 说有，去 sqlite 里面查了一行都没有
+  void record_false_positive() const { false_positives++; }
+
+  size_t size() const { return shards.size(); }
+  size_t memory_bytes() const;
+  void dump(std::ostream &out) const;
+
+private:
+  struct Bits {
+    uint32_t hash_cnt = HASH_CNT;
+    uint64_t entry_cnt = 0;
+    std::vector<uint64_t> words;
+  };
+
+  std::unordered_map<std::string, Bits> shards;
+  mutable uint64_t probes = 0;
+  mutable uint64_t misses = 0;
+  mutable uint64_t false_positives = 0;
+
+  static uint64_t hash(Kind kind, const std::string &text);
+  static bool save_bits(sqlite3_stmt *stmt, const std::string &shard, const Bits &bits);
+};
+
+#endif // FAN_KEY_FILTER_H
@@ -0,0 +1,135 @@
+#include "keystroke_trace.h"
+#include <algorithm>
+#include <cstring>
+#include "config.h"
+#include "trace.h"
+
+static_assert(sizeof(KeystrokeTrace::Header) == 16, "keystroke trace header must stay 16 bytes");
+static_assert(sizeof(KeystrokeTrace::Record) == 28, "keystroke trace record must stay 28 bytes");
+
+namespace {
+
+uint32_t to_us(uint64_t ns) { return static_cast<uint32_t>(std::min<uint64_t>(ns / 1000, UINT32_MAX)); }
+
+} // namespace
+
+KeystrokeTrace::KeystrokeTrace() {
+  auto &config = FanimeConfig::instance();
+  enabled_ = config.get_bool("keystroke_trace", false);
+  max_bytes = static_cast<size_t>(std::max(64, config.get_int("keystroke_trace_max_kb", 8192))) * 1024;
+}
+
+KeystrokeTrace::~KeystrokeTrace() {
+  if (has_cur)
+    write(cur);
+  if (file)
+    fclose(file);
+}
+
+/*
+  追加到已有的文件后面，文件头不对(旧版本或者不是这个文件)的话重新开始
+*/
+bool KeystrokeTrace::open() {
+  if (file)
+    return true;
+  path = FanimeConfig::data_dir() + "/keystroke_trace.bin";
+  file = fopen(path.c_str(), "ab+");
+  if (!file) {
+    enabled_ = false;
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  written = static_cast<size_t>(ftell(file));
+  Header header;
+  rewind(file);
+  bool valid = written >= sizeof(header) && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION && header.record_size == sizeof(Record);
+  if (!valid) {
+    fclose(file);
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+      enabled_ = false;
+      return false;
+    }
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.record_size = sizeof(Record);
+    fwrite(&header, sizeof(header), 1, file);
+    written = sizeof(header);
+  }
+  fseek(file, 0, SEEK_END);
+  return true;
+}
+
+void KeystrokeTrace::write(const Record &record) {
+  if (!open())
+    return;
+  if (written + sizeof(record) > max_bytes) {
+    fclose(file);
+    file = nullptr;
+    std::rename(path.c_str(), (path + ".1").c_str());
+    if (!open())
+      return;
+  }
+  fwrite(&record, sizeof(record), 1, file);
+  written += sizeof(record);
+}
+
+void KeystrokeTrace::begin_key() {
+  if (!enabled_)
+    return;
+  if (has_cur)
+    write(cur);
+  uint64_t now = FanimeTrace::now_ns(true);
+  cur = Record{};
+  cur.gap_us = last_key_ns ? to_us(now - last_key_ns) : UINT32_MAX;
+  cur.select_index = -1;
+  has_cur = true;
+  key_start_ns = last_key_ns = now;
+}
+
+void KeystrokeTrace::end_key(KeyClass key_class, uint8_t flags, size_t code_len, size_t syllable_cnt, uint16_t initial_mask, size_t candidate_cnt) {
+  if (!has_cur)
+    return;
+  cur.key_class = key_class;
+  cur.key_us = to_us(FanimeTrace::elapsed_ns(key_start_ns));
+  cur.flags = flags;
+  cur.code_len = static_cast<uint8_t>(std::min<size_t>(code_len, UINT8_MAX));
+  cur.syllable_cnt = static_cast<uint8_t>(std::min<size_t>(syllable_cnt, UINT8_MAX));
+  cur.initial_mask = initial_mask;
+  cur.candidate_cnt = static_cast<uint16_t>(std::min<size_t>(candidate_cnt, UINT16_MAX));
+}
+
+void KeystrokeTrace::add_generate_ns(uint64_t ns) {
+  if (has_cur)
+    cur.generate_us = to_us(static_cast<uint64_t>(cur.generate_us) * 1000 + ns);
+}
+
+void KeystrokeTrace::add_learn_ns(uint64_t ns) {
+  if (has_cur)
+    cur.learn_us = to_us(static_cast<uint64_t>(cur.learn_us) * 1000 + ns);
+}
+
+void KeystrokeTrace::set_select(size_t index) {
+  if (has_cur)
+    cur.select_index = static_cast<int16_t>(std::min<size_t>(index, INT16_MAX));
+}
+
+void KeystrokeTrace::flush() {
+  if (file)
+    fflush(file);
+}
+
+bool KeystrokeTrace::read(const std::string &path, std::vector<Record> &records) {
+  FILE *in = fopen(path.c_str(), "rb");
+  if (!in)
+    return false;
+  Header header;
+  bool valid = fread(&header, sizeof(header), 1, in) == 1 && memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION && header.record_size == sizeof(Record);
+  if (valid) {
+    Record record;
+    while (fread(&record, sizeof(record), 1, in) == 1)
+      records.push_back(record);
+  }
+  fclose(in);
+  return valid;
+}
@@ -0,0 +1,107 @@
+#ifndef FAN_KEYSTROKE_TRACE_H
+#define FAN_KEYSTROKE_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+  线上按键耗时的采集，拿真实的输入节奏离线重放调优；默认关闭，打开之后也不记录输入了什么
+
+  - 每个按键一条定长的记录: 按键的种类、按键之后输入码的长度和切分、模式、上屏的候选项的下标、各个阶段的耗时
+  - 字母本身完全不记，只留下哪些音节是完整的双拼、哪些只有声母，fanime-keytrace 按照这个结构从词库里面抽词造出等价的输入
+  - 推迟生成和分片补上的候选项(见 FanimeState::scheduleUpdate、scheduleProgress)的耗时记在最后一个按键上，
+    所以一条记录要到下一个按键开始的时候才写出去
+  - 写到 数据目录/keystroke_trace.bin，超过 keystroke_trace_max_kb 之后改名成 keystroke_trace.bin.1 重新开始
+
+  config.txt:
+      keystroke_trace=0
+      keystroke_trace_max_kb=8192
+
+  文件格式(小端): 一个 Header，后面都是 Record
+*/
+class KeystrokeTrace {
+public:
+  enum KeyClass : uint8_t {
+    LETTER = 0,
+    HELPCODE,  // 大写字母，或者输入之后变成了单码辅助
+    BACKSPACE,
+    PREV_PAGE,
+    NEXT_PAGE,
+    SELECT,    // 数字键、空格、逗号句号上屏
+    RETURN,    // 回车上屏输入码
+    ESCAPE,
+    PUNCTUATION, // 缓冲区为空的时候的标点
+    OTHER,
+    KEY_CLASS_CNT
+  };
+  enum Flag : uint8_t {
+    CREATING = 1,
+    FULL_HELPCODE = 2,
+    SINGLE_HELPCODE = 4,
+    DEFERRED = 8,    // 候选项推迟到了按键之后生成
+    PROGRESSIVE = 16 // 到期之后还有没做完的候选项
+  };
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+  };
+  struct Record {
+    uint32_t gap_us;      // 距离上一个按键，超过的记成 UINT32_MAX
+    uint32_t key_us;      // keyEvent 本身
+    uint32_t generate_us; // 生成候选项，包括推迟和分片补上的
+    uint32_t learn_us;    // 造词和调整权重
+    int16_t select_index; // 上屏的是 current_candidates 里面第几个，没有上屏是 -1
+    uint16_t candidate_cnt;
+    uint16_t initial_mask; // 第 i 位是 1 表示第 i 个音节只有声母，超过 16 个音节的不记
+    uint8_t key_class;
+    uint8_t flags;
+    uint8_t code_len; // 按键之后输入码的长度
+    uint8_t syllable_cnt;
+    uint16_t reserved;
+  };
+  static constexpr char MAGIC[8] = {'F', 'A', 'N', 'K', 'E', 'Y', 'T', '\0'};
+  static constexpr uint32_t VERSION = 1;
+
+  KeystrokeTrace();
+  ~KeystrokeTrace();
+  KeystrokeTrace(const KeystrokeTrace &) = delete;
+  KeystrokeTrace &operator=(const KeystrokeTrace &) = delete;
+
+  bool enabled() const { return enabled_; }
+  // 按键开始: 上一个按键的记录写出去，开始新的一条
+  void begin_key();
+  // 按键处理完: 记下 keyEvent 的耗时和按键之后的状态
+  void end_key(KeyClass key_class, uint8_t flags, size_t code_len, size_t syllable_cnt, uint16_t initial_mask, size_t candidate_cnt);
+  void add_generate_ns(uint64_t ns);
+  void add_learn_ns(uint64_t ns);
+  void set_select(size_t index);
+  // 平时靠 stdio 的缓冲，不是每个按键都写文件；当前这个按键的记录还是要等到下一个按键
+  void flush();
+
+  /*
+    读整个文件，给 fanime-keytrace 用
+    Return: 文件头不对的时候返回 false
+  */
+  static bool read(const std::string &path, std::vector<Record> &records);
+
+private:
+  bool enabled_;
+  size_t max_bytes;
+  std::string path;
+  FILE *file = nullptr;
+  size_t written = 0;
+  Record cur{};
+  bool has_cur = false;
+  uint64_t key_start_ns = 0;
+  uint64_t last_key_ns = 0;
+
+  bool open();
+  void write(const Record &record);
+};
+
+#endif // FAN_KEYSTROKE_TRACE_H
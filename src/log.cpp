@@ -1,6 +1,7 @@
 #include "log.h"
 #include <iostream>
 #include <ctime>
+#include <unordered_map>
 
 Log::Log(const std::string &filename) : log_file(filename, std::ios_base::app) {
   if (!log_file.is_open()) {
@@ -14,6 +15,36 @@ Log::~Log() {
   }
 }
 
+namespace {
+
+std::mutex registry_mutex;
+
+std::unordered_map<std::string, std::weak_ptr<Log>> &registry() {
+  static std::unordered_map<std::string, std::weak_ptr<Log>> logs;
+  return logs;
+}
+
+} // namespace
+
+std::shared_ptr<Log> Log::shared(const std::string &filename) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  auto &each = registry()[filename];
+  auto log = each.lock();
+  if (!log) {
+    log = std::make_shared<Log>(filename);
+    each = log;
+  }
+  return log;
+}
+
+size_t Log::shared_cnt() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  size_t cnt = 0;
+  for (const auto &[filename, each] : registry())
+    cnt += !each.expired();
+  return cnt;
+}
+
 void Log::info(const std::string &message) { write(INFO, message); }
 
 void Log::warning(const std::string &message) { write(WARNING, message); }
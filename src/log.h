@@ -3,6 +3,7 @@
 
 #include <string>
 #include <fstream>
+#include <memory>
 #include <mutex>
 
 class Log {
@@ -10,6 +11,13 @@ public:
   enum Level { INFO, WARNING, ERROR };
 
   Log(const std::string &filename);
+  /*
+    同一个文件只打开一次: 输入法进程里面好几个地方都写 app.log，共用一个 ofstream 和锁，
+    少几个文件缓冲区，行也不会互相插到一起
+  */
+  static std::shared_ptr<Log> shared(const std::string &filename);
+  // 现在还打开着的 shared 的个数
+  static size_t shared_cnt();
 
   ~Log();
 
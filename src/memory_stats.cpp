@@ -0,0 +1,82 @@
+#include "memory_stats.h"
+#include "config.h"
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+
+MemoryStats::MemoryStats() {
+  auto &config = FanimeConfig::instance();
+  budget_bytes = static_cast<uint64_t>(std::max(0, config.get_int("memory_budget_mb", 0))) << 20;
+  trim_margin_bytes = static_cast<uint64_t>(std::max(0, config.get_int("memory_trim_margin_mb", 8))) << 20;
+  trim_interval = std::chrono::seconds(std::max(0, config.get_int("memory_trim_interval_sec", 60)));
+}
+
+bool MemoryStats::over_budget() {
+  auto [resident, shared] = process_resident();
+  anon_bytes = resident > shared ? resident - shared : 0;
+  peak_anon_bytes = std::max(peak_anon_bytes, anon_bytes);
+  return budget_bytes > 0 && anon_bytes > budget_bytes;
+}
+
+bool MemoryStats::should_trim() {
+  if (!over_budget())
+    return false;
+  if (!last_trim_anon)
+    return true;
+  return anon_bytes >= last_trim_anon + trim_margin_bytes || std::chrono::steady_clock::now() - last_trim >= trim_interval;
+}
+
+bool MemoryStats::record_trim() {
+  trims++;
+  bool over = over_budget();
+  // 回到预算以内的话下一次超过就可以马上收缩
+  last_trim_anon = over ? std::max<uint64_t>(anon_bytes, 1) : 0;
+  last_trim = std::chrono::steady_clock::now();
+  return !over;
+}
+
+void MemoryStats::record(const std::string &name, uint64_t bytes, uint64_t entries_cnt, bool mapped) {
+  auto &entry = entries[name];
+  entry.cur = Usage{bytes, entries_cnt};
+  entry.peak.bytes = std::max(entry.peak.bytes, bytes);
+  entry.peak.entries = std::max(entry.peak.entries, entries_cnt);
+  entry.mapped = mapped;
+}
+
+void MemoryStats::dump(std::ostream &out) {
+  over_budget();
+  auto [resident, shared] = process_resident();
+  sqlite3_int64 sqlite_cur = 0, sqlite_peak = 0;
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &sqlite_cur, &sqlite_peak, 0);
+  out << "[memory]\n";
+  out << "resident=" << resident << " shared=" << shared << " anon=" << anon_bytes << " peak_anon=" << peak_anon_bytes << "\n";
+  out << "budget=" << budget_bytes << " trims=" << trims << "\n";
+  out << "sqlite_heap bytes=" << sqlite_cur << " peak_bytes=" << sqlite_peak << "\n";
+  uint64_t heap_total = 0;
+  for (const auto &[name, entry] : entries) {
+    out << name << (entry.mapped ? "(mmap)" : "") << " bytes=" << entry.cur.bytes << " entries=" << entry.cur.entries << " peak_bytes=" << entry.peak.bytes << " peak_entries=" << entry.peak.entries << "\n";
+    // sqlite 的 page cache 已经算在 sqlite_heap 里面了
+    if (!entry.mapped && name.compare(0, 7, "sqlite_") != 0)
+      heap_total += entry.cur.bytes;
+  }
+  out << "accounted_heap=" << heap_total + static_cast<uint64_t>(sqlite_cur) << "\n";
+}
+
+/*
+  /proc/self/statm 的第二、三个数: 常驻的页数，其中和文件共享的页数
+*/
+std::pair<uint64_t, uint64_t> MemoryStats::process_resident() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0, shared = 0;
+  if (!(statm >> size >> resident >> shared))
+    return {0, 0};
+  uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  return {resident * page, shared * page};
+}
+
+uint64_t MemoryStats::file_size(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
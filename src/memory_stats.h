@@ -0,0 +1,94 @@
+#ifndef FAN_MEMORY_STATS_H
+#define FAN_MEMORY_STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/*
+  进程的内存都花在哪里: 每个子系统占了多少字节、多少项，以及到现在为止的峰值，写到 stats.txt 的 [memory] 一节
+
+  - 各个子系统自己估算，只算容器和字符串在堆上的大小，malloc 自己的开销不算，所以比实际的少一点
+  - mmap 的文件(typo_index.bin、next_word.bin)单独标出来，这些页内核可以随时丢掉，不算在预算里面
+  - 预算和进程的匿名内存(statm 的 resident - shared)比较，词库 mmap 进来的页也是 shared，不算
+  - 超过预算的时候由调用者收缩: 清空查询缓存和造句的缓存、释放 sqlite 的 page cache、把空闲的堆还给系统
+  - 收缩之后还是超过预算的话(常驻的部分本来就比预算大)，不能每次上屏都再收缩一次:
+    比上一次收缩完多了 memory_trim_margin_mb，或者离上一次过了 memory_trim_interval_sec 才再收缩
+
+  config.txt:
+      memory_budget_mb=0              匿名内存超过多少 MB 的时候收缩，为 0 时不限制
+      memory_trim_margin_mb=8
+      memory_trim_interval_sec=60
+*/
+class MemoryStats {
+public:
+  struct Usage {
+    uint64_t bytes = 0;
+    uint64_t entries = 0;
+  };
+
+  MemoryStats();
+
+  bool has_budget() const { return budget_bytes > 0; }
+  // 采样一次进程的内存，超过预算的时候返回 true
+  bool over_budget();
+  // 超过预算，并且离上一次收缩涨了足够多或者过了足够久，见上面
+  bool should_trim();
+  /*
+    收缩完调用，再采样一次记下来
+    Return: 收缩之后有没有回到预算以内
+  */
+  bool record_trim();
+  uint64_t anon() const { return anon_bytes; }
+  uint64_t budget() const { return budget_bytes; }
+  /*
+    每次采样都覆盖上一次的值，峰值一直留着
+    mapped: mmap 的文件，不是堆
+  */
+  void record(const std::string &name, uint64_t bytes, uint64_t entries, bool mapped = false);
+  void dump(std::ostream &out);
+
+  // 进程的 resident 和 shared，单位是字节，读不到的时候都是 0
+  static std::pair<uint64_t, uint64_t> process_resident();
+  static uint64_t file_size(const std::string &path);
+
+  // 字符串在堆上的大小，短字符串放在 std::string 自己里面(libstdc++ 最多 15 个字节)，不算
+  static size_t heap_bytes(const std::string &s) { return s.capacity() > 15 ? s.capacity() + 1 : 0; }
+  static size_t heap_bytes(const std::vector<std::tuple<std::string, std::string, int>> &items) {
+    size_t bytes = items.capacity() * sizeof(items[0]);
+    for (const auto &[key, value, weight] : items)
+      bytes += heap_bytes(key) + heap_bytes(value);
+    return bytes;
+  }
+  // unordered_map / unordered_set 的桶和节点，节点里面的字符串由调用者另外加上
+  template <typename Table> static size_t table_bytes(const Table &table) {
+    return table.bucket_count() * sizeof(void *) + table.size() * (sizeof(typename Table::value_type) + 2 * sizeof(void *));
+  }
+
+private:
+  struct Entry {
+    Usage cur;
+    Usage peak;
+    bool mapped = false;
+  };
+
+  uint64_t budget_bytes = 0;
+  uint64_t anon_bytes = 0;
+  uint64_t peak_anon_bytes = 0;
+  size_t trims = 0;
+  uint64_t trim_margin_bytes;
+  std::chrono::steady_clock::duration trim_interval;
+  // 上一次收缩完的匿名内存和时间，还没收缩过的时候 last_trim_anon 为 0
+  uint64_t last_trim_anon = 0;
+  std::chrono::steady_clock::time_point last_trim;
+  // 按名字排好序，stats.txt 里面的顺序固定
+  std::map<std::string, Entry> entries;
+};
+
+#endif // FAN_MEMORY_STATS_H
@@ -0,0 +1,285 @@
+#include "next_word.h"
+#include "config.h"
+#include "memory_stats.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+static_assert(sizeof(NextWordIndex::Header) == 40, "next word index header must stay 40 bytes");
+static_assert(sizeof(NextWordIndex::Pred) == 8, "next word index pred must stay 8 bytes");
+
+namespace {
+
+size_t align8(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+// 上下文里面 trigram 和 bigram 的权重
+const double TRIGRAM_WEIGHT = 0.6;
+const double BIGRAM_WEIGHT = 0.4;
+
+void add_scores(std::vector<std::pair<std::string, double>> &scores, const std::vector<std::pair<std::string, double>> &counts, double weight) {
+  double total = 0;
+  for (const auto &[word, count] : counts)
+    total += count;
+  if (total <= 0)
+    return;
+  for (const auto &[word, count] : counts) {
+    auto it = std::find_if(scores.begin(), scores.end(), [&word](const auto &each) { return each.first == word; });
+    if (it == scores.end())
+      scores.emplace_back(word, weight * count / total);
+    else
+      it->second += weight * count / total;
+  }
+}
+
+} // namespace
+
+NextWordIndex::~NextWordIndex() {
+  if (mapped)
+    munmap(mapped, mapped_size);
+}
+
+bool NextWordIndex::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  auto *head = static_cast<const Header *>(addr);
+  size_t file_size = static_cast<size_t>(st.st_size);
+  bool valid = memcmp(head->magic, MAGIC, sizeof(MAGIC)) == 0 && head->version == VERSION && head->bucket_bits >= 1 && head->bucket_bits <= 30 && head->ctx_cnt < file_size / 12 && head->pred_cnt <= file_size / 8 && head->pool_size <= file_size;
+  size_t buckets_offset = sizeof(Header);
+  size_t hashes_offset = 0, starts_offset = 0, preds_offset = 0, pool_offset = 0;
+  if (valid) {
+    hashes_offset = align8(buckets_offset + ((size_t{1} << head->bucket_bits) + 1) * sizeof(uint32_t));
+    starts_offset = hashes_offset + head->ctx_cnt * sizeof(uint64_t);
+    preds_offset = align8(starts_offset + (head->ctx_cnt + 1) * sizeof(uint32_t));
+    pool_offset = preds_offset + head->pred_cnt * sizeof(Pred);
+    valid = pool_offset + head->pool_size == file_size;
+  }
+  if (!valid) {
+    munmap(addr, st.st_size);
+    return false;
+  }
+  mapped = addr;
+  mapped_size = st.st_size;
+  header = head;
+  const char *base = static_cast<const char *>(addr);
+  buckets = reinterpret_cast<const uint32_t *>(base + buckets_offset);
+  hashes = reinterpret_cast<const uint64_t *>(base + hashes_offset);
+  starts = reinterpret_cast<const uint32_t *>(base + starts_offset);
+  preds = reinterpret_cast<const Pred *>(base + preds_offset);
+  pool = base + pool_offset;
+  // 每次上屏只碰一两个桶，不要预读
+  madvise(mapped, mapped_size, MADV_RANDOM);
+  return true;
+}
+
+std::vector<std::pair<std::string, uint32_t>> NextWordIndex::lookup(const std::string &context) const {
+  std::vector<std::pair<std::string, uint32_t>> res;
+  if (!header || header->ctx_cnt == 0)
+    return res;
+  uint64_t key = hash(context);
+  uint64_t bucket = key >> (64 - header->bucket_bits);
+  uint64_t end = std::min<uint64_t>(buckets[bucket + 1], header->ctx_cnt);
+  for (uint64_t i = buckets[bucket]; i < end && hashes[i] <= key; i++) {
+    if (hashes[i] != key)
+      continue;
+    for (uint64_t j = starts[i]; j < starts[i + 1] && j < header->pred_cnt; j++) {
+      // 文件坏了也不要读到外面去
+      if (preds[j].word >= header->pool_size)
+        continue;
+      const char *word = pool + preds[j].word;
+      res.emplace_back(std::string(word, strnlen(word, header->pool_size - preds[j].word)), preds[j].count);
+    }
+    break;
+  }
+  return res;
+}
+
+uint64_t NextWordIndex::hash(const std::string &context) {
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : context) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string NextWordIndex::context_key(const std::string &prev2, const std::string &prev1) { return prev2.empty() ? prev1 : prev2 + '\t' + prev1; }
+
+uint32_t NextWordIndex::bucket_bits_for(uint64_t ctx_cnt) {
+  uint32_t bits = 1;
+  while (bits < 30 && (uint64_t{1} << bits) < ctx_cnt)
+    bits++;
+  return bits;
+}
+
+NextWordPredictor::NextWordPredictor() {
+  auto &config = FanimeConfig::instance();
+  enabled_ = config.get_bool("next_word_prediction", false);
+  max_user_contexts = static_cast<size_t>(std::max(1, config.get_int("next_word_user_contexts", 4096)));
+}
+
+/*
+  每一行: 次数 \t 词 \t 上下文(trigram 的上下文本身也带一个 \t)
+*/
+bool NextWordPredictor::load_user(const std::string &path) {
+  std::ifstream user_file(path);
+  if (!user_file.is_open())
+    return false;
+  std::string line;
+  while (std::getline(user_file, line)) {
+    size_t first = line.find('\t');
+    size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+    if (second == std::string::npos)
+      continue;
+    double count = std::atof(line.substr(0, first).c_str());
+    std::string word = line.substr(first + 1, second - first - 1);
+    auto &counts = user[line.substr(second + 1)];
+    if (count > 0 && counts.size() < MAX_USER_WORDS)
+      counts.emplace_back(std::move(word), count);
+  }
+  return true;
+}
+
+bool NextWordPredictor::save_user(const std::string &path) const {
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream user_file(tmp_path, std::ios::trunc);
+    if (!user_file.is_open())
+      return false;
+    for (const auto &[context, counts] : user)
+      for (const auto &[word, count] : counts)
+        user_file << count << '\t' << word << '\t' << context << '\n';
+    if (!user_file.good())
+      return false;
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+size_t NextWordPredictor::user_memory_bytes() const {
+  size_t bytes = MemoryStats::table_bytes(user);
+  for (const auto &[context, counts] : user) {
+    bytes += MemoryStats::heap_bytes(context) + counts.capacity() * sizeof(counts[0]);
+    for (const auto &each : counts)
+      bytes += MemoryStats::heap_bytes(each.first);
+  }
+  return bytes;
+}
+
+void NextWordPredictor::commit(const std::string &text) {
+  if (!enabled_ || !is_word(text)) {
+    break_context();
+    return;
+  }
+  if (!prev1.empty()) {
+    learn(NextWordIndex::context_key("", prev1), text);
+    if (!prev2.empty())
+      learn(NextWordIndex::context_key(prev2, prev1), text);
+  }
+  prev2 = std::move(prev1);
+  prev1 = text;
+}
+
+void NextWordPredictor::break_context() {
+  prev1.clear();
+  prev2.clear();
+}
+
+std::vector<std::string> NextWordPredictor::predict(size_t cnt) const {
+  std::vector<std::string> res;
+  if (!enabled_ || prev1.empty())
+    return res;
+  std::vector<std::pair<std::string, double>> scores;
+  std::string bigram = NextWordIndex::context_key("", prev1);
+  std::string trigram = prev2.empty() ? "" : NextWordIndex::context_key(prev2, prev1);
+  if (index_) {
+    auto to_counts = [](const std::vector<std::pair<std::string, uint32_t>> &rows) {
+      std::vector<std::pair<std::string, double>> counts;
+      for (const auto &[word, count] : rows)
+        counts.emplace_back(word, count);
+      return counts;
+    };
+    if (!trigram.empty())
+      add_scores(scores, to_counts(index_->lookup(trigram)), TRIGRAM_WEIGHT);
+    add_scores(scores, to_counts(index_->lookup(bigram)), BIGRAM_WEIGHT);
+  }
+  if (!trigram.empty())
+    if (auto it = user.find(trigram); it != user.end())
+      add_scores(scores, it->second, TRIGRAM_WEIGHT * USER_BOOST);
+  if (auto it = user.find(bigram); it != user.end())
+    add_scores(scores, it->second, BIGRAM_WEIGHT * USER_BOOST);
+  std::stable_sort(scores.begin(), scores.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+  for (size_t i = 0; i < scores.size() && i < cnt; i++)
+    res.push_back(std::move(scores[i].first));
+  return res;
+}
+
+bool NextWordPredictor::is_word(const std::string &text) {
+  size_t chars = 0;
+  for (size_t i = 0; i < text.size(); chars++) {
+    unsigned char c = text[i];
+    uint32_t cp;
+    size_t len;
+    if (c >= 0xF0 && c < 0xF8) {
+      cp = c & 0x07;
+      len = 4;
+    } else if (c >= 0xE0 && c < 0xF0) {
+      cp = c & 0x0F;
+      len = 3;
+    } else {
+      // 汉字至少是三个字节
+      return false;
+    }
+    if (i + len > text.size())
+      return false;
+    for (size_t j = 1; j < len; j++)
+      cp = cp << 6 | (static_cast<unsigned char>(text[i + j]) & 0x3F);
+    bool han = (cp >= 0x3400 && cp <= 0x9FFF) || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x20000 && cp <= 0x3FFFF);
+    if (!han)
+      return false;
+    i += len;
+  }
+  return chars > 0 && chars <= MAX_WORD_CHARS;
+}
+
+/*
+  次数加一，一个上下文只留 MAX_USER_WORDS 个词，满了就替换掉次数最少的
+*/
+void NextWordPredictor::learn(const std::string &context, const std::string &word) {
+  auto &counts = user[context];
+  auto it = std::find_if(counts.begin(), counts.end(), [&word](const auto &each) { return each.first == word; });
+  if (it != counts.end()) {
+    it->second += 1;
+  } else if (counts.size() < MAX_USER_WORDS) {
+    counts.emplace_back(word, 1);
+  } else {
+    auto least = std::min_element(counts.begin(), counts.end(), [](const auto &a, const auto &b) { return a.second < b.second; });
+    *least = {word, 1};
+  }
+  if (user.size() > max_user_contexts)
+    decay();
+}
+
+void NextWordPredictor::decay() {
+  for (auto it = user.begin(); it != user.end();) {
+    auto &counts = it->second;
+    for (auto &each : counts)
+      each.second /= 2;
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [](const auto &each) { return each.second < 1; }), counts.end());
+    it = counts.empty() ? user.erase(it) : std::next(it);
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef FAN_NEXT_WORD_H
+#define FAN_NEXT_WORD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+  前一个词(或者前两个词)之后最常出现的词，由 fanime-nextword 从分好词的语料离线生成，查询时 mmap 进来只读
+
+  - 上下文是前一个词(bigram)或者前两个词中间加一个 '\t'(trigram)，压成 64 位的 FNV-1a 哈希，按哈希排好序
+  - 哈希的高 bucket_bits 位分桶，桶的个数不少于上下文的个数，每个桶记住自己在排好序的数组里面从哪里开始，
+    查询就是定位到桶、在桶里面往后比较几个哈希，和上下文的个数无关
+  - 每个上下文最多保留 top 个词，按出现次数降序
+
+  文件格式(小端): Header，(1 << bucket_bits) + 1 个 uint32 的桶的起点，补齐到 8 字节，
+                  ctx_cnt 个 uint64 的哈希(升序)，ctx_cnt + 1 个 uint32 的词的起点，补齐到 8 字节，
+                  pred_cnt 个 Pred，pool_size 字节的词(以 '\0' 结尾)
+*/
+class NextWordIndex {
+public:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket_bits;
+    uint64_t ctx_cnt;
+    uint64_t pred_cnt;
+    uint64_t pool_size;
+  };
+  struct Pred {
+    uint32_t word; // 在 pool 里面的偏移
+    uint32_t count;
+  };
+  static constexpr char MAGIC[8] = {'F', 'A', 'N', 'N', 'E', 'X', 'T', '\0'};
+  static constexpr uint32_t VERSION = 1;
+
+  NextWordIndex() = default;
+  ~NextWordIndex();
+  NextWordIndex(const NextWordIndex &) = delete;
+  NextWordIndex &operator=(const NextWordIndex &) = delete;
+
+  // 文件不存在或者格式不对的时候返回 false
+  bool open(const std::string &path);
+  size_t size() const { return header ? header->ctx_cnt : 0; }
+  size_t mapped_bytes() const { return mapped_size; }
+  /*
+    context: 见 context_key
+    Return: 这个上下文之后的词以及出现次数，次数从高到低，没有的时候返回空
+  */
+  std::vector<std::pair<std::string, uint32_t>> lookup(const std::string &context) const;
+
+  static uint64_t hash(const std::string &context);
+  // prev2 为空的时候是 bigram
+  static std::string context_key(const std::string &prev2, const std::string &prev1);
+  // 桶的个数不少于 ctx_cnt 的最小的位数，fanime-nextword 使用
+  static uint32_t bucket_bits_for(uint64_t ctx_cnt);
+
+private:
+  void *mapped = nullptr;
+  size_t mapped_size = 0;
+  const Header *header = nullptr;
+  const uint32_t *buckets = nullptr;
+  const uint64_t *hashes = nullptr;
+  const uint32_t *starts = nullptr;
+  const Pred *preds = nullptr;
+  const char *pool = nullptr;
+};
+
+/*
+  上屏之后预测下一个词: 离线的 NextWordIndex 加上用户自己上屏的习惯
+
+  - 记住最近上屏的两个词，标点、回车、切换窗口之后重新开始
+  - 用户层: 每次上屏都记一次 (前一个词 -> 这个词) 和 (前两个词 -> 这个词)，
+    上下文超过 next_word_user_contexts 个的时候计数整体减半，忘掉不常用的，保存在 next_word_user.txt
+  - 分数: trigram 和 bigram 的相对频率按 0.6 / 0.4 加权，用户层按同样的方式算，再乘以 USER_BOOST 加上去
+  - 只在主线程使用；词库目录下面的 next_word.bin 被替换之后在后台线程打开新的，回到主线程再 set_index
+
+  config.txt:
+      next_word_prediction=0         打开之后上屏之后马上显示预测的下一个词，数字键选择，别的键关掉
+      next_word_user_contexts=4096   用户层最多记住多少个上下文
+*/
+class NextWordPredictor {
+public:
+  // 太长的一般是整句，不当作一个词
+  static constexpr size_t MAX_WORD_CHARS = 8;
+  static constexpr size_t MAX_USER_WORDS = 8;
+  static constexpr double USER_BOOST = 2.0;
+
+  NextWordPredictor();
+
+  bool enabled() const { return enabled_; }
+  void set_index(std::shared_ptr<const NextWordIndex> index) { index_ = std::move(index); }
+  bool load_user(const std::string &path);
+  bool save_user(const std::string &path) const;
+  size_t user_size() const { return user.size(); }
+  // 用户层在堆上的大小
+  size_t user_memory_bytes() const;
+  const std::shared_ptr<const NextWordIndex> &index() const { return index_; }
+
+  // 上屏了 text，不是汉字的词(标点之类)相当于 break_context
+  void commit(const std::string &text);
+  void break_context();
+  /*
+    Return: 最近上屏的词之后最可能的 cnt 个词，分数从高到低，没有上下文的时候返回空
+  */
+  std::vector<std::string> predict(size_t cnt) const;
+
+  // 全部是汉字，而且不超过 MAX_WORD_CHARS 个字
+  static bool is_word(const std::string &text);
+
+private:
+  using Counts = std::vector<std::pair<std::string, double>>;
+
+  bool enabled_;
+  size_t max_user_contexts;
+  std::shared_ptr<const NextWordIndex> index_;
+  std::unordered_map<std::string, Counts> user;
+  std::string prev1, prev2;
+
+  void learn(const std::string &context, const std::string &word);
+  void decay();
+};
+
+#endif // FAN_NEXT_WORD_H
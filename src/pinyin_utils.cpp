@@ -3,6 +3,7 @@
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include <cstdlib>
+#include <atomic>
 #include "../utfcpp/source/utf8.h"
 
 std::string PinyinUtil::get_home_path() {
@@ -21,29 +22,37 @@ std::unordered_map<std::string, std::string> PinyinUtil::zero_sm_keymaps_reverse
 std::unordered_map<std::string, std::string> PinyinUtil::ym_keymaps{{"iu", "q"}, {"ei", "w"}, {"e", "e"}, {"uan", "r"}, {"ue", "t"}, {"ve", "t"}, {"un", "y"}, {"u", "u"}, {"i", "i"}, {"uo", "o"}, {"o", "o"}, {"ie", "p"}, {"a", "a"}, {"ong", "s"}, {"iong", "s"}, {"ai", "d"}, {"en", "f"}, {"eng", "g"}, {"ang", "h"}, {"an", "j"}, {"uai", "k"}, {"ing", "k"}, {"uang", "l"}, {"iang", "l"}, {"ou", "z"}, {"ua", "x"}, {"ia", "x"}, {"ao", "c"}, {"ui", "v"}, {"v", "v"}, {"in", "b"}, {"iao", "n"}, {"ian", "m"}};
 std::unordered_map<std::string, std::string> PinyinUtil::ym_keymaps_reversed{{"q", "iu"}, {"w", "ei"}, {"e", "e"}, {"r", "uan"}, {"t", "ve"}, {"y", "un"}, {"u", "u"}, {"i", "i"}, {"o", "o"}, {"p", "ie"}, {"a", "a"}, {"s", "iong"}, {"d", "ai"}, {"f", "en"}, {"g", "eng"}, {"h", "ang"}, {"j", "an"}, {"k", "ing"}, {"l", "iang"}, {"z", "ou"}, {"x", "ia"}, {"c", "ao"}, {"v", "v"}, {"b", "in"}, {"n", "iao"}, {"m", "ian"}};
 
-std::unordered_set<std::string> &initialize_quanpin_set() {
-  static std::unordered_set<std::string> tmp_set;
-  std::ifstream pinyin_path(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/pinyin.txt");
+std::shared_ptr<const PinyinAssets> PinyinUtil::load_assets(const std::string &data_dir) {
+  auto new_assets = std::make_shared<PinyinAssets>();
+  std::ifstream pinyin_path(data_dir + "/pinyin.txt");
   std::string line;
   while (std::getline(pinyin_path, line)) {
     line.erase(std::remove_if(line.begin(), line.end(), [](unsigned char x) { return std::isspace(x); }), line.end());
-    tmp_set.insert(line);
+    new_assets->quanpin_set.insert(line);
   }
-  return tmp_set;
-}
-std::unordered_set<std::string> &PinyinUtil::quanpin_set = initialize_quanpin_set();
-
-std::unordered_map<std::string, std::string> &initialize_helpcode_keymap() {
-  static std::unordered_map<std::string, std::string> tmp_map;
-  std::ifstream helpcode_path(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime/helpcode.txt");
-  std::string line;
+  std::ifstream helpcode_path(data_dir + "/helpcode.txt");
   while (std::getline(helpcode_path, line)) {
     size_t pos = line.find('=');
-    tmp_map[line.substr(0, pos)] = line.substr(pos + 1, 2);
+    new_assets->helpcode_keymap[line.substr(0, pos)] = line.substr(pos + 1, 2);
   }
-  return tmp_map;
+  new_assets->helpcode_bmp.assign(0x10000, 0);
+  for (const auto &[han_char, helpcode] : new_assets->helpcode_keymap) {
+    uint32_t codepoint;
+    if (!decode_bmp_char(han_char, 0, han_char.size(), codepoint) || helpcode.empty())
+      continue;
+    new_assets->helpcode_bmp[codepoint] = static_cast<uint8_t>(helpcode[0]) | (helpcode.size() > 1 ? static_cast<uint8_t>(helpcode[1]) << 8 : 0);
+  }
+  return new_assets;
+}
+
+static std::atomic<std::shared_ptr<const PinyinAssets>> &current_assets() {
+  static std::atomic<std::shared_ptr<const PinyinAssets>> tmp_assets{PinyinUtil::load_assets(PinyinUtil::get_home_path() + "/.local/share/fcitx5-fanime")};
+  return tmp_assets;
 }
-std::unordered_map<std::string, std::string> &PinyinUtil::helpcode_keymap = initialize_helpcode_keymap();
+
+std::shared_ptr<const PinyinAssets> PinyinUtil::assets() { return current_assets().load(); }
+
+void PinyinUtil::publish_assets(std::shared_ptr<const PinyinAssets> new_assets) { current_assets().store(std::move(new_assets)); }
 
 /*
   把小鹤双拼转换为拼音(全拼)
@@ -73,8 +82,9 @@ std::string PinyinUtil::cvt_single_sp_to_pinyin(std::string sp_str) {
   if (sm == "" || ym_list.size() == 0) {
     return "";
   }
+  auto cur_assets = assets();
   for (const auto &ym : ym_list) {
-    if (quanpin_set.count(sm + ym) > 0) {
+    if (cur_assets->quanpin_set.count(sm + ym) > 0) {
       res = sm + ym;
     }
   }
@@ -89,30 +99,23 @@ std::string PinyinUtil::pinyin_segmentation(std::string sp_str) {
   if (sp_str.size() == 1) {
     return sp_str;
   }
-  std::string res("");
+  // 原地追加，不要 res = res + ...，整句的输入码每次都拷贝一遍是平方的
+  std::string res;
+  res.reserve(sp_str.size() * 3 / 2);
   std::string::size_type range_start = 0;
+  auto cur_assets = assets();
   while (range_start < sp_str.size()) {
-    if ((range_start + 2) <= sp_str.size()) {
-      // 先切两个字符看看
-      std::string cur_sp = sp_str.substr(range_start, 2);
-      if (quanpin_set.count(cvt_single_sp_to_pinyin(cur_sp)) > 0) {
-        res = res + "'" + cur_sp;
-        range_start += 2;
-      } else {
-        res = res + "'" + cur_sp.substr(0, 1);
-        range_start += 1;
-      }
+    if (!res.empty())
+      res += '\'';
+    // 先切两个字符看看
+    if ((range_start + 2) <= sp_str.size() && cur_assets->quanpin_set.count(cvt_single_sp_to_pinyin(sp_str.substr(range_start, 2))) > 0) {
+      res.append(sp_str, range_start, 2);
+      range_start += 2;
     } else {
-      res = res + "'" + sp_str.substr(sp_str.size() - 1, 1);
+      res += sp_str[range_start];
       range_start += 1;
     }
   }
-  while (!res.empty() && res[0] == '\'') {
-    res.erase(0, 1);
-  }
-  while (!res.empty() && res[res.size()] == '\'') {
-    res.erase(res.size() - 1, 1);
-  }
   return res;
 }
 
@@ -196,6 +199,28 @@ std::string::size_type PinyinUtil::cnt_han_chars(std::string words) {
   return cnt;
 }
 
+/*
+  只认最短的编码，这样和 helpcode_keymap 里面的 key 按字节比较的结果是一样的
+*/
+bool PinyinUtil::decode_bmp_char(const std::string &words, size_t index, size_t len, uint32_t &codepoint) {
+  if (len == 0 || len > 3 || index + len > words.size())
+    return false;
+  unsigned char lead = words[index];
+  for (size_t i = 1; i < len; i++)
+    if ((static_cast<unsigned char>(words[index + i]) & 0xc0) != 0x80)
+      return false;
+  if (len == 1) {
+    codepoint = lead;
+    return lead < 0x80;
+  }
+  if (len == 2) {
+    codepoint = (lead & 0x1f) << 6 | (words[index + 1] & 0x3f);
+    return (lead & 0xe0) == 0xc0 && codepoint >= 0x80;
+  }
+  codepoint = (lead & 0x0f) << 12 | (words[index + 1] & 0x3f) << 6 | (words[index + 2] & 0x3f);
+  return (lead & 0xf0) == 0xe0 && codepoint >= 0x800;
+}
+
 /**
  * @brief Compute helpcodes
  *
@@ -206,24 +231,26 @@ std::string::size_type PinyinUtil::cnt_han_chars(std::string words) {
  * @return string Helpcodes surrounded by ()
  */
 std::string PinyinUtil::compute_helpcodes(std::string words) {
+  auto cur_assets = assets();
+  const auto &helpcode_keymap = cur_assets->helpcode_keymap;
   std::string helpcodes("");
   if (cnt_han_chars(words) == 1) {
     if (helpcode_keymap.count(words)) {
-      helpcodes += helpcode_keymap[words];
+      helpcodes += helpcode_keymap.at(words);
       helpcodes[1] = toupper(helpcodes[1]);
     }
   } else {
     // First
     std::string firstHan = get_first_han_char(words);
     if (helpcode_keymap.count(firstHan)) {
-      helpcodes += helpcode_keymap[firstHan].substr(0, 1);
+      helpcodes += helpcode_keymap.at(firstHan).substr(0, 1);
     } else {
       return "";
     }
     // Second
     std::string lastHan = get_last_han_char(words);
     if (helpcode_keymap.count(lastHan)) {
-      helpcodes += helpcode_keymap[lastHan].substr(0, 1);
+      helpcodes += helpcode_keymap.at(lastHan).substr(0, 1);
       helpcodes[1] = toupper(helpcodes[1]);
     } else {
       return "";
@@ -7,6 +7,19 @@
 #include <algorithm>
 #include <cctype>
 #include <unordered_map>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+/*
+  从 pinyin.txt 和 helpcode.txt 加载的数据，热加载时整体替换，不会原地修改
+*/
+struct PinyinAssets {
+  std::unordered_set<std::string> quanpin_set;
+  std::unordered_map<std::string, std::string> helpcode_keymap;
+  // helpcode_keymap 里面 BMP 范围内的字按码点直接查，两个辅助码字母拼成一个 uint16(低位是第一个)，没有的是 0
+  std::vector<uint16_t> helpcode_bmp;
+};
 
 class PinyinUtil {
 public:
@@ -19,8 +32,10 @@ public:
   static std::unordered_map<std::string, std::string> zero_sm_keymaps_reversed;
   static std::unordered_map<std::string, std::string> ym_keymaps;
   static std::unordered_map<std::string, std::string> ym_keymaps_reversed;
-  static std::unordered_set<std::string> &quanpin_set;
-  static std::unordered_map<std::string, std::string> &helpcode_keymap;
+  // 当前的一份，调用者持有返回值期间不会被释放
+  static std::shared_ptr<const PinyinAssets> assets();
+  static std::shared_ptr<const PinyinAssets> load_assets(const std::string &data_dir);
+  static void publish_assets(std::shared_ptr<const PinyinAssets> new_assets);
   static std::string cvt_single_sp_to_pinyin(std::string sp_str);
   static std::string pinyin_segmentation(std::string sp_str);
   static std::string::size_type get_first_char_size(std::string words);
@@ -28,6 +43,8 @@ public:
   static std::string::size_type get_last_char_size(std::string words);
   static std::string get_last_han_char(const std::string &words);
   static std::string::size_type cnt_han_chars(std::string words);
+  // words[index, index + len) 刚好是一个 BMP 范围内的字的话，取出它的码点
+  static bool decode_bmp_char(const std::string &words, size_t index, size_t len, uint32_t &codepoint);
   static std::string compute_helpcodes(std::string words);
   static std::string extract_preview(std::string candidate);
   static bool is_all_complete_pinyin(std::string pure_pinyin, std::string seg_pinyin);
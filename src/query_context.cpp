@@ -0,0 +1,84 @@
+#include "query_context.h"
+#include "pinyin_utils.h"
+#include <algorithm>
+#include <cctype>
+
+std::shared_ptr<const QueryContext> QueryContext::build(const std::string &input, const QueryContext *prev) {
+  auto ctx = std::make_shared<QueryContext>();
+  ctx->input_ = input;
+  ctx->code_ = input;
+  std::transform(ctx->code_.begin(), ctx->code_.end(), ctx->code_.begin(), [](unsigned char c) { return std::tolower(c); });
+  const std::string &code = ctx->code_;
+
+  // 1. 分词，复用上一次按键完全落在共同前缀里面的音节
+  size_t pos = 0;
+  if (prev) {
+    size_t common = std::mismatch(code.begin(), code.end(), prev->code_.begin(), prev->code_.end()).first - code.begin();
+    for (const auto &seg : prev->segments_) {
+      if (seg.start + 2 > common)
+        break;
+      ctx->segments_.push_back(seg);
+      pos = seg.start + seg.len;
+    }
+  }
+  if (code.size() == 1) {
+    ctx->segments_.push_back(Segment{0, 1, SyllableKind::Initial});
+    pos = 1;
+  }
+  auto assets = PinyinUtil::assets();
+  while (pos < code.size()) {
+    if (pos + 2 <= code.size() && assets->quanpin_set.count(PinyinUtil::cvt_single_sp_to_pinyin(code.substr(pos, 2)))) {
+      ctx->segments_.push_back(Segment{pos, 2, SyllableKind::Full});
+      pos += 2;
+    } else {
+      ctx->segments_.push_back(Segment{pos, 1, SyllableKind::Initial});
+      pos += 1;
+    }
+  }
+  ctx->seg_pinyin_ = ctx->join(code, ctx->segments_.size());
+  for (const auto &seg : ctx->segments_)
+    ctx->pinyin_list_.push_back(code.substr(seg.start, seg.len));
+
+  // 2. 辅助码模式
+  auto all_full = [&ctx](size_t segment_cnt) { return std::all_of(ctx->segments_.begin(), ctx->segments_.begin() + segment_cnt, [](const Segment &seg) { return seg.kind == SyllableKind::Full; }); };
+  size_t segment_cnt = ctx->segments_.size();
+  ctx->all_complete_ = code.size() % 2 == 0 && all_full(segment_cnt);
+  ctx->supposed_han_cnt_ = segment_cnt;
+  ctx->raw_pinyin_ = code;
+  // 全码辅助: 前面的拼音里面不能有大写字母，大写的字母不可能是完整的双拼
+  if (code.size() >= 4 && code.size() % 2 == 0 && std::isupper(static_cast<unsigned char>(input.back())) && ctx->segments_within(code.size() - 2) == (code.size() - 2) / 2 && all_full((code.size() - 2) / 2) &&
+      std::none_of(input.begin(), input.end() - 2, [](unsigned char c) { return std::isupper(c); })) {
+    ctx->helpcode_mode_ = HelpcodeMode::Full;
+    ctx->raw_pinyin_ = input.substr(0, input.size() - 2);
+    ctx->supposed_han_cnt_ = (code.size() - 2) / 2;
+  } else if (code.size() >= 3 && code.size() % 2 == 1 && all_full(segment_cnt - 1)) {
+    ctx->helpcode_mode_ = HelpcodeMode::Single;
+    ctx->raw_pinyin_ = code.substr(0, code.size() - 1);
+    ctx->supposed_han_cnt_ = segment_cnt - 1;
+  }
+  return ctx;
+}
+
+size_t QueryContext::segments_within(size_t len) const {
+  size_t cnt = 0;
+  while (cnt < segments_.size() && segments_[cnt].start + segments_[cnt].len <= len)
+    cnt++;
+  return cnt;
+}
+
+std::string QueryContext::join(const std::string &str, size_t segment_cnt) const {
+  std::string res;
+  res.reserve(str.size() + segment_cnt);
+  for (size_t i = 0; i < segment_cnt; i++) {
+    if (i)
+      res += '\'';
+    res.append(str, segments_[i].start, segments_[i].len);
+  }
+  return res;
+}
+
+std::string QueryContext::seg_pinyin_prefix(size_t len) const { return join(code_, segments_within(len)); }
+
+std::vector<std::string> QueryContext::pinyin_list_prefix(size_t len) const { return std::vector<std::string>(pinyin_list_.begin(), pinyin_list_.begin() + segments_within(len)); }
+
+std::string QueryContext::seg_input() const { return join(input_, segments_.size()); }
@@ -0,0 +1,76 @@
+#ifndef FAN_QUERY_CONTEXT_H
+#define FAN_QUERY_CONTEXT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+  一次按键之后输入码的所有派生信息: 分词、辅助码模式、应该有几个汉字等等
+  每次按键只算一次，之后整个流程都只读，不再反复调用 PinyinUtil::pinyin_segmentation
+
+  分词是正向贪心的，某个位置怎么切只取决于从这个位置开始的两个字母，
+  所以和上一次按键的输入码有共同前缀的时候，完全落在共同前缀里面的音节可以直接复用
+*/
+class QueryContext {
+public:
+  enum class SyllableKind {
+    Full,   // 完整的双拼，两个字母
+    Initial // 只有声母，一个字母
+  };
+
+  enum class HelpcodeMode {
+    None,
+    Full,  // 最后两码是辅助码，最后一码大写，前面的全部是完整的双拼
+    Single // 奇数码，最后一码是辅助码，前面的全部是完整的双拼
+  };
+
+  struct Segment {
+    size_t start;
+    size_t len;
+    SyllableKind kind;
+  };
+
+  /*
+    input: 缓冲区里面的原始输入，可能带有大写字母
+    prev: 上一次按键的 context，可以为空
+  */
+  static std::shared_ptr<const QueryContext> build(const std::string &input, const QueryContext *prev);
+
+  const std::string &input() const { return input_; }
+  // 转成小写的输入码
+  const std::string &code() const { return code_; }
+  const std::vector<Segment> &segments() const { return segments_; }
+  // 和 PinyinUtil::pinyin_segmentation(code()) 的结果一样
+  const std::string &seg_pinyin() const { return seg_pinyin_; }
+  // 按音节切好的输入码，词库根据它选表、拼 sql
+  const std::vector<std::string> &pinyin_list() const { return pinyin_list_; }
+  HelpcodeMode helpcode_mode() const { return helpcode_mode_; }
+  // 去掉辅助码之后的拼音
+  const std::string &raw_pinyin() const { return raw_pinyin_; }
+  size_t supposed_han_cnt() const { return supposed_han_cnt_; }
+  // 全部是完整的双拼
+  bool all_complete() const { return all_complete_; }
+
+  // 只包含前 len 个字母的音节
+  std::string seg_pinyin_prefix(size_t len) const;
+  std::vector<std::string> pinyin_list_prefix(size_t len) const;
+  // 用原始输入拼出来的分词，给 preedit 显示用
+  std::string seg_input() const;
+
+private:
+  std::string input_;
+  std::string code_;
+  std::vector<Segment> segments_;
+  std::string seg_pinyin_;
+  std::vector<std::string> pinyin_list_;
+  HelpcodeMode helpcode_mode_ = HelpcodeMode::None;
+  std::string raw_pinyin_;
+  size_t supposed_han_cnt_ = 0;
+  bool all_complete_ = false;
+
+  size_t segments_within(size_t len) const;
+  std::string join(const std::string &str, size_t segment_cnt) const;
+};
+
+#endif // FAN_QUERY_CONTEXT_H
@@ -0,0 +1,134 @@
+#include "sentence_composer.h"
+#include <algorithm>
+#include <cmath>
+#include "config.h"
+#include "memory_stats.h"
+#include "dict.h"
+#include "pinyin_utils.h"
+#include "trace.h"
+
+namespace {
+
+// 每一段拼音取前几个词作为边
+const size_t WORDS_PER_SPAN = 3;
+// 每个词的固定代价，大约是 log(词库里面最大的 weight)，这样拆成几个高频单字不如一个普通的词
+const double WORD_COST = 16.0;
+// 缓存的拼音段太多的时候整个清掉
+const size_t MAX_SPAN_CACHE = 4096;
+
+} // namespace
+
+SentenceComposer::SentenceComposer() {
+  auto &config = FanimeConfig::instance();
+  enabled_ = config.get_bool("native_composer", true);
+  beam_width = static_cast<size_t>(std::max(1, config.get_int("composer_beam", 4)));
+  max_word_len = static_cast<size_t>(std::max(1, config.get_int("composer_max_word_len", 4)));
+}
+
+void SentenceComposer::reset() {
+  syllables.clear();
+  nodes.clear();
+  span_cache.clear();
+}
+
+/*
+  和词库里面其它的查询一样走 generate_cursor，只取前几行；
+  音节里面有简拼的时候查出来的词长度不一定对，只留下字数和音节数相同的
+*/
+size_t SentenceComposer::memory_bytes() const {
+  size_t bytes = MemoryStats::table_bytes(span_cache) + nodes.capacity() * sizeof(Node);
+  for (const auto &[span, words] : span_cache) {
+    bytes += MemoryStats::heap_bytes(span) + words.capacity() * sizeof(words[0]);
+    for (const auto &each : words)
+      bytes += MemoryStats::heap_bytes(each.first);
+  }
+  for (const auto &node : nodes) {
+    bytes += node.paths.capacity() * sizeof(Path);
+    for (const auto &path : node.paths)
+      bytes += MemoryStats::heap_bytes(path.text);
+  }
+  return bytes;
+}
+
+const SentenceComposer::SpanWords &SentenceComposer::lookup(DictionaryUlPb &dict, size_t from, size_t to) {
+  std::string span_key;
+  for (size_t i = from; i < to; i++)
+    span_key += (i > from ? "'" : "") + syllables[i];
+  auto it = span_cache.find(span_key);
+  if (it != span_cache.end())
+    return it->second;
+  if (span_cache.size() >= MAX_SPAN_CACHE)
+    span_cache.clear();
+  lookups++;
+  std::vector<std::string> pinyin_list(syllables.begin() + from, syllables.begin() + to);
+  std::string code = boost::algorithm::join(pinyin_list, "");
+  auto cursor = dict.generate_cursor(code, pinyin_list);
+  SpanWords words;
+  for (size_t row = 0; words.size() < WORDS_PER_SPAN && cursor->fetch(row + 1) > row; row++) {
+    const auto &item = cursor->rows()[row];
+    const std::string &word = std::get<1>(item);
+    if (PinyinUtil::cnt_han_chars(word) != to - from)
+      continue;
+    if (std::any_of(words.begin(), words.end(), [&word](const auto &each) { return each.first == word; }))
+      continue;
+    words.emplace_back(word, std::log(std::max(std::get<2>(item), 0) + 1.0) - WORD_COST);
+  }
+  return span_cache.emplace(std::move(span_key), std::move(words)).first->second;
+}
+
+/*
+  补上 nodes[to]: 所有以 to 结尾、不超过 max_word_len 个音节的词，接在前面节点的路径后面，保留最好的 beam_width 条
+*/
+void SentenceComposer::extend(DictionaryUlPb &dict, size_t to) {
+  std::vector<Edge> edges;
+  for (size_t from = to > max_word_len ? to - max_word_len : 0; from < to; from++) {
+    if (nodes[from].paths.empty())
+      continue;
+    for (const auto &[word, score] : lookup(dict, from, to))
+      edges.push_back(Edge{from, word, score});
+  }
+  std::vector<std::pair<double, std::pair<const Path *, const Edge *>>> expanded;
+  for (const auto &edge : edges)
+    for (const auto &path : nodes[edge.from].paths)
+      expanded.push_back({path.score + edge.score, {&path, &edge}});
+  std::sort(expanded.begin(), expanded.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+  Node node;
+  for (const auto &[score, from_path] : expanded) {
+    if (node.paths.size() >= beam_width)
+      break;
+    std::string text = from_path.first->text + from_path.second->word;
+    // 不同的切分可能得到同样的句子，只留分数高的那个
+    if (std::any_of(node.paths.begin(), node.paths.end(), [&text](const Path &each) { return each.text == text; }))
+      continue;
+    node.paths.push_back(Path{score, std::move(text)});
+  }
+  nodes.push_back(std::move(node));
+}
+
+std::vector<std::string> SentenceComposer::compose(DictionaryUlPb &dict, const std::vector<std::string> &pinyin_list, size_t cnt, uint64_t deadline_ns) {
+  lookups = 0;
+  // 和上一次共同的音节: 以这些音节结尾的节点只依赖前面的音节，可以直接复用
+  size_t common = 0;
+  while (common < syllables.size() && common < pinyin_list.size() && syllables[common] == pinyin_list[common])
+    common++;
+  syllables = pinyin_list;
+  if (nodes.empty())
+    nodes.push_back(Node{{Path{0, ""}}});
+  nodes.resize(std::min(nodes.size(), common + 1));
+  std::vector<std::string> sentences;
+  finished_ = false;
+  for (size_t to = nodes.size(); to <= syllables.size(); to++) {
+    extend(dict, to);
+    if (deadline_ns && to < syllables.size() && FanimeTrace::now_ns(true) > deadline_ns)
+      return sentences;
+  }
+  finished_ = true;
+  if (syllables.empty())
+    return sentences;
+  for (const auto &path : nodes[syllables.size()].paths) {
+    if (sentences.size() >= cnt)
+      break;
+    sentences.push_back(path.text);
+  }
+  return sentences;
+}
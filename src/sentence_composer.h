@@ -0,0 +1,82 @@
+#ifndef FAN_SENTENCE_COMPOSER_H
+#define FAN_SENTENCE_COMPOSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class DictionaryUlPb;
+
+/*
+  词库里面直接查不到的时候，用本地词库自己造句，代替谷歌输入法引擎
+  (谷歌的词表和权重都和 tbl_* 不一样，也看不到用户造的词)
+
+  - 按音节建一张词图: 节点是音节之间的位置，从 i 到 j 的边是词库里面 pinyin_list[i, j) 对应的词
+  - 每个节点只保留分数最高的几条路径(beam search)，词的分数是 log(weight + 1) 再减去一个固定的代价，词越少越好
+  - 用户造的词和调整过的权重通过 DictionaryUlPb 的查询(合并了 overlay)自然地参与进来
+  - 词图跟着输入增量维护: 和上一次相同的那些音节对应的节点直接复用，每次 compose 只补上后面缺的节点，
+    每个节点的查询次数不超过 composer_max_word_len
+  - 只有词库里面查不到的时候才会 compose，所以一串直接查得到的输入之后第一次查不到要把前面的音节都补上；
+    给了期限的时候到期就停下来，补好的节点留着，下一次接着补
+  - 每一段拼音查到的词也缓存起来，删掉再输入的时候不用再查
+
+  config.txt:
+      native_composer=1          关掉之后还是使用谷歌输入法引擎
+      composer_beam=4            每个节点保留几条路径
+      composer_max_word_len=4    词图里面的词最多几个字
+*/
+class SentenceComposer {
+public:
+  SentenceComposer();
+
+  bool enabled() const { return enabled_; }
+  /*
+    pinyin_list: 按音节切好的输入码，见 QueryContext::pinyin_list
+    deadline_ns: FanimeTrace::now_ns 的时间，为 0 的时候不限时间；到期的时候至少也补上一个节点
+    Return: 最多 cnt 个整句，分数从高到低；某个音节一个字也查不到，或者到期还没补完的时候返回空，见 finished
+  */
+  std::vector<std::string> compose(DictionaryUlPb &dict, const std::vector<std::string> &pinyin_list, size_t cnt, uint64_t deadline_ns = 0);
+  // 上一次 compose 有没有把词图补完，没有的话用同样的 pinyin_list 再调用一次
+  bool finished() const { return finished_; }
+  // 用户造词、调整权重、重新加载词库之后调用，之前查到的词都不能再用了
+  void reset();
+  // 上一次 compose 实际去词库查了几次
+  size_t last_lookups() const { return lookups; }
+  // 缓存的每一段拼音查到的词，以及词图
+  size_t cache_size() const { return span_cache.size(); }
+  size_t memory_bytes() const;
+
+private:
+  struct Edge {
+    size_t from;
+    std::string word;
+    double score;
+  };
+  struct Path {
+    double score;
+    std::string text;
+  };
+  struct Node {
+    std::vector<Path> paths;
+  };
+  using SpanWords = std::vector<std::pair<std::string, double>>;
+
+  bool enabled_;
+  size_t beam_width;
+  size_t max_word_len;
+  // 当前词图对应的音节，nodes[j] 是前 j 个音节之后的位置，nodes[0] 是起点
+  std::vector<std::string> syllables;
+  std::vector<Node> nodes;
+  // 一段拼音(音节之间用 ' 隔开) -> 查到的词和分数
+  std::unordered_map<std::string, SpanWords> span_cache;
+  size_t lookups = 0;
+  bool finished_ = true;
+
+  const SpanWords &lookup(DictionaryUlPb &dict, size_t from, size_t to);
+  void extend(DictionaryUlPb &dict, size_t to);
+};
+
+#endif // FAN_SENTENCE_COMPOSER_H
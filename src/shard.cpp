@@ -0,0 +1,29 @@
+#include "shard.h"
+#include <boost/format.hpp>
+
+namespace Shard {
+
+Scheme scheme_from_string(const std::string &name) {
+  if (name == "len_syllable")
+    return Scheme::LenSyllable;
+  return Scheme::LenInitial;
+}
+
+std::string scheme_to_string(Scheme scheme) { return scheme == Scheme::LenSyllable ? "len_syllable" : "len_initial"; }
+
+std::string table_for(Scheme scheme, const std::string &key, size_t word_len) {
+  std::string base_tbl("tbl_%1%_%2%");
+  std::string shard_key = scheme == Scheme::LenSyllable ? key.substr(0, 2) : key.substr(0, 1);
+  if (word_len >= 8)
+    return boost::str(boost::format(base_tbl) % "others" % shard_key);
+  return boost::str(boost::format(base_tbl) % word_len % shard_key);
+}
+
+std::string table_prefix(size_t word_len, char initial) {
+  std::string base_tbl("tbl_%1%_%2%");
+  if (word_len >= 8)
+    return boost::str(boost::format(base_tbl) % "others" % initial);
+  return boost::str(boost::format(base_tbl) % word_len % initial);
+}
+
+} // namespace Shard
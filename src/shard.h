@@ -0,0 +1,33 @@
+#ifndef FAN_SHARD_H
+#define FAN_SHARD_H
+
+#include <string>
+
+/*
+  词库分表的方式，在生成词库的时候决定，记录在 fanime_meta 表的 shard_scheme 里面
+  没有 fanime_meta 表的旧词库都是 LenInitial
+
+  - LenInitial:  tbl_<字数>_<第一个字母>，字数 >= 8 的放到 tbl_others_<第一个字母>
+  - LenSyllable: tbl_<字数>_<第一个音节的两个双拼字母>，字数 >= 8 的放到 tbl_others_<两个字母>
+                 只知道声母的查询需要合并所有以这个声母开头的表
+*/
+namespace Shard {
+
+enum class Scheme { LenInitial, LenSyllable };
+
+Scheme scheme_from_string(const std::string &name);
+std::string scheme_to_string(Scheme scheme);
+
+/*
+  key 的第一个音节必须是完整的双拼
+*/
+std::string table_for(Scheme scheme, const std::string &key, size_t word_len);
+
+/*
+  LenSyllable 下面，所有属于 (word_len, initial) 的表名的共同前缀，例如 tbl_2_s
+*/
+std::string table_prefix(size_t word_len, char initial);
+
+} // namespace Shard
+
+#endif // FAN_SHARD_H
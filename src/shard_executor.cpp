@@ -0,0 +1,129 @@
+#include "shard_executor.h"
+#include "trace.h"
+
+namespace {
+
+std::vector<ShardExecutor::WordItem> select_rows(sqlite3 *db, const SqlQuery &query) {
+  std::vector<ShardExecutor::WordItem> rows;
+  uint64_t start_ns = FanimeTrace::now_ns(FANIME_PROBE_ENABLED(sql));
+  sqlite3_stmt *stmt = query.prepare(db);
+  if (!stmt)
+    return rows;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    rows.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)), sqlite3_column_int(stmt, 3));
+  sqlite3_finalize(stmt);
+  FANIME_PROBE(sql, query.sql.c_str(), rows.size(), FanimeTrace::elapsed_ns(start_ns));
+  return rows;
+}
+
+} // namespace
+
+ShardExecutor::ShardExecutor(const std::string &db_path, size_t workers, int64_t mmap_bytes) : db_path(db_path), workers(workers), mmap_bytes(mmap_bytes) {}
+
+void ShardExecutor::start() {
+  if (started)
+    return;
+  started = true;
+  for (size_t i = 0; i < workers; i++) {
+    sqlite3 *db = nullptr;
+    // 每个连接只在自己的线程里面用，不需要 sqlite 自己的锁
+    if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+      sqlite3_close(db);
+      break;
+    }
+    if (mmap_bytes > 0)
+      sqlite3_exec(db, ("PRAGMA mmap_size = " + std::to_string(mmap_bytes) + ";").c_str(), nullptr, nullptr, nullptr);
+    conns.push_back(db);
+  }
+  for (sqlite3 *db : conns)
+    threads.emplace_back([this, db] { work(db); });
+}
+
+ShardExecutor::~ShardExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+  for (sqlite3 *db : conns)
+    sqlite3_close(db);
+}
+
+void ShardExecutor::Batch::drain(sqlite3 *db) {
+  size_t i;
+  while ((i = next++) < cnt) {
+    results[i] = select_rows(db, (*sqls)[i]);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (++done == cnt)
+      done_cv.notify_all();
+  }
+}
+
+void ShardExecutor::work(sqlite3 *db) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this] { return stopping || current; });
+    if (stopping)
+      return;
+    // 自己持有一份，调用者返回之后这一批也不会被释放
+    auto batch = current;
+    lock.unlock();
+    batch->drain(db);
+    lock.lock();
+    // 这一批已经全部被取走了，不用再叫醒别的线程
+    if (current == batch)
+      current.reset();
+  }
+}
+
+std::vector<std::vector<ShardExecutor::WordItem>> ShardExecutor::run(sqlite3 *caller_db, const std::vector<SqlQuery> &sqls) {
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+  if (sqls.size() > 1)
+    start();
+  auto batch = std::make_shared<Batch>();
+  batch->sqls = &sqls;
+  batch->cnt = sqls.size();
+  batch->results.resize(sqls.size());
+  if (!threads.empty() && sqls.size() > 1) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current = batch;
+    }
+    cv.notify_all();
+  }
+  batch->drain(caller_db);
+  {
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done_cv.wait(lock, [&batch] { return batch->done == batch->cnt; });
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (current == batch)
+      current.reset();
+  }
+  return std::move(batch->results);
+}
+
+size_t ShardExecutor::size() {
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+  return threads.size();
+}
+
+int64_t ShardExecutor::cache_used() {
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+  int64_t total = 0;
+  for (sqlite3 *db : conns) {
+    int cur = 0, hiwtr = 0;
+    if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &cur, &hiwtr, 0) == SQLITE_OK)
+      total += cur;
+  }
+  return total;
+}
+
+void ShardExecutor::release_memory() {
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+  for (sqlite3 *db : conns)
+    sqlite3_db_release_memory(db);
+}
@@ -0,0 +1,85 @@
+#ifndef FAN_SHARD_EXECUTOR_H
+#define FAN_SHARD_EXECUTOR_H
+
+#include <sqlite3.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "sql_query.h"
+
+/*
+  互相独立的几条分表查询(例如造词时每个前缀一张 tbl_<字数>_<c>)并发执行，不在一个连接上排队
+
+  - 每个工作线程自己一个只读连接，调用者的线程用词库本身的连接也一起执行，run 返回的时候全部查完
+  - 跟着 DictSnapshot 一起创建和释放，热加载之后用的是新的词库文件
+  - 连接和线程等到第一次 run 的时候才打开，DictionaryUlPb 在静态初始化的时候创建，不能在那里起线程
+  - 每条 sql 都是 select *，只取 key、value、weight 三列，和 DictionaryUlPb::select_complete_data 一样
+  - 结果和 sqls 一一对应，每一组内部还是 sql 自己的顺序(按 weight 降序)，怎么合并由调用者决定
+
+  config.txt:
+      shard_workers=3    默认是 CPU 核数减一，最多 3 个；为 0 时不创建，还是在一个连接上依次查询
+*/
+class ShardExecutor {
+public:
+  using WordItem = std::tuple<std::string, std::string, int>;
+
+  // 只是记下来，见 start；mmap_bytes 不为 0 的时候每个连接都设置 mmap_size
+  ShardExecutor(const std::string &db_path, size_t workers, int64_t mmap_bytes = 0);
+  ~ShardExecutor();
+  ShardExecutor(const ShardExecutor &) = delete;
+  ShardExecutor &operator=(const ShardExecutor &) = delete;
+
+  // 已经起来的工作线程的个数，第一次 run 之前是 0
+  size_t size();
+  /*
+    caller_db: 调用者自己的连接，调用者的线程也从同一批里面取 sql 来执行
+    同时只有一批在执行，别的线程调用的话排队
+  */
+  std::vector<std::vector<WordItem>> run(sqlite3 *caller_db, const std::vector<SqlQuery> &sqls);
+  /*
+    工作线程的连接的 page cache 一共多少字节，以及释放掉
+    都要等正在执行的一批查完，连接没有 sqlite 自己的锁，不能和查询同时用
+  */
+  int64_t cache_used();
+  void release_memory();
+
+private:
+  struct Batch {
+    // 调用者的 sqls，只在 run 返回之前用；取完之后才被叫醒的线程只看 cnt
+    const std::vector<SqlQuery> *sqls;
+    size_t cnt;
+    std::vector<std::vector<WordItem>> results;
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    size_t done = 0;
+
+    // 取下一条还没人执行的 sql，直到取完
+    void drain(sqlite3 *db);
+  };
+
+  std::string db_path;
+  size_t workers;
+  int64_t mmap_bytes;
+  bool started = false;
+  std::vector<sqlite3 *> conns;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::shared_ptr<Batch> current;
+  bool stopping = false;
+  std::mutex run_mutex;
+
+  void work(sqlite3 *db);
+  // 打开连接、起线程，持有 run_mutex 的时候调用；打不开的连接直接不要，一个都打不开的时候调用者自己查完
+  void start();
+};
+
+#endif // FAN_SHARD_EXECUTOR_H
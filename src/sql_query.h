@@ -0,0 +1,37 @@
+#ifndef FAN_SQL_QUERY_H
+#define FAN_SQL_QUERY_H
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+/*
+  一条 sql 以及它的参数: 输入码、简拼、词这些都不拼到 sql 里面，按顺序绑定到 sql 里面的 ? 上
+  表名和 limit 不能绑定，由 Shard::table_for 和我们自己的数字生成
+*/
+struct SqlQuery {
+  std::string sql;
+  std::vector<std::string> params;
+
+  bool empty() const { return sql.empty(); }
+  /*
+    prepare 并且绑定好所有参数
+    Return: 失败的时候返回 nullptr
+  */
+  sqlite3_stmt *prepare(sqlite3 *db) const {
+    sqlite3_stmt *stmt = nullptr;
+    if (sql.empty() || sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK) {
+      sqlite3_finalize(stmt);
+      return nullptr;
+    }
+    for (size_t i = 0; i < params.size(); i++) {
+      if (sqlite3_bind_text(stmt, static_cast<int>(i + 1), params[i].data(), static_cast<int>(params[i].size()), SQLITE_TRANSIENT) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return nullptr;
+      }
+    }
+    return stmt;
+  }
+};
+
+#endif // FAN_SQL_QUERY_H
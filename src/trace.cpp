@@ -0,0 +1,11 @@
+#include "trace.h"
+
+#ifdef FANIME_HAS_USDT
+// 追踪器附加上来的时候会把对应的 semaphore 加一
+#define FANIME_DEFINE_SEMAPHORE(name) \
+  extern "C" { \
+  __extension__ volatile unsigned short fanime_##name##_semaphore __attribute__((unused, section(".probes"))) = 0; \
+  }
+FANIME_PROBE_LIST(FANIME_DEFINE_SEMAPHORE)
+#undef FANIME_DEFINE_SEMAPHORE
+#endif
@@ -0,0 +1,74 @@
+#ifndef FAN_TRACE_H
+#define FAN_TRACE_H
+
+/*
+  USDT 探针，线上遇到某个按键很慢的时候，可以直接用 bpftrace/perf 观察，不需要换成 debug 版本
+
+    bpftrace -e 'usdt:/usr/lib/fcitx5/fanime.so:fanime:key_end { printf("%s %d us\n", str(arg0), arg1 / 1000); }'
+
+  - 没有 sys/sdt.h 或者定义了 FANIME_NO_USDT 时全部编译成空的
+  - 每个探针都有一个 semaphore，只有追踪器附加上来之后才会去取时间、准备参数，平时只多一次内存读取和一个 nop
+
+  探针(参数):
+    key_begin(code, keysym)                    FanimeState::keyEvent 入口
+    key_end(code, elapsed_ns, candidate_cnt)   FanimeState::keyEvent 出口
+    generate(code, candidate_cnt, elapsed_ns)  FanimeCandidateList::generate
+    sql(sql, row_cnt, elapsed_ns)              DictionaryUlPb 里面每次执行 sql
+    helpcode_filter(code, in_cnt, out_cnt, elapsed_ns)
+    im_search(pinyin, sentence, elapsed_ns)    谷歌输入法引擎造句
+    compose(code, sentence, lookup_cnt, elapsed_ns)  SentenceComposer 用本地词库造句
+    learn(kind, pinyin, word, elapsed_ns)      造词(kind = 0)和调整权重(kind = 1)
+*/
+#include <cstdint>
+#include <ctime>
+
+#if !defined(FANIME_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FANIME_HAS_USDT 1
+#endif
+#endif
+
+namespace FanimeTrace {
+
+// 探针没有附加时不取时间
+inline uint64_t now_ns(bool enabled) {
+  if (!enabled)
+    return 0;
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+inline uint64_t elapsed_ns(uint64_t start_ns) { return start_ns ? now_ns(true) - start_ns : 0; }
+
+template <class... Args> inline void unused(const Args &...) {}
+
+} // namespace FanimeTrace
+
+#ifdef FANIME_HAS_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// 新增探针时在这里加一行，trace.cpp 会给每个探针定义 semaphore
+#define FANIME_PROBE_LIST(X) X(key_begin) X(key_end) X(generate) X(sql) X(helpcode_filter) X(im_search) X(compose) X(learn)
+
+#define FANIME_DECLARE_SEMAPHORE(name) extern "C" volatile unsigned short fanime_##name##_semaphore;
+FANIME_PROBE_LIST(FANIME_DECLARE_SEMAPHORE)
+#undef FANIME_DECLARE_SEMAPHORE
+
+#define FANIME_PROBE_ENABLED(name) __builtin_expect(fanime_##name##_semaphore != 0, 0)
+#define FANIME_PROBE(name, ...) \
+  do { \
+    if (FANIME_PROBE_ENABLED(name)) \
+      STAP_PROBEV(fanime, name, __VA_ARGS__); \
+  } while (0)
+#else
+#define FANIME_PROBE_ENABLED(name) false
+#define FANIME_PROBE(name, ...) \
+  do { \
+    if (false) \
+      FanimeTrace::unused(__VA_ARGS__); \
+  } while (0)
+#endif
+
+#endif // FAN_TRACE_H
@@ -0,0 +1,133 @@
+#include "typo_index.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+static_assert(sizeof(TypoIndex::Header) == 32, "typo index header must stay 32 bytes");
+
+namespace {
+
+const char *const KEYBOARD_ROWS[] = {"qwertyuiop", "asdfghjkl", "zxcvbnm"};
+// 每一行相对第一行往右错开的距离，单位是一个键的宽度
+const double ROW_OFFSET[] = {0, 0.25, 0.75};
+
+size_t align8(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+} // namespace
+
+TypoIndex::~TypoIndex() {
+  if (mapped)
+    munmap(mapped, mapped_size);
+}
+
+bool TypoIndex::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  auto *head = static_cast<const Header *>(addr);
+  size_t file_size = static_cast<size_t>(st.st_size);
+  if (head->entry_cnt > file_size / 12 || head->code_cnt > file_size / 8) {
+    munmap(addr, st.st_size);
+    return false;
+  }
+  size_t typos_offset = sizeof(Header);
+  size_t targets_offset = typos_offset + head->entry_cnt * sizeof(uint64_t);
+  size_t codes_offset = align8(targets_offset + head->entry_cnt * sizeof(uint32_t));
+  bool valid = memcmp(head->magic, MAGIC, sizeof(MAGIC)) == 0 && head->version == VERSION && head->max_len <= MAX_LEN && codes_offset + head->code_cnt * sizeof(uint64_t) == file_size;
+  if (!valid) {
+    munmap(addr, st.st_size);
+    return false;
+  }
+  mapped = addr;
+  mapped_size = st.st_size;
+  header = head;
+  const char *base = static_cast<const char *>(addr);
+  typos = reinterpret_cast<const uint64_t *>(base + typos_offset);
+  targets = reinterpret_cast<const uint32_t *>(base + targets_offset);
+  codes = reinterpret_cast<const uint64_t *>(base + codes_offset);
+  // 查询是随机的二分，不要预读
+  madvise(mapped, mapped_size, MADV_RANDOM);
+  return true;
+}
+
+std::vector<std::string> TypoIndex::corrections(const std::string &code, size_t cnt) const {
+  std::vector<std::string> res;
+  if (!header || code.size() > header->max_len)
+    return res;
+  uint64_t packed = pack(code);
+  if (!packed)
+    return res;
+  const uint64_t *begin = typos;
+  const uint64_t *end = typos + header->entry_cnt;
+  for (const uint64_t *it = std::lower_bound(begin, end, packed); it != end && *it == packed && res.size() < cnt; it++) {
+    uint32_t code_idx = targets[it - begin] >> 2;
+    if (code_idx < header->code_cnt)
+      res.push_back(unpack(codes[code_idx]));
+  }
+  return res;
+}
+
+uint64_t TypoIndex::pack(const std::string &code) {
+  if (code.empty() || code.size() > MAX_LEN)
+    return 0;
+  uint64_t packed = 0;
+  for (char c : code) {
+    if (c < 'a' || c > 'z')
+      return 0;
+    packed = packed << 5 | static_cast<uint64_t>(c - 'a' + 1);
+  }
+  // 左对齐，这样同一个前缀的排在一起
+  return packed << (5 * (MAX_LEN - code.size()));
+}
+
+std::string TypoIndex::unpack(uint64_t packed) {
+  std::string code;
+  for (size_t i = 0; i < MAX_LEN; i++) {
+    uint64_t letter = packed >> (5 * (MAX_LEN - 1 - i)) & 31;
+    if (!letter)
+      break;
+    code += static_cast<char>('a' + letter - 1);
+  }
+  return code;
+}
+
+std::vector<std::pair<char, uint8_t>> TypoIndex::neighbors(char key) {
+  std::vector<std::pair<char, uint8_t>> res;
+  int row = -1;
+  double col = 0;
+  for (int r = 0; r < 3; r++) {
+    const char *pos = strchr(KEYBOARD_ROWS[r], key);
+    if (key && pos) {
+      row = r;
+      col = (pos - KEYBOARD_ROWS[r]) + ROW_OFFSET[r];
+    }
+  }
+  if (row < 0)
+    return res;
+  for (int r = std::max(0, row - 1); r <= std::min(2, row + 1); r++) {
+    size_t len = strlen(KEYBOARD_ROWS[r]);
+    for (size_t i = 0; i < len; i++) {
+      char other = KEYBOARD_ROWS[r][i];
+      double dist = (static_cast<double>(i) + ROW_OFFSET[r]) - col;
+      if (other == key)
+        continue;
+      if (r == row && (dist == 1 || dist == -1))
+        res.emplace_back(other, 1);
+      else if (r != row && dist > -1 && dist < 1)
+        res.emplace_back(other, 2);
+    }
+  }
+  return res;
+}
@@ -0,0 +1,69 @@
+#ifndef FAN_TYPO_INDEX_H
+#define FAN_TYPO_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+  打错一个字母的输入码 -> 词库里面真正存在的 key，由 fanime-typoindex 离线生成，查询时 mmap 进来只读
+
+  - 只收录不超过 max_len 个字母的 key，打错的方式只有两种:
+      替换成键盘上相邻的键(同一行左右相邻的代价是 1，上下两行挨着的代价是 2)，以及相邻两个字母交换(代价 1)
+  - 本身就是合法 key 的错误形式不收录，查得到的输入码不会走到这里
+  - 同一个错误形式对应多个 key 的时候，按代价、再按 key 在词库里面最大的 weight 排好
+  - 每个输入码(a-z，最多 12 个)压成一个 uint64，每个字母 5 位，查询就是在排好序的数组上二分，不分配内存也不读整个文件
+
+  文件格式(小端): Header，entry_cnt 个 uint64 的错误形式(升序)，entry_cnt 个 uint32 的目标(key 的下标 << 2 | 代价)，
+                  补齐到 8 字节，code_cnt 个 uint64 的 key
+
+  config.txt:
+      typo_correction=0          打开之后词库目录下面有 typo_index.bin 就加载
+      typo_max_corrections=3     一个输入码最多改正成几个 key
+*/
+class TypoIndex {
+public:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_len;
+    uint64_t entry_cnt;
+    uint64_t code_cnt;
+  };
+  static constexpr char MAGIC[8] = {'F', 'A', 'N', 'T', 'Y', 'P', 'O', '\0'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t MAX_LEN = 12;
+
+  TypoIndex() = default;
+  ~TypoIndex();
+  TypoIndex(const TypoIndex &) = delete;
+  TypoIndex &operator=(const TypoIndex &) = delete;
+
+  // 文件不存在或者格式不对的时候返回 false
+  bool open(const std::string &path);
+  size_t max_len() const { return header ? header->max_len : 0; }
+  size_t size() const { return header ? header->entry_cnt : 0; }
+  size_t mapped_bytes() const { return mapped_size; }
+  /*
+    Return: code 打错一个字母之前最可能是哪些 key，最多 cnt 个，最可能的在前面
+  */
+  std::vector<std::string> corrections(const std::string &code, size_t cnt) const;
+
+  // 不是 a-z 或者超过 MAX_LEN 的时候返回 0
+  static uint64_t pack(const std::string &code);
+  static std::string unpack(uint64_t packed);
+  // 键盘上和 key 相邻的键以及代价，fanime-typoindex 使用
+  static std::vector<std::pair<char, uint8_t>> neighbors(char key);
+
+private:
+  void *mapped = nullptr;
+  size_t mapped_size = 0;
+  const Header *header = nullptr;
+  const uint64_t *typos = nullptr;
+  const uint32_t *targets = nullptr;
+  const uint64_t *codes = nullptr;
+};
+
+#endif // FAN_TYPO_INDEX_H
@@ -0,0 +1,275 @@
+#include "user_overlay.h"
+#include "config.h"
+#include "memory_stats.h"
+#include "dict_protocol.h"
+#include <fcntl.h>
+#include <sys/fsuid.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+namespace {
+
+std::string jp_of(const std::string &key) {
+  std::string jp;
+  for (size_t i = 0; i < key.size(); i += 2)
+    jp += key[i];
+  return jp;
+}
+
+// 双拼的 key 每两个字母一个字，jp 是每个字的首字母
+bool valid_entry(const std::string &key, const std::string &jp, const std::string &value) { return DictProtocol::valid_code(key) && key.size() % 2 == 0 && jp == jp_of(key) && DictProtocol::valid_word(value); }
+
+/*
+  在作用域里面把文件系统的 uid/gid 换成 uid/gid，离开的时候换回来；uid 为 -1 的时候什么都不做
+  setfsuid 只对当前线程有效，fanime-dictd 的 ShardExecutor 线程不受影响
+*/
+class FsIdentity {
+public:
+  FsIdentity(uid_t uid, gid_t gid) : active(uid != static_cast<uid_t>(-1)) {
+    if (!active)
+      return;
+    prev_gid = static_cast<gid_t>(setfsgid(gid));
+    prev_uid = static_cast<uid_t>(setfsuid(uid));
+  }
+  ~FsIdentity() {
+    if (!active)
+      return;
+    setfsuid(prev_uid);
+    setfsgid(prev_gid);
+  }
+  FsIdentity(const FsIdentity &) = delete;
+  FsIdentity &operator=(const FsIdentity &) = delete;
+
+private:
+  bool active;
+  uid_t prev_uid = 0;
+  gid_t prev_gid = 0;
+};
+
+} // namespace
+
+UserOverlay::UserOverlay(const std::string &path) : path(path), last_checkpoint(std::chrono::steady_clock::now()) {
+  auto &config = FanimeConfig::instance();
+  checkpoint_writes = static_cast<size_t>(std::max(1, config.get_int("overlay_checkpoint_writes", 20)));
+  checkpoint_interval = std::chrono::seconds(std::max(0, config.get_int("overlay_checkpoint_sec", 30)));
+}
+
+UserOverlay::~UserOverlay() { checkpoint(); }
+
+bool UserOverlay::read_entries(std::vector<Entry> &entries, int64_t &mtime_ns, int64_t &size) const {
+  FsIdentity identity(owner, owner_gid);
+  int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  uid_t expected = owner != static_cast<uid_t>(-1) ? owner : geteuid();
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != expected) {
+    close(fd);
+    return false;
+  }
+  std::string content;
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    if (n > 0)
+      content.append(buf, static_cast<size_t>(n));
+  close(fd);
+  if (n < 0)
+    return false;
+  mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  size = static_cast<int64_t>(st.st_size);
+  entries.clear();
+  std::istringstream overlay_file(content);
+  std::string line;
+  while (std::getline(overlay_file, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    if (!std::getline(fields, entry.key, '\t') || !std::getline(fields, entry.jp, '\t') || !std::getline(fields, entry.value, '\t') || !(fields >> entry.weight))
+      continue;
+    // 文件是用户自己可以随便改的，不合法的行直接丢掉，match 等地方默认 key 是 jp 的两倍长
+    if (!valid_entry(entry.key, entry.jp, entry.value))
+      continue;
+    entries.push_back(std::move(entry));
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return std::tie(a.jp, a.key, a.value) < std::tie(b.jp, b.key, b.value); });
+  return true;
+}
+
+std::pair<int64_t, int64_t> UserOverlay::file_stat() const {
+  FsIdentity identity(owner, owner_gid);
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0)
+    return {-1, -1};
+  return {static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, static_cast<int64_t>(st.st_size)};
+}
+
+bool UserOverlay::load() {
+  if (!read_entries(entries, file_mtime_ns, file_size))
+    return false;
+  dirty = 0;
+  return true;
+}
+
+bool UserOverlay::refresh() {
+  auto [mtime_ns, size] = file_stat();
+  if (mtime_ns == file_mtime_ns && size == file_size)
+    return false;
+  std::vector<Entry> file_entries;
+  if (!read_entries(file_entries, file_mtime_ns, file_size))
+    return false;
+  // 两边都是按 (jp, key, value) 排好序的，归并一遍
+  auto order = [](const Entry &a, const Entry &b) { return std::tie(a.jp, a.key, a.value) < std::tie(b.jp, b.key, b.value); };
+  std::vector<Entry> merged;
+  merged.reserve(std::max(entries.size(), file_entries.size()));
+  bool newer = false;
+  auto mine = entries.begin(), theirs = file_entries.begin();
+  while (mine != entries.end() || theirs != file_entries.end()) {
+    if (theirs == file_entries.end() || (mine != entries.end() && order(*mine, *theirs))) {
+      merged.push_back(std::move(*mine++));
+      newer = true;
+    } else if (mine == entries.end() || order(*theirs, *mine)) {
+      merged.push_back(std::move(*theirs++));
+    } else {
+      newer = newer || mine->weight > theirs->weight;
+      theirs->weight = std::max(mine->weight, theirs->weight);
+      merged.push_back(std::move(*theirs++));
+      ++mine;
+    }
+  }
+  entries = std::move(merged);
+  // 文件里面没有的下一次 checkpoint 要写回去
+  if (newer && !dirty)
+    dirty = 1;
+  return true;
+}
+
+/*
+  先写临时文件再 rename，避免写到一半的时候进程退出把用户数据弄坏
+  临时文件的名字是 mkstemp 随机生成的(O_EXCL)，不会写到事先放在那里的文件或者符号链接上
+*/
+bool UserOverlay::save() {
+  FsIdentity identity(owner, owner_gid);
+  std::string tmp_path = path + ".XXXXXX";
+  int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  std::ostringstream overlay_file;
+  for (const auto &entry : entries)
+    overlay_file << entry.key << '\t' << entry.jp << '\t' << entry.value << '\t' << entry.weight << '\n';
+  std::string content = overlay_file.str();
+  bool ok = true;
+  for (size_t written = 0; ok && written < content.size();) {
+    ssize_t n = write(fd, content.data() + written, content.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    written += ok ? static_cast<size_t>(n) : 0;
+  }
+  // setfsuid 之后创建的文件本来就属于这个用户，这里只是确认一下
+  if (ok && owner != static_cast<uid_t>(-1))
+    ok = fchown(fd, owner, static_cast<gid_t>(-1)) == 0;
+  struct stat st;
+  ok = ok && fstat(fd, &st) == 0;
+  close(fd);
+  if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  file_mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  file_size = static_cast<int64_t>(st.st_size);
+  return true;
+}
+
+bool UserOverlay::checkpoint() {
+  if (!dirty)
+    return true;
+  // 写失败的话留着 dirty，下一次再试
+  if (!save())
+    return false;
+  dirty = 0;
+  last_checkpoint = std::chrono::steady_clock::now();
+  return true;
+}
+
+bool UserOverlay::maybe_checkpoint() {
+  if (dirty >= checkpoint_writes || (dirty && std::chrono::steady_clock::now() - last_checkpoint >= checkpoint_interval))
+    return checkpoint();
+  return true;
+}
+
+size_t UserOverlay::memory_bytes() const {
+  size_t bytes = entries.capacity() * sizeof(Entry);
+  for (const auto &entry : entries)
+    bytes += MemoryStats::heap_bytes(entry.key) + MemoryStats::heap_bytes(entry.jp) + MemoryStats::heap_bytes(entry.value);
+  return bytes;
+}
+
+std::vector<UserOverlay::Entry>::iterator UserOverlay::find(const std::string &jp, const std::string &key, const std::string &value) {
+  return std::lower_bound(entries.begin(), entries.end(), std::tie(jp, key, value), [](const Entry &a, const std::tuple<const std::string &, const std::string &, const std::string &> &b) { return std::tie(a.jp, a.key, a.value) < b; });
+}
+
+std::vector<UserOverlay::Entry>::const_iterator UserOverlay::find(const std::string &jp, const std::string &key, const std::string &value) const {
+  return std::lower_bound(entries.begin(), entries.end(), std::tie(jp, key, value), [](const Entry &a, const std::tuple<const std::string &, const std::string &, const std::string &> &b) { return std::tie(a.jp, a.key, a.value) < b; });
+}
+
+void UserOverlay::add_word(const std::string &key, const std::string &jp, const std::string &value, int weight) {
+  auto it = find(jp, key, value);
+  if (it != entries.end() && it->key == key && it->value == value)
+    return;
+  entries.insert(it, Entry{key, jp, value, weight});
+  dirty++;
+}
+
+void UserOverlay::set_weight(const std::string &key, const std::string &jp, const std::string &value, int weight) {
+  auto it = find(jp, key, value);
+  dirty++;
+  if (it != entries.end() && it->key == key && it->value == value) {
+    it->weight = weight;
+    return;
+  }
+  entries.insert(it, Entry{key, jp, value, weight});
+}
+
+bool UserOverlay::contains(const std::string &key, const std::string &value) const {
+  auto it = find(jp_of(key), key, value);
+  return it != entries.end() && it->key == key && it->value == value;
+}
+
+int UserOverlay::max_weight(const std::string &key) const {
+  int res = -1;
+  std::string jp = jp_of(key);
+  for (auto it = find(jp, key, ""); it != entries.end() && it->key == key; ++it)
+    res = std::max(res, it->weight);
+  return res;
+}
+
+std::vector<UserOverlay::WordItem> UserOverlay::match(const std::vector<std::string> &pinyin_list) const {
+  std::vector<WordItem> res;
+  std::string jp;
+  for (const auto &each_pinyin : pinyin_list)
+    jp += each_pinyin.substr(0, 1);
+  for (auto it = find(jp, "", ""); it != entries.end() && it->jp == jp; ++it) {
+    bool matched = true;
+    for (size_t i = 0; i < pinyin_list.size() && matched; i++) {
+      if (pinyin_list[i].size() == 2)
+        matched = it->key.size() >= i * 2 + 2 && it->key.compare(i * 2, 2, pinyin_list[i]) == 0;
+    }
+    if (matched)
+      res.emplace_back(it->key, it->value, it->weight);
+  }
+  std::stable_sort(res.begin(), res.end(), [](const WordItem &a, const WordItem &b) { return std::get<2>(a) > std::get<2>(b); });
+  return res;
+}
+
+std::vector<UserOverlay::WordItem> UserOverlay::match_key(const std::string &key) const {
+  std::vector<WordItem> res;
+  for (auto it = find(jp_of(key), key, ""); it != entries.end() && it->key == key; ++it)
+    res.emplace_back(it->key, it->value, it->weight);
+  std::stable_sort(res.begin(), res.end(), [](const WordItem &a, const WordItem &b) { return std::get<2>(a) > std::get<2>(b); });
+  return res;
+}
@@ -0,0 +1,105 @@
+#ifndef FAN_USER_OVERLAY_H
+#define FAN_USER_OVERLAY_H
+
+#include <sys/types.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/*
+  用户造的词以及调整过的权重，和基础词库分开存放，查询的时候再合并
+  文件格式和 assets/word.txt 类似，每行: key\tjp\tvalue\tweight
+
+  - 修改只改内存里面排好序的 entries，maybe_checkpoint 攒够一定的修改次数或者时间才整个写一次文件
+  - 进程退出之前调用 checkpoint，最多丢掉最后一个间隔之内的修改
+  - 使用 fanime-dictd 的时候守护进程和输入法进程(守护进程不可用的时候)写同一个文件，
+    用之前先 refresh，把对方写进去的合并进来
+  - 文件所在的目录可能是用户自己可写的，不跟着符号链接读写，只读所有者是自己(或者 set_owner 的用户)的普通文件；
+    临时文件用 mkstemp 创建，不会打开用户事先放好的文件
+
+  config.txt:
+      overlay_checkpoint_writes=20    攒够多少次修改写一次文件，为 1 时每次修改都写
+      overlay_checkpoint_sec=30       距离上一次写文件超过多少秒，有修改就写
+*/
+class UserOverlay {
+public:
+  using WordItem = std::tuple<std::string, std::string, int>;
+
+  explicit UserOverlay(const std::string &path);
+  // 还没写到文件里面的修改在这里写掉
+  ~UserOverlay();
+  UserOverlay(const UserOverlay &) = delete;
+  UserOverlay &operator=(const UserOverlay &) = delete;
+
+  bool load();
+  bool save();
+  /*
+    文件在别的进程里面被改过(修改时间或者大小和自己上一次读写的时候不一样)的话读进来合并:
+    自己没有的词加上，两边都有的取大的 weight；还没写出去的修改留着
+    Return: 有没有读文件
+  */
+  bool refresh();
+  /*
+    fanime-dictd 以 root 运行的时候用: 所有的文件操作都先 setfsuid/setfsgid 成这个用户，
+    内核按用户自己的权限检查，符号链接也只能指到用户自己能读写的文件；写出来的文件属于这个用户
+  */
+  void set_owner(uid_t uid, gid_t gid) {
+    owner = uid;
+    owner_gid = gid;
+  }
+  // 有还没写到文件里面的修改才写
+  bool checkpoint();
+  // add_word、set_weight 之后调用，到了 overlay_checkpoint_writes 或者 overlay_checkpoint_sec 才 checkpoint
+  bool maybe_checkpoint();
+  size_t dirty_writes() const { return dirty; }
+
+  // 已经存在的话就什么都不做
+  void add_word(const std::string &key, const std::string &jp, const std::string &value, int weight);
+  void set_weight(const std::string &key, const std::string &jp, const std::string &value, int weight);
+  bool contains(const std::string &key, const std::string &value) const;
+  // 没有的话返回 -1
+  int max_weight(const std::string &key) const;
+  /*
+    按照 pinyin_list 的分词匹配:
+      - 两个字母的必须是完整的双拼
+      - 一个字母的只需要声母相同
+    Return: 按照 weight 降序排列
+  */
+  std::vector<WordItem> match(const std::vector<std::string> &pinyin_list) const;
+  std::vector<WordItem> match_key(const std::string &key) const;
+  size_t size() const { return entries.size(); }
+  size_t memory_bytes() const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::string jp;
+    std::string value;
+    int weight;
+  };
+  std::string path;
+  // 按照 (jp, key, value) 排序，这样同一个简拼的词都挨在一起
+  std::vector<Entry> entries;
+  size_t dirty = 0;
+  uid_t owner = static_cast<uid_t>(-1);
+  gid_t owner_gid = static_cast<gid_t>(-1);
+  // 上一次读写的时候文件的修改时间和大小
+  int64_t file_mtime_ns = -1;
+  int64_t file_size = -1;
+  size_t checkpoint_writes;
+  std::chrono::steady_clock::duration checkpoint_interval;
+  std::chrono::steady_clock::time_point last_checkpoint;
+
+  std::vector<Entry>::iterator find(const std::string &jp, const std::string &key, const std::string &value);
+  std::vector<Entry>::const_iterator find(const std::string &jp, const std::string &key, const std::string &value) const;
+  // 读的同时记下文件的修改时间和大小；不是自己的普通文件的时候不读
+  bool read_entries(std::vector<Entry> &entries, int64_t &mtime_ns, int64_t &size) const;
+  // 文件现在的修改时间和大小(不跟着符号链接)，不存在的时候都是 -1
+  std::pair<int64_t, int64_t> file_stat() const;
+};
+
+#endif // FAN_USER_OVERLAY_H
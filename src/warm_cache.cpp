@@ -0,0 +1,153 @@
+#include "warm_cache.h"
+#include "config.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+WarmCache::WarmCache() {
+  auto &config = FanimeConfig::instance();
+  enabled_ = config.get_bool("warm_cache", true);
+  max_codes = static_cast<size_t>(std::max(1, config.get_int("warm_cache_codes", 256)));
+  max_bytes = static_cast<uint64_t>(std::max(0, config.get_int("warm_cache_max_mb", 64))) << 20;
+}
+
+bool WarmCache::load(const std::string &path) {
+  std::ifstream cache_file(path);
+  if (!cache_file.is_open())
+    return false;
+  counts.clear();
+  ranges_.clear();
+  std::string line;
+  while (std::getline(cache_file, line)) {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind == "code") {
+      double count;
+      std::string code;
+      if (fields >> count >> code)
+        counts[code] = count;
+    } else if (kind == "range") {
+      Range range;
+      // 文件名只能是数据目录下面的，不许带路径
+      if (fields >> range.file >> range.offset >> range.length && range.file.find('/') == std::string::npos)
+        ranges_.push_back(std::move(range));
+    }
+  }
+  return true;
+}
+
+bool WarmCache::save(const std::string &path, const std::string &data_dir, const std::vector<std::string> &files) const {
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream cache_file(tmp_path, std::ios::trunc);
+    if (!cache_file.is_open())
+      return false;
+    auto codes = hot_codes();
+    for (const auto &code : codes)
+      cache_file << "code " << counts.at(code) << ' ' << code << '\n';
+    uint64_t budget = max_bytes;
+    for (const auto &file : files) {
+      for (const auto &range : resident_ranges(data_dir, file, budget)) {
+        cache_file << "range " << range.file << ' ' << range.offset << ' ' << range.length << '\n';
+        budget -= range.length;
+      }
+    }
+    if (!cache_file.good())
+      return false;
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+void WarmCache::record(const std::string &code) {
+  if (!enabled_ || code.empty() || code.find_first_of(" \t\n") != std::string::npos)
+    return;
+  counts[code] += 1;
+  if (counts.size() > max_codes * 2)
+    decay();
+}
+
+std::vector<std::string> WarmCache::hot_codes() const {
+  std::vector<std::pair<std::string, double>> sorted(counts.begin(), counts.end());
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second != b.second ? a.second > b.second : a.first < b.first; });
+  std::vector<std::string> res;
+  for (size_t i = 0; i < sorted.size() && i < max_codes; i++)
+    res.push_back(std::move(sorted[i].first));
+  return res;
+}
+
+uint64_t WarmCache::prefault(const std::string &data_dir) const {
+  uint64_t total = 0;
+  std::string opened;
+  int fd = -1;
+  for (const auto &range : ranges_) {
+    if (range.file != opened) {
+      if (fd >= 0)
+        close(fd);
+      opened = range.file;
+      fd = open((data_dir + "/" + range.file).c_str(), O_RDONLY);
+    }
+    if (fd < 0)
+      continue;
+    // 文件换过了的话超出的部分内核自己会忽略
+    if (posix_fadvise(fd, static_cast<off_t>(range.offset), static_cast<off_t>(range.length), POSIX_FADV_WILLNEED) == 0)
+      total += range.length;
+  }
+  if (fd >= 0)
+    close(fd);
+  return total;
+}
+
+std::vector<WarmCache::Range> WarmCache::resident_ranges(const std::string &data_dir, const std::string &file, uint64_t max_bytes) {
+  std::vector<Range> res;
+  int fd = open((data_dir + "/" + file).c_str(), O_RDONLY);
+  if (fd < 0)
+    return res;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return res;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  // 只是 mmap 进来问一下哪些页在 page cache 里面，不会读文件
+  void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return res;
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  std::vector<unsigned char> resident((size + page - 1) / page);
+  if (mincore(addr, size, resident.data()) == 0) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < resident.size() && total < max_bytes;) {
+      if (!(resident[i] & 1)) {
+        i++;
+        continue;
+      }
+      size_t j = i;
+      while (j < resident.size() && (resident[j] & 1) && total + (j - i + 1) * page <= max_bytes)
+        j++;
+      if (j == i)
+        break;
+      res.push_back(Range{file, i * page, (j - i) * page});
+      total += (j - i) * page;
+      i = j;
+    }
+  }
+  munmap(addr, size);
+  return res;
+}
+
+/*
+  次数整体减半，忘掉很久不用的
+*/
+void WarmCache::decay() {
+  for (auto it = counts.begin(); it != counts.end();) {
+    it->second /= 2;
+    it = it->second < 1 ? counts.erase(it) : std::next(it);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef FAN_WARM_CACHE_H
+#define FAN_WARM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+  fcitx5 刚启动的时候词库的页都不在内存里面，前几百个按键都很慢
+  退出的时候(以及定期)把最常上屏的输入码和词库文件里面常驻内存的区间记下来，下次启动的时候在后台线程预读
+
+  - 输入码: 每次上屏记一次，按次数排序保留 warm_cache_codes 个，启动的时候在独立的只读连接上查一遍，
+    把这些查询实际用到的索引和数据页读进 page cache(词库是 mmap 的，主连接直接用这些页)
+  - 区间: 退出的时候(以及定期在后台线程)对词库文件做 mincore，把在 page cache 里面的区间记下来，
+    总共不超过 warm_cache_max_mb，启动的时候 posix_fadvise(WILLNEED)；
+    谷歌输入法引擎打开的时候就把 dict_pinyin.dat 整个读到堆里面了，不用记
+  - 文件格式和 fetch_tuner.txt 一样是文本，每行: code 次数 输入码，或者 range 文件名 偏移 长度(文件名相对数据目录)
+
+  config.txt:
+      warm_cache=1               关掉之后不记录也不预读
+      warm_cache_codes=256       最多记住多少个输入码
+      warm_cache_max_mb=64       最多记住多少 MB 的区间
+*/
+class WarmCache {
+public:
+  struct Range {
+    std::string file;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  WarmCache();
+
+  bool enabled() const { return enabled_; }
+  bool load(const std::string &path);
+  /*
+    files: 数据目录下面要记录常驻区间的文件名
+  */
+  bool save(const std::string &path, const std::string &data_dir, const std::vector<std::string> &files) const;
+  // 上屏的时候调用
+  void record(const std::string &code);
+  // 次数从高到低
+  std::vector<std::string> hot_codes() const;
+  const std::vector<Range> &ranges() const { return ranges_; }
+  /*
+    对 ranges 里面的区间 posix_fadvise(WILLNEED)，在后台线程调用
+    Return: 预读了多少字节
+  */
+  uint64_t prefault(const std::string &data_dir) const;
+
+  // 文件里面在 page cache 里面的区间，相邻的合并，总共不超过 max_bytes
+  static std::vector<Range> resident_ranges(const std::string &data_dir, const std::string &file, uint64_t max_bytes);
+
+private:
+  bool enabled_;
+  size_t max_codes;
+  uint64_t max_bytes;
+  std::unordered_map<std::string, double> counts;
+  std::vector<Range> ranges_;
+
+  void decay();
+};
+
+#endif // FAN_WARM_CACHE_H
@@ -0,0 +1,105 @@
+#ifndef FAN_BENCH_UTIL_H
+#define FAN_BENCH_UTIL_H
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+/*
+  工具和 benchmark 共用的一些小函数
+*/
+namespace BenchUtil {
+
+inline double now_us() { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// 对 samples 排序之后取百分位，samples 为空时返回 0
+inline double percentile(std::vector<double> &samples, double p) {
+  if (samples.empty())
+    return 0;
+  std::sort(samples.begin(), samples.end());
+  size_t idx = static_cast<size_t>(p / 100.0 * (samples.size() - 1) + 0.5);
+  return samples[std::min(idx, samples.size() - 1)];
+}
+
+// 从 /proc/self/status 里面读取，单位是 kB，读不到返回 -1
+inline long proc_status_kb(const std::string &field) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, field.size() + 1, field + ":") == 0)
+      return std::stol(line.substr(field.size() + 1));
+  }
+  return -1;
+}
+
+inline long rss_kb() { return proc_status_kb("VmRSS"); }
+inline long peak_rss_kb() { return proc_status_kb("VmHWM"); }
+
+inline long long file_size(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
+struct Sample {
+  std::string key;
+  std::string jp;
+  std::string value;
+};
+
+/*
+  按照每张表的行数随机抽取词条，用来构造查询
+*/
+inline std::vector<Sample> sample_rows(const std::string &db_path, size_t cnt, std::mt19937_64 &rng, long long &total_rows) {
+  std::vector<Sample> samples;
+  sqlite3 *db = nullptr;
+  if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+    return samples;
+  std::vector<std::pair<std::string, long long>> tables;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'table' and name like 'tbl_%';", -1, &stmt, nullptr);
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    tables.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), 0);
+  sqlite3_finalize(stmt);
+  total_rows = 0;
+  for (auto &[table, rows] : tables) {
+    sqlite3_prepare_v2(db, ("select max(rowid) from " + table + ";").c_str(), -1, &stmt, nullptr);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      rows = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    total_rows += rows;
+  }
+  if (total_rows == 0) {
+    sqlite3_close(db);
+    return samples;
+  }
+  std::uniform_int_distribution<long long> pick(1, total_rows);
+  while (samples.size() < cnt) {
+    long long n = pick(rng);
+    for (const auto &[table, rows] : tables) {
+      if (n > rows) {
+        n -= rows;
+        continue;
+      }
+      sqlite3_prepare_v2(db, ("select key, jp, value from " + table + " where rowid = ?;").c_str(), -1, &stmt, nullptr);
+      sqlite3_bind_int64(stmt, 1, n);
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        samples.push_back(Sample{reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+                                 reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2))});
+      sqlite3_finalize(stmt);
+      break;
+    }
+  }
+  sqlite3_close(db);
+  return samples;
+}
+
+} // namespace BenchUtil
+
+#endif // FAN_BENCH_UTIL_H
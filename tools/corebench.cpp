@@ -0,0 +1,180 @@
+/*
+  fanime-corebench: 不经过 fcitx，直接对 fanime-core 里面的 PinyinUtil 和 DictionaryUlPb 做微基准测试
+
+  - 输入从词库里面随机抽取(固定的 seed)，同一个词库、同样的参数每次测的是同一批输入
+  - pinyin_segmentation、cvt_single_sp_to_pinyin、cnt_han_chars、compute_helpcodes 是纯计算
+  - build_sql 只拼 sql 不查询，generate、generate_for_creating_word 会真的查词库
+  - 每一项先跑一轮预热，之后跑 --rounds 轮，每一轮算一次平均每次调用的 ns，报告这些轮里面的中位数、最小值和平均值
+  - long_code: 抽到的词拼成 64 个字母的整句，逐个字母输入，第 8、16、32、48、64 个字母的耗时(分词 + 增量造句)，应该是平的
+
+  输出一行 JSON，用 --label 区分不同的构建，见 scripts/bench_core.sh
+
+  Usage: fanime-corebench --db fixture.db [--assets assets] [--queries 500] [--rounds 5] [--seed 1] [--label name]
+*/
+#include <boost/algorithm/string.hpp>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench_util.h"
+#include "dict.h"
+#include "pinyin_utils.h"
+#include "query_context.h"
+#include "sentence_composer.h"
+
+namespace {
+
+// 结果累加到这里，免得编译器把被测的调用整个优化掉
+volatile size_t sink = 0;
+
+struct BenchCase {
+  std::string name;
+  size_t inputs;
+  std::function<size_t(size_t)> run; // 第 i 个输入跑一次，返回结果的大小
+};
+
+double round_ns_per_op(const BenchCase &bench) {
+  auto start = std::chrono::steady_clock::now();
+  size_t acc = 0;
+  for (size_t i = 0; i < bench.inputs; i++)
+    acc += bench.run(i);
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  sink = sink + acc;
+  return elapsed / bench.inputs;
+}
+
+std::string run_bench(const BenchCase &bench, size_t rounds) {
+  std::ostringstream out;
+  out << "\"" << bench.name << "\": {\"inputs\": " << bench.inputs;
+  if (bench.inputs == 0) {
+    out << "}";
+    return out.str();
+  }
+  round_ns_per_op(bench);
+  std::vector<double> samples;
+  for (size_t r = 0; r < rounds; r++)
+    samples.push_back(round_ns_per_op(bench));
+  double mean = 0;
+  for (double each : samples)
+    mean += each;
+  mean /= samples.size();
+  out << ", \"median_ns\": " << BenchUtil::percentile(samples, 50) << ", \"min_ns\": " << BenchUtil::percentile(samples, 0) << ", \"mean_ns\": " << mean << "}";
+  return out.str();
+}
+
+/*
+  一个字母一个字母地输入整句: 前面 len - 1 个字母的词图先建好(不计时)，只计第 len 个字母的分词和造句
+  每次都用新的 SentenceComposer，缓存的拼音段不会跨句子、跨轮次命中
+*/
+std::string run_long_code(DictionaryUlPb &dict, const std::vector<std::string> &sentences, size_t rounds) {
+  std::ostringstream out;
+  out << "\"long_code\": {\"inputs\": " << sentences.size();
+  if (sentences.empty()) {
+    out << "}";
+    return out.str();
+  }
+  for (size_t len : {8, 16, 32, 48, 64}) {
+    std::vector<double> samples;
+    for (size_t r = 0; r < rounds; r++) {
+      double total = 0;
+      for (const auto &sentence : sentences) {
+        SentenceComposer composer;
+        auto prev = QueryContext::build(sentence.substr(0, len - 1), nullptr);
+        composer.compose(dict, prev->pinyin_list(), 4);
+        auto start = std::chrono::steady_clock::now();
+        auto ctx = QueryContext::build(sentence.substr(0, len), prev.get());
+        sink = sink + composer.compose(dict, ctx->pinyin_list(), 4).size();
+        total += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      }
+      samples.push_back(total / sentences.size());
+    }
+    out << ", \"len_" << len << "_median_ns\": " << BenchUtil::percentile(samples, 50);
+  }
+  out << "}";
+  return out.str();
+}
+
+std::vector<std::string> split_pinyin(const std::string &code) {
+  std::vector<std::string> pinyin_list;
+  if (code.size() > 1) {
+    std::string pinyin_with_seg = PinyinUtil::pinyin_segmentation(code);
+    boost::split(pinyin_list, pinyin_with_seg, boost::is_any_of("'"));
+  }
+  return pinyin_list;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string db_path;
+  std::string assets_dir = "assets";
+  std::string label = "default";
+  size_t queries = 500;
+  size_t rounds = 5;
+  unsigned seed = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--db")
+      db_path = argv[i + 1];
+    else if (opt == "--assets")
+      assets_dir = argv[i + 1];
+    else if (opt == "--label")
+      label = argv[i + 1];
+    else if (opt == "--queries")
+      queries = std::stoul(argv[i + 1]);
+    else if (opt == "--rounds")
+      rounds = std::max(1ul, std::stoul(argv[i + 1]));
+    else if (opt == "--seed")
+      seed = std::stoul(argv[i + 1]);
+  }
+  if (db_path.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --db fixture.db [--assets assets] [--queries 500] [--rounds 5] [--seed 1] [--label name]" << std::endl;
+    return 1;
+  }
+  PinyinUtil::publish_assets(PinyinUtil::load_assets(assets_dir));
+
+  std::mt19937_64 rng(seed);
+  long long total_rows = 0;
+  std::vector<std::string> codes, syllables, words;
+  for (const auto &each : BenchUtil::sample_rows(db_path, queries, rng, total_rows)) {
+    if (each.key.size() > 16)
+      continue;
+    codes.push_back(each.key);
+    for (size_t i = 0; i + 1 < each.key.size(); i += 2)
+      syllables.push_back(each.key.substr(i, 2));
+    words.push_back(each.value);
+  }
+  std::vector<std::string> sentences;
+  std::string sentence;
+  for (const auto &code : codes) {
+    sentence += code;
+    if (sentence.size() >= 64) {
+      sentences.push_back(sentence.substr(0, 64));
+      sentence.clear();
+    }
+  }
+  std::vector<std::vector<std::string>> pinyin_lists;
+  for (const auto &code : codes)
+    pinyin_lists.push_back(split_pinyin(code));
+
+  DictionaryUlPb dict(db_path);
+  std::vector<BenchCase> benches = {
+      {"pinyin_segmentation", codes.size(), [&](size_t i) { return PinyinUtil::pinyin_segmentation(codes[i]).size(); }},
+      {"cvt_single_sp_to_pinyin", syllables.size(), [&](size_t i) { return PinyinUtil::cvt_single_sp_to_pinyin(syllables[i]).size(); }},
+      {"cnt_han_chars", words.size(), [&](size_t i) { return PinyinUtil::cnt_han_chars(words[i]); }},
+      {"compute_helpcodes", words.size(), [&](size_t i) { return PinyinUtil::compute_helpcodes(words[i]).size(); }},
+      {"build_sql", codes.size(), [&](size_t i) { return dict.explain_sql(codes[i], pinyin_lists[i]).first.sql.size(); }},
+      {"generate", codes.size(), [&](size_t i) { return dict.generate(codes[i], pinyin_lists[i]).size(); }},
+      {"generate_for_creating_word", codes.size(), [&](size_t i) { return dict.generate_for_creating_word(codes[i]).size(); }},
+  };
+
+  std::ostringstream results;
+  for (size_t i = 0; i < benches.size(); i++)
+    results << (i ? ", " : "") << run_bench(benches[i], rounds);
+  results << ", " << run_long_code(dict, sentences, rounds);
+  std::cout << "{\"label\": \"" << label << "\", \"db\": \"" << db_path << "\", \"rows\": " << total_rows << ", \"rounds\": " << rounds << ", \"seed\": " << seed << ", \"benches\": {" << results.str() << "}}" << std::endl;
+  return 0;
+}
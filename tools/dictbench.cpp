@@ -0,0 +1,110 @@
+/*
+  fanime-dictbench: 测量 DictionaryUlPb 在某个词库上的表现，每次只测一个词库，这样 RSS 不会互相影响
+
+  - 词库文件大小、行数
+  - 冷启动: 先把词库从页缓存里踢出去，再计时打开词库 + 第一次查询
+  - 各种查询路径的延迟(全拼、简拼、单个简拼、混合简拼、半个音节)
+  - 查询之后的 RSS 和峰值 RSS
+
+  输出一行 JSON，方便多个规模的结果拼在一起比较，见 scripts/bench_scaling.sh
+
+  Usage: fanime-dictbench --db path.db [--queries 2000] [--seed 1]
+*/
+#include <fcntl.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench_util.h"
+#include "dict.h"
+
+namespace {
+
+void evict_from_page_cache(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/*
+  和 DictionaryUlPb::build_sql 的几个分支对应
+*/
+std::map<std::string, std::vector<std::string>> build_workload(const std::vector<BenchUtil::Sample> &samples) {
+  std::map<std::string, std::vector<std::string>> workload;
+  for (const auto &each : samples) {
+    if (each.key.size() > 16)
+      continue;
+    workload["full"].push_back(each.key);
+    if (each.jp.size() >= 2)
+      workload["jp"].push_back(each.jp);
+    if (each.key.size() >= 4)
+      workload["one_jp"].push_back(each.key.substr(0, each.key.size() - 1));
+    if (each.key.size() >= 6)
+      workload["mixed_jp"].push_back(each.key.substr(0, 2) + each.jp.substr(1));
+    if (each.key.size() >= 4)
+      workload["half_syllable"].push_back(each.key.substr(0, 3));
+    workload["creating_word"].push_back(each.key);
+  }
+  return workload;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string db_path;
+  size_t queries = 2000;
+  unsigned seed = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--db")
+      db_path = argv[i + 1];
+    else if (opt == "--queries")
+      queries = std::stoul(argv[i + 1]);
+    else if (opt == "--seed")
+      seed = std::stoul(argv[i + 1]);
+  }
+  if (db_path.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --db path.db [--queries 2000] [--seed 1]" << std::endl;
+    return 1;
+  }
+
+  std::mt19937_64 rng(seed);
+  long long total_rows = 0;
+  auto workload = build_workload(BenchUtil::sample_rows(db_path, queries, rng, total_rows));
+  long rss_before = BenchUtil::rss_kb();
+
+  evict_from_page_cache(db_path);
+  double start = BenchUtil::now_us();
+  DictionaryUlPb dict(db_path);
+  double open_us = BenchUtil::now_us() - start;
+  start = BenchUtil::now_us();
+  dict.generate(workload["full"].empty() ? "aa" : workload["full"][0]);
+  double first_query_us = BenchUtil::now_us() - start;
+
+  std::ostringstream lookups;
+  bool first = true;
+  for (auto &[name, codes] : workload) {
+    std::vector<double> latencies;
+    size_t rows = 0;
+    for (const auto &code : codes) {
+      double t0 = BenchUtil::now_us();
+      rows += name == "creating_word" ? dict.generate_for_creating_word(code).size() : dict.generate(code).size();
+      latencies.push_back(BenchUtil::now_us() - t0);
+    }
+    double avg_rows = codes.empty() ? 0 : static_cast<double>(rows) / codes.size();
+    lookups << (first ? "" : ", ") << "\"" << name << "\": {\"count\": " << codes.size() << ", \"avg_rows\": " << avg_rows << ", \"p50_us\": " << BenchUtil::percentile(latencies, 50) << ", \"p95_us\": " << BenchUtil::percentile(latencies, 95) << ", \"p99_us\": " << BenchUtil::percentile(latencies, 99)
+            << ", \"max_us\": " << BenchUtil::percentile(latencies, 100) << "}";
+    first = false;
+  }
+
+  std::cout << "{\"db\": \"" << db_path << "\", \"size_bytes\": " << BenchUtil::file_size(db_path) << ", \"rows\": " << total_rows << ", \"cold_open_ms\": " << open_us / 1000 << ", \"cold_first_query_ms\": " << first_query_us / 1000 << ", \"rss_before_kb\": " << rss_before << ", \"rss_kb\": " << BenchUtil::rss_kb()
+            << ", \"peak_rss_kb\": " << BenchUtil::peak_rss_kb() << ", \"lookups\": {" << lookups.str() << "}}" << std::endl;
+  return 0;
+}
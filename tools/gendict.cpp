@@ -0,0 +1,365 @@
+/*
+  fanime-gendict: 用 assets/word.txt 里面的单字生成和 cutted_flyciku_with_jp.db 结构相同的大词库，用来测试词库变大之后的表现
+
+  - 单字直接来自 word.txt，放到 tbl_1_<c>
+  - 多字词由单字随机组合而成，单字的使用频率服从 Zipf 分布，词长的分布参考常见的中文词库
+  - weight 也服从 Zipf 分布
+  - 表结构: tbl_<len>_<c> / tbl_others_<c> (key, jp, value, weight)，key 和 jp 上有索引
+  - --shard 选择分表方式(见 shard.h)，记录在 fanime_meta 表里面
+  - --from 不生成新词，而是把已有的词库按照 --shard 重新分表
+  - --helpcode 给每个词条加上首字和尾字的辅助码 (hc_first, hc_last)，并且在 (key, hc_first, hc_last) 上建索引，
+    完整辅助码的查询可以直接在索引上完成，见 DictionaryUlPb::generate_with_fullhelpcode
+    helpcode.txt 改了之后需要重新生成
+  - 每个分表的 key、jp 和去掉最后一个字母的 key 都放进 fanime_key_filter 表里面的 Bloom filter，一定查不到的输入码不用去查，见 src/key_filter.h
+    旧的词库用 --from 重新生成一次就有了
+
+  Usage: fanime-gendict --words assets/word.txt --out out.db [--rows 400000] [--scale 1] [--seed 1] [--shard len_initial|len_syllable] [--helpcode assets/helpcode.txt]
+         fanime-gendict --from old.db --out out.db --shard len_syllable [--helpcode assets/helpcode.txt]
+*/
+#include <sqlite3.h>
+#include <boost/format.hpp>
+#include <unordered_map>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "bench_util.h"
+#include "key_filter.h"
+#include "shard.h"
+
+namespace {
+
+struct HanChar {
+  std::string key; // 双拼
+  std::string value;
+  double popularity;
+};
+
+// 词长(字数)的分布，>= 8 的都放到 tbl_others_<c>
+const std::vector<std::pair<int, double>> WORD_LEN_DISTRIBUTION = {{2, 0.45}, {3, 0.20}, {4, 0.25}, {5, 0.04}, {6, 0.02}, {7, 0.02}, {8, 0.01}, {10, 0.01}};
+
+using HelpcodeMap = std::unordered_map<std::string, std::string>;
+
+// 和 PinyinUtil::load_assets 读 helpcode.txt 的方式一样
+HelpcodeMap load_helpcodes(const std::string &path) {
+  HelpcodeMap helpcodes;
+  std::ifstream helpcode_file(path);
+  std::string line;
+  while (std::getline(helpcode_file, line)) {
+    size_t pos = line.find('=');
+    if (pos != std::string::npos)
+      helpcodes[line.substr(0, pos)] = line.substr(pos + 1, 2);
+  }
+  return helpcodes;
+}
+
+// value 的第一个和最后一个 utf-8 字符
+std::string first_char(const std::string &value) {
+  size_t len = 1;
+  while (len < value.size() && (static_cast<unsigned char>(value[len]) & 0xC0) == 0x80)
+    len++;
+  return value.substr(0, len);
+}
+
+std::string last_char(const std::string &value) {
+  size_t pos = value.empty() ? 0 : value.size() - 1;
+  while (pos > 0 && (static_cast<unsigned char>(value[pos]) & 0xC0) == 0x80)
+    pos--;
+  return value.substr(pos);
+}
+
+// 查不到的字留空
+std::string helpcode_of(const HelpcodeMap &helpcodes, const std::string &han_char) {
+  auto it = helpcodes.find(han_char);
+  return it == helpcodes.end() ? "" : it->second;
+}
+
+bool exec(sqlite3 *db, const std::string &sql) {
+  char *err = nullptr;
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+    std::cerr << "sql error: " << (err ? err : "") << " in " << sql << std::endl;
+    sqlite3_free(err);
+    return false;
+  }
+  return true;
+}
+
+class TableWriter {
+public:
+  // helpcodes 为空的时候不加辅助码列
+  TableWriter(sqlite3 *db, const std::string &table, const HelpcodeMap *helpcodes) : db(db), table(table), helpcodes(helpcodes) {
+    if (helpcodes) {
+      exec(db, boost::str(boost::format("create table if not exists %1% (key TEXT, jp TEXT, value TEXT, weight INTEGER, hc_first TEXT, hc_last TEXT);") % table));
+      sqlite3_prepare_v2(db, boost::str(boost::format("insert into %1% (key, jp, value, weight, hc_first, hc_last) values (?, ?, ?, ?, ?, ?);") % table).c_str(), -1, &stmt, nullptr);
+    } else {
+      exec(db, boost::str(boost::format("create table if not exists %1% (key TEXT, jp TEXT, value TEXT, weight INTEGER);") % table));
+      sqlite3_prepare_v2(db, boost::str(boost::format("insert into %1% (key, jp, value, weight) values (?, ?, ?, ?);") % table).c_str(), -1, &stmt, nullptr);
+    }
+  }
+  ~TableWriter() {
+    sqlite3_finalize(stmt);
+    exec(db, boost::str(boost::format("create index if not exists idx_%1%_key on %1% (key);") % table));
+    exec(db, boost::str(boost::format("create index if not exists idx_%1%_jp on %1% (jp);") % table));
+    if (helpcodes)
+      exec(db, boost::str(boost::format("create index if not exists idx_%1%_key_hc on %1% (key, hc_first, hc_last);") % table));
+  }
+  void insert(const std::string &key, const std::string &jp, const std::string &value, int weight) {
+    sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, jp.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, value.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 4, weight);
+    if (helpcodes) {
+      sqlite3_bind_text(stmt, 5, helpcode_of(*helpcodes, first_char(value)).c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(stmt, 6, helpcode_of(*helpcodes, last_char(value)).c_str(), -1, SQLITE_TRANSIENT);
+    }
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+
+private:
+  sqlite3 *db;
+  std::string table;
+  const HelpcodeMap *helpcodes;
+  sqlite3_stmt *stmt = nullptr;
+};
+
+/*
+  按照分表方式把词条写到对应的表里面，析构的时候给所有的表建索引
+*/
+class ShardWriter {
+public:
+  ShardWriter(sqlite3 *db, Shard::Scheme scheme, const HelpcodeMap *helpcodes) : db(db), scheme(scheme), helpcodes(helpcodes) {
+    exec(db, "create table if not exists fanime_meta (name TEXT PRIMARY KEY, value TEXT);");
+    exec(db, "insert or replace into fanime_meta (name, value) values ('shard_scheme', '" + Shard::scheme_to_string(scheme) + "');");
+    exec(db, std::string("insert or replace into fanime_meta (name, value) values ('helpcode_columns', '") + (helpcodes ? "1" : "0") + "');");
+  }
+  // 所有的词条都写完之后，按每个分表实际的项数生成 key_filter
+  ~ShardWriter() {
+    KeyFilter filter;
+    for (const auto &[shard, entries] : filter_entries) {
+      filter.reserve(shard, entries.size());
+      for (const auto &entry : entries)
+        filter.add(shard, static_cast<KeyFilter::Kind>(entry[0]), entry.substr(1));
+    }
+    filter.save(db);
+  }
+  void insert(const std::string &key, const std::string &jp, const std::string &value, int weight) {
+    auto &writer = writers[Shard::table_for(scheme, key, jp.size())];
+    if (!writer)
+      writer = std::make_unique<TableWriter>(db, Shard::table_for(scheme, key, jp.size()), helpcodes);
+    writer->insert(key, jp, value, weight);
+    auto &entries = filter_entries[Shard::table_prefix(jp.size(), key[0])];
+    entries.insert(static_cast<char>(KeyFilter::Kind::Key) + key);
+    entries.insert(static_cast<char>(KeyFilter::Kind::Jp) + jp);
+    if (!key.empty())
+      entries.insert(static_cast<char>(KeyFilter::Kind::Prefix) + key.substr(0, key.size() - 1));
+  }
+
+private:
+  sqlite3 *db;
+  Shard::Scheme scheme;
+  const HelpcodeMap *helpcodes;
+  std::map<std::string, std::unique_ptr<TableWriter>> writers;
+  // 分表 -> 前面加上 KeyFilter::Kind 的 key 和 jp，去掉重复的之后才知道每张表要多大
+  std::map<std::string, std::unordered_set<std::string>> filter_entries;
+};
+
+/*
+  把旧词库的所有词条按照新的分表方式写一遍
+*/
+long copy_from(const std::string &from_path, ShardWriter &writer) {
+  sqlite3 *from_db = nullptr;
+  if (sqlite3_open_v2(from_path.c_str(), &from_db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+    std::cerr << "cannot open " << from_path << std::endl;
+    return -1;
+  }
+  std::vector<std::string> tables;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(from_db, "select name from sqlite_master where type = 'table' and name like 'tbl_%';", -1, &stmt, nullptr);
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    tables.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+  sqlite3_finalize(stmt);
+  long total_rows = 0;
+  for (const auto &table : tables) {
+    sqlite3_prepare_v2(from_db, ("select key, jp, value, weight from " + table + ";").c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      writer.insert(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)), reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)), sqlite3_column_int(stmt, 3));
+      total_rows++;
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(from_db);
+  return total_rows;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string words_path = "assets/word.txt";
+  std::string out_path;
+  std::string from_path;
+  std::string helpcode_path;
+  Shard::Scheme scheme = Shard::Scheme::LenInitial;
+  long rows = 400000;
+  long scale = 1;
+  unsigned seed = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--words")
+      words_path = argv[i + 1];
+    else if (opt == "--out")
+      out_path = argv[i + 1];
+    else if (opt == "--rows")
+      rows = std::stol(argv[i + 1]);
+    else if (opt == "--scale")
+      scale = std::stol(argv[i + 1]);
+    else if (opt == "--seed")
+      seed = std::stoul(argv[i + 1]);
+    else if (opt == "--shard")
+      scheme = Shard::scheme_from_string(argv[i + 1]);
+    else if (opt == "--from")
+      from_path = argv[i + 1];
+    else if (opt == "--helpcode")
+      helpcode_path = argv[i + 1];
+  }
+  if (out_path.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --words assets/word.txt --out out.db [--rows 400000] [--scale 1] [--seed 1] [--shard len_initial|len_syllable] [--helpcode assets/helpcode.txt]" << std::endl;
+    std::cerr << "       " << argv[0] << " --from old.db --out out.db --shard len_syllable [--helpcode assets/helpcode.txt]" << std::endl;
+    return 1;
+  }
+  HelpcodeMap helpcodes;
+  if (!helpcode_path.empty()) {
+    helpcodes = load_helpcodes(helpcode_path);
+    if (helpcodes.empty()) {
+      std::cerr << "no helpcodes in " << helpcode_path << std::endl;
+      return 1;
+    }
+  }
+  const HelpcodeMap *helpcodes_ptr = helpcode_path.empty() ? nullptr : &helpcodes;
+
+  if (!from_path.empty()) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(out_path.c_str(), &db) != SQLITE_OK) {
+      std::cerr << "cannot open " << out_path << std::endl;
+      return 1;
+    }
+    exec(db, "PRAGMA journal_mode = OFF;");
+    exec(db, "PRAGMA synchronous = OFF;");
+    exec(db, "begin;");
+    long total_rows;
+    {
+      ShardWriter writer(db, scheme, helpcodes_ptr);
+      total_rows = copy_from(from_path, writer);
+    }
+    exec(db, "commit;");
+    exec(db, "ANALYZE;");
+    sqlite3_close(db);
+    std::cout << "rows=" << total_rows << " size_bytes=" << BenchUtil::file_size(out_path) << std::endl;
+    return total_rows < 0 ? 1 : 0;
+  }
+
+  std::mt19937_64 rng(seed);
+  std::vector<HanChar> chars;
+  std::ifstream words_file(words_path);
+  std::string line;
+  while (std::getline(words_file, line)) {
+    size_t pos = line.find('\t');
+    if (pos == std::string::npos || pos != 2)
+      continue;
+    chars.push_back(HanChar{line.substr(0, pos), line.substr(pos + 1), 0});
+  }
+  if (chars.empty()) {
+    std::cerr << "no words in " << words_path << std::endl;
+    return 1;
+  }
+  // 随机排一个名次，名次越靠前的字越常用
+  std::vector<size_t> ranks(chars.size());
+  for (size_t i = 0; i < ranks.size(); i++)
+    ranks[i] = i;
+  std::shuffle(ranks.begin(), ranks.end(), rng);
+  for (size_t i = 0; i < chars.size(); i++)
+    chars[ranks[i]].popularity = 1.0 / std::pow(i + 1, 1.0);
+
+  // 每个声母(双拼首字母)一个分布，用来生成首字固定的词
+  std::map<char, std::vector<size_t>> chars_by_initial;
+  std::map<char, double> initial_share;
+  double total_popularity = 0;
+  for (size_t i = 0; i < chars.size(); i++) {
+    chars_by_initial[chars[i].key[0]].push_back(i);
+    initial_share[chars[i].key[0]] += chars[i].popularity;
+    total_popularity += chars[i].popularity;
+  }
+  std::vector<double> all_weights;
+  for (const auto &each : chars)
+    all_weights.push_back(each.popularity);
+  std::discrete_distribution<size_t> any_char(all_weights.begin(), all_weights.end());
+
+  sqlite3 *db = nullptr;
+  if (sqlite3_open(out_path.c_str(), &db) != SQLITE_OK) {
+    std::cerr << "cannot open " << out_path << std::endl;
+    return 1;
+  }
+  exec(db, "PRAGMA journal_mode = OFF;");
+  exec(db, "PRAGMA synchronous = OFF;");
+  exec(db, "begin;");
+
+  double start = BenchUtil::now_us();
+  long total_rows = 0;
+  // weight 服从 Zipf 分布: 先随机一个名次，再换算成 weight
+  long total_target = rows * scale;
+  std::uniform_int_distribution<long> weight_rank(1, std::max(total_target, 1L));
+  auto zipf_weight = [&]() { return static_cast<int>(10000000.0 / std::pow(static_cast<double>(weight_rank(rng)), 0.8)) + 1; };
+
+  auto writer = std::make_unique<ShardWriter>(db, scheme, helpcodes_ptr);
+  // 1. 单字
+  for (const auto &[initial, indices] : chars_by_initial) {
+    for (size_t idx : indices) {
+      writer->insert(chars[idx].key, chars[idx].key.substr(0, 1), chars[idx].value, static_cast<int>(chars[idx].popularity * 10000000) + 1);
+      total_rows++;
+    }
+  }
+
+  // 2. 多字词，一张表一张表地生成，这样去重用的集合不会太大
+  for (const auto &[word_len, len_share] : WORD_LEN_DISTRIBUTION) {
+    for (const auto &[initial, indices] : chars_by_initial) {
+      long quota = static_cast<long>(total_target * len_share * initial_share[initial] / total_popularity);
+      if (quota <= 0)
+        continue;
+      std::vector<double> first_weights;
+      for (size_t idx : indices)
+        first_weights.push_back(chars[idx].popularity);
+      std::discrete_distribution<size_t> first_char(first_weights.begin(), first_weights.end());
+      std::unordered_set<uint64_t> seen;
+      long attempts = 0;
+      for (long n = 0; n < quota && attempts < quota * 4; attempts++) {
+        const HanChar &first = chars[indices[first_char(rng)]];
+        std::string key = first.key, jp = first.key.substr(0, 1), value = first.value;
+        for (int i = 1; i < word_len; i++) {
+          const HanChar &each = chars[any_char(rng)];
+          key += each.key;
+          jp += each.key[0];
+          value += each.value;
+        }
+        if (!seen.insert(std::hash<std::string>{}(key + value)).second)
+          continue;
+        writer->insert(key, jp, value, zipf_weight());
+        n++;
+        total_rows++;
+      }
+    }
+  }
+  writer.reset();
+  exec(db, "commit;");
+  exec(db, "ANALYZE;");
+  sqlite3_close(db);
+
+  std::cout << "rows=" << total_rows << " size_bytes=" << BenchUtil::file_size(out_path) << " seconds=" << (BenchUtil::now_us() - start) / 1e6 << std::endl;
+  return 0;
+}
@@ -0,0 +1,339 @@
+/*
+  fanime-keytrace: 处理 keystroke_trace.bin(见 src/keystroke_trace.h)
+
+  - summary: 每种按键的个数和各个阶段耗时的百分位，输出一行 JSON
+  - synth: 按照记录里面的结构造出等价的输入，写成重放脚本
+      每次从空的缓冲区开始到上屏或者清空是一段，按这一段里面最长的输入码的音节结构从词库里面抽词，
+      完整的音节用词的双拼，只有声母的音节用简拼，辅助码随便取一个字母；按键的种类、间隔、上屏的下标都照抄
+  - replay: 把重放脚本喂给候选项的流程(QueryContext、缓存、DictionaryUlPb、CandidateRanker)，
+      只读不写，不造词也不调整权重，输出一行 JSON
+
+  重放脚本每行一个按键: <距离上一个按键的微秒数> <动作> [参数]
+      type <字母>  backspace  prev  next  select <下标>  return  escape  punct  other
+
+  Usage:
+    fanime-keytrace summary --trace keystroke_trace.bin
+    fanime-keytrace synth --trace keystroke_trace.bin --db path.db [--seed 1] > replay.txt
+    fanime-keytrace replay --script replay.txt --db path.db
+*/
+#include <sqlite3.h>
+#include <boost/circular_buffer.hpp>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench_util.h"
+#include "candidate_ranker.h"
+#include "dict.h"
+#include "keystroke_trace.h"
+#include "query_context.h"
+
+namespace {
+
+using Record = KeystrokeTrace::Record;
+
+const char *CLASS_NAMES[] = {"letter", "helpcode", "backspace", "prev_page", "next_page", "select", "return", "escape", "punctuation", "other"};
+// 和 fanime.cpp 里面的一样
+const size_t PAGE_SIZE = 8;
+const size_t CACHE_SIZE = 20;
+
+std::string percentiles_json(std::vector<double> samples) {
+  std::ostringstream out;
+  out << "{\"p50_us\": " << BenchUtil::percentile(samples, 50) << ", \"p95_us\": " << BenchUtil::percentile(samples, 95) << ", \"p99_us\": " << BenchUtil::percentile(samples, 99) << ", \"max_us\": " << BenchUtil::percentile(samples, 100) << "}";
+  return out.str();
+}
+
+int summary(const std::vector<Record> &records) {
+  std::map<int, std::vector<double>> key_us;
+  std::vector<double> generate_us, learn_us;
+  std::map<int, size_t> flag_cnts;
+  for (const auto &record : records) {
+    key_us[std::min<int>(record.key_class, KeystrokeTrace::OTHER)].push_back(record.key_us);
+    if (record.generate_us)
+      generate_us.push_back(record.generate_us);
+    if (record.learn_us)
+      learn_us.push_back(record.learn_us);
+    for (int bit = 0; bit < 8; bit++)
+      if (record.flags & (1 << bit))
+        flag_cnts[bit]++;
+  }
+  std::cout << "{\"records\": " << records.size() << ", \"keys\": {";
+  bool first = true;
+  for (auto &[key_class, samples] : key_us) {
+    std::cout << (first ? "" : ", ") << "\"" << CLASS_NAMES[key_class] << "\": {\"count\": " << samples.size() << ", \"key\": " << percentiles_json(samples) << "}";
+    first = false;
+  }
+  std::cout << "}, \"generate\": " << percentiles_json(generate_us) << ", \"learn\": " << percentiles_json(learn_us) << ", \"creating\": " << flag_cnts[0] << ", \"full_helpcode\": " << flag_cnts[1] << ", \"single_helpcode\": " << flag_cnts[2] << ", \"deferred\": " << flag_cnts[3]
+            << ", \"progressive\": " << flag_cnts[4] << "}" << std::endl;
+  return 0;
+}
+
+/*
+  按音节数从词库里面抽词，每个音节一个 (双拼, 简拼) 对；超过 4 个音节的拼几个词
+*/
+class SyllableSampler {
+public:
+  SyllableSampler(const std::string &db_path, unsigned seed) : rng(seed) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+      return;
+    std::vector<std::string> tables;
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'table' and name like 'tbl_%';", -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      tables.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+    sqlite3_finalize(stmt);
+    for (const auto &table : tables) {
+      sqlite3_prepare_v2(db, ("select key, jp from " + table + " order by random() limit 2000;").c_str(), -1, &stmt, nullptr);
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string key = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        std::string jp = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        size_t cnt = key.size() / 2;
+        if (cnt == 0 || cnt > 4 || jp.size() != cnt || key.size() != cnt * 2)
+          continue;
+        words[cnt].push_back(key);
+      }
+      sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+  }
+
+  // 返回 cnt 个音节的双拼
+  std::vector<std::string> sample(size_t cnt) {
+    std::vector<std::string> syllables;
+    while (syllables.size() < cnt) {
+      size_t want = std::min<size_t>(cnt - syllables.size(), 4);
+      while (want > 1 && words[want].empty())
+        want--;
+      if (words[want].empty()) {
+        syllables.push_back("aa");
+        continue;
+      }
+      const std::string &key = words[want][rng() % words[want].size()];
+      for (size_t i = 0; i < key.size(); i += 2)
+        syllables.push_back(key.substr(i, 2));
+    }
+    return syllables;
+  }
+
+  char random_letter() { return static_cast<char>('a' + rng() % 26); }
+
+private:
+  std::mt19937_64 rng;
+  std::map<size_t, std::vector<std::string>> words;
+};
+
+/*
+  一段输入里面最长的输入码的结构: 每个音节是完整的双拼还是只有声母
+  按照这个结构拼出目标输入码，这一段里面输入的字母依次从里面取
+*/
+std::string build_target(const Record &longest, SyllableSampler &sampler) {
+  std::string target;
+  auto syllables = sampler.sample(longest.syllable_cnt);
+  for (size_t i = 0; i < syllables.size(); i++) {
+    bool initial = i < 16 && (longest.initial_mask & (1u << i));
+    target += initial ? syllables[i].substr(0, 1) : syllables[i];
+  }
+  return target;
+}
+
+int synth(const std::vector<Record> &records, const std::string &db_path, unsigned seed) {
+  SyllableSampler sampler(db_path, seed);
+  std::string code, target;
+  for (size_t i = 0; i < records.size(); i++) {
+    const Record &record = records[i];
+    if (code.empty() && (record.key_class == KeystrokeTrace::LETTER || record.key_class == KeystrokeTrace::HELPCODE)) {
+      // 新的一段，找到这一段里面最长的输入码
+      size_t longest = i;
+      for (size_t j = i; j < records.size() && records[j].code_len > 0; j++)
+        if (records[j].code_len > records[longest].code_len)
+          longest = j;
+      target = build_target(records[longest], sampler);
+    }
+    std::cout << (record.gap_us == UINT32_MAX ? 0 : record.gap_us) << " ";
+    switch (record.key_class) {
+    case KeystrokeTrace::LETTER:
+    case KeystrokeTrace::HELPCODE: {
+      char letter = code.size() < target.size() ? target[code.size()] : sampler.random_letter();
+      if (record.key_class == KeystrokeTrace::HELPCODE && !(record.flags & KeystrokeTrace::SINGLE_HELPCODE))
+        letter = static_cast<char>(std::toupper(letter));
+      code += letter;
+      std::cout << "type " << letter;
+      break;
+    }
+    case KeystrokeTrace::BACKSPACE:
+      if (!code.empty())
+        code.pop_back();
+      std::cout << "backspace";
+      break;
+    case KeystrokeTrace::PREV_PAGE:
+      std::cout << "prev";
+      break;
+    case KeystrokeTrace::NEXT_PAGE:
+      std::cout << "next";
+      break;
+    case KeystrokeTrace::SELECT:
+      std::cout << "select " << std::max<int>(record.select_index, 0);
+      break;
+    case KeystrokeTrace::RETURN:
+      std::cout << "return";
+      break;
+    case KeystrokeTrace::ESCAPE:
+      std::cout << "escape";
+      break;
+    case KeystrokeTrace::PUNCTUATION:
+      std::cout << "punct";
+      break;
+    default:
+      std::cout << "other";
+      break;
+    }
+    std::cout << "\n";
+    // 造词的时候上屏之后剩下后面的输入码，其它时候清空
+    if (record.code_len < code.size())
+      code = code.substr(code.size() - record.code_len);
+  }
+  return 0;
+}
+
+/*
+  和 FanimeCandidateList 的普通输入一样: 当前输入码的结果在前，然后是缓存里面更短的拼音的结果
+  辅助码和造词的分支不在这里，按照普通的拼音来查
+*/
+class Pipeline {
+public:
+  explicit Pipeline(const std::string &db_path) : dict(db_path), cache(CACHE_SIZE) {}
+
+  void set_code(const std::string &code) {
+    ranker.reset();
+    candidates.clear();
+    page = 0;
+    if (code.empty()) {
+      ctx.reset();
+      cache.clear();
+      return;
+    }
+    ctx = QueryContext::build(code, ctx.get());
+    std::shared_ptr<CandidateCursor> cursor;
+    for (const auto &item : cache)
+      if (item.first == ctx->code()) {
+        cursor = item.second;
+        break;
+      }
+    if (!cursor)
+      cursor = dict.generate_cursor(ctx->code(), ctx->pinyin_list());
+    if (cursor->fetch(1) > 0) {
+      cache.push_front(std::make_pair(ctx->code(), cursor));
+      ranker.add_source(0, cursor);
+    }
+    int tier = 1;
+    for (size_t len = ctx->pinyin_list().size(); len-- > 1;) {
+      std::string prefix = boost::algorithm::join(ctx->pinyin_list_prefix(ctx->segments()[len].start), "");
+      for (const auto &item : cache)
+        if (item.first == prefix) {
+          ranker.add_source(tier++, item.second);
+          break;
+        }
+    }
+    ranker.fill(candidates, PAGE_SIZE * 2 + 1);
+  }
+
+  void next_page() { ranker.fill(candidates, (++page + 2) * PAGE_SIZE + 1); }
+  void select(size_t index) { ranker.fill(candidates, index + 1); }
+  size_t candidate_cnt() const { return candidates.size(); }
+
+private:
+  DictionaryUlPb dict;
+  boost::circular_buffer<std::pair<std::string, std::shared_ptr<CandidateCursor>>> cache;
+  std::shared_ptr<const QueryContext> ctx;
+  CandidateRanker ranker;
+  std::vector<CandidateRanker::WordItem> candidates;
+  size_t page = 0;
+};
+
+int replay(const std::string &script_path, const std::string &db_path) {
+  std::ifstream script(script_path);
+  if (!script) {
+    std::cerr << "cannot open " << script_path << std::endl;
+    return 1;
+  }
+  Pipeline pipeline(db_path);
+  std::map<std::string, std::vector<double>> latencies;
+  std::string code, line;
+  size_t keys = 0, empty_lists = 0;
+  while (std::getline(script, line)) {
+    std::istringstream fields(line);
+    uint64_t gap_us;
+    std::string action, arg;
+    if (!(fields >> gap_us >> action))
+      continue;
+    fields >> arg;
+    keys++;
+    double t0 = BenchUtil::now_us();
+    if (action == "type" && !arg.empty()) {
+      code += arg[0];
+      pipeline.set_code(code);
+      empty_lists += pipeline.candidate_cnt() == 0;
+    } else if (action == "backspace" && !code.empty()) {
+      code.pop_back();
+      pipeline.set_code(code);
+    } else if (action == "next") {
+      pipeline.next_page();
+    } else if (action == "select" && !code.empty()) {
+      pipeline.select(std::stoul(arg));
+      code.clear();
+      pipeline.set_code(code);
+    } else if (action == "return" || action == "escape") {
+      code.clear();
+      pipeline.set_code(code);
+    } else {
+      continue;
+    }
+    latencies[action].push_back(BenchUtil::now_us() - t0);
+  }
+  std::cout << "{\"keys\": " << keys << ", \"empty_lists\": " << empty_lists << ", \"rss_kb\": " << BenchUtil::rss_kb() << ", \"actions\": {";
+  bool first = true;
+  for (auto &[action, samples] : latencies) {
+    std::cout << (first ? "" : ", ") << "\"" << action << "\": {\"count\": " << samples.size() << ", \"latency\": " << percentiles_json(samples) << "}";
+    first = false;
+  }
+  std::cout << "}}" << std::endl;
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string command = argc > 1 ? argv[1] : "";
+  std::string trace_path, db_path, script_path;
+  unsigned seed = 1;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--trace")
+      trace_path = argv[i + 1];
+    else if (opt == "--db")
+      db_path = argv[i + 1];
+    else if (opt == "--script")
+      script_path = argv[i + 1];
+    else if (opt == "--seed")
+      seed = std::stoul(argv[i + 1]);
+  }
+  std::vector<Record> records;
+  if ((command == "summary" || command == "synth") && !KeystrokeTrace::read(trace_path, records)) {
+    std::cerr << "not a keystroke trace: " << trace_path << std::endl;
+    return 1;
+  }
+  if (command == "summary")
+    return summary(records);
+  if (command == "synth" && !db_path.empty())
+    return synth(records, db_path, seed);
+  if (command == "replay" && !db_path.empty() && !script_path.empty())
+    return replay(script_path, db_path);
+  std::cerr << "Usage: " << argv[0] << " summary --trace keystroke_trace.bin" << std::endl;
+  std::cerr << "       " << argv[0] << " synth --trace keystroke_trace.bin --db path.db [--seed 1]" << std::endl;
+  std::cerr << "       " << argv[0] << " replay --script replay.txt --db path.db" << std::endl;
+  return 1;
+}
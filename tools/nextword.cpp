@@ -0,0 +1,158 @@
+/*
+  fanime-nextword: 从分好词的语料生成预测下一个词的索引 next_word.bin，放到词库旁边，打开 next_word_prediction 之后使用
+
+  - 语料一行一句，词之间用空白隔开(例如 jieba 分词之后的结果)
+  - 不全是汉字的词(标点、英文、数字)把上下文断开，前后的词不算在一起
+  - 每个上下文(前一个词、前两个词)出现不到 --min-count 次的词不要，最多留 --top 个，格式见 src/next_word.h
+
+  Usage: fanime-nextword --corpus corpus.txt --out next_word.bin [--top 8] [--min-count 2]
+*/
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bench_util.h"
+#include "next_word.h"
+
+namespace {
+
+size_t align8(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+void pad_to(std::ofstream &out, size_t &written, size_t offset) {
+  while (written < offset) {
+    out.put('\0');
+    written++;
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string corpus_path;
+  std::string out_path;
+  size_t top = 8;
+  uint32_t min_count = 2;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--corpus")
+      corpus_path = argv[i + 1];
+    else if (opt == "--out")
+      out_path = argv[i + 1];
+    else if (opt == "--top")
+      top = std::max<size_t>(1, std::stoul(argv[i + 1]));
+    else if (opt == "--min-count")
+      min_count = static_cast<uint32_t>(std::stoul(argv[i + 1]));
+  }
+  std::ifstream corpus(corpus_path);
+  if (corpus_path.empty() || out_path.empty() || !corpus.is_open()) {
+    std::cerr << "Usage: " << argv[0] << " --corpus corpus.txt --out next_word.bin [--top 8] [--min-count 2]" << std::endl;
+    return 1;
+  }
+
+  double start = BenchUtil::now_us();
+  std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> counts;
+  std::string line;
+  size_t word_cnt = 0;
+  while (std::getline(corpus, line)) {
+    std::istringstream words(line);
+    std::string word, prev1, prev2;
+    while (words >> word) {
+      if (!NextWordPredictor::is_word(word)) {
+        prev1.clear();
+        prev2.clear();
+        continue;
+      }
+      word_cnt++;
+      if (!prev1.empty()) {
+        counts[NextWordIndex::context_key("", prev1)][word]++;
+        if (!prev2.empty())
+          counts[NextWordIndex::context_key(prev2, prev1)][word]++;
+      }
+      prev2 = std::move(prev1);
+      prev1 = word;
+    }
+  }
+
+  // 按哈希排好序，每个上下文只留 top 个
+  struct Context {
+    uint64_t hash;
+    std::vector<std::pair<std::string, uint32_t>> words;
+  };
+  std::vector<Context> contexts;
+  for (auto &[context, words] : counts) {
+    Context each{NextWordIndex::hash(context), {}};
+    for (auto &[word, count] : words)
+      if (count >= min_count)
+        each.words.emplace_back(word, count);
+    if (each.words.empty())
+      continue;
+    std::sort(each.words.begin(), each.words.end(), [](const auto &a, const auto &b) { return a.second != b.second ? a.second > b.second : a.first < b.first; });
+    if (each.words.size() > top)
+      each.words.resize(top);
+    contexts.push_back(std::move(each));
+  }
+  counts.clear();
+  std::sort(contexts.begin(), contexts.end(), [](const Context &a, const Context &b) { return a.hash < b.hash; });
+  // 64 位的哈希撞了的话只留第一个
+  contexts.erase(std::unique(contexts.begin(), contexts.end(), [](const Context &a, const Context &b) { return a.hash == b.hash; }), contexts.end());
+
+  NextWordIndex::Header header{};
+  memcpy(header.magic, NextWordIndex::MAGIC, sizeof(NextWordIndex::MAGIC));
+  header.version = NextWordIndex::VERSION;
+  header.bucket_bits = NextWordIndex::bucket_bits_for(contexts.size());
+  header.ctx_cnt = contexts.size();
+  size_t bucket_cnt = size_t{1} << header.bucket_bits;
+  std::vector<uint32_t> buckets(bucket_cnt + 1);
+  std::vector<uint32_t> starts;
+  std::vector<NextWordIndex::Pred> preds;
+  std::unordered_map<std::string, uint32_t> pool_offsets;
+  std::string pool;
+  size_t ctx_idx = 0;
+  for (size_t bucket = 0; bucket <= bucket_cnt; bucket++) {
+    while (ctx_idx < contexts.size() && (contexts[ctx_idx].hash >> (64 - header.bucket_bits)) < bucket)
+      ctx_idx++;
+    buckets[bucket] = static_cast<uint32_t>(ctx_idx);
+  }
+  buckets[bucket_cnt] = static_cast<uint32_t>(contexts.size());
+  for (const auto &context : contexts) {
+    starts.push_back(static_cast<uint32_t>(preds.size()));
+    for (const auto &[word, count] : context.words) {
+      auto [it, inserted] = pool_offsets.emplace(word, static_cast<uint32_t>(pool.size()));
+      if (inserted) {
+        pool += word;
+        pool += '\0';
+      }
+      preds.push_back(NextWordIndex::Pred{it->second, count});
+    }
+  }
+  starts.push_back(static_cast<uint32_t>(preds.size()));
+  header.pred_cnt = preds.size();
+  header.pool_size = pool.size();
+
+  std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+  size_t written = 0;
+  auto write = [&out, &written](const void *data, size_t size) {
+    out.write(static_cast<const char *>(data), size);
+    written += size;
+  };
+  write(&header, sizeof(header));
+  write(buckets.data(), buckets.size() * sizeof(uint32_t));
+  pad_to(out, written, align8(written));
+  for (const auto &context : contexts)
+    write(&context.hash, sizeof(context.hash));
+  write(starts.data(), starts.size() * sizeof(uint32_t));
+  pad_to(out, written, align8(written));
+  write(preds.data(), preds.size() * sizeof(NextWordIndex::Pred));
+  write(pool.data(), pool.size());
+  out.close();
+  if (!out) {
+    std::cerr << "failed to write " << out_path << std::endl;
+    return 1;
+  }
+  std::cout << "{\"words\": " << word_cnt << ", \"contexts\": " << contexts.size() << ", \"preds\": " << preds.size() << ", \"size_bytes\": " << BenchUtil::file_size(out_path) << ", \"build_ms\": " << (BenchUtil::now_us() - start) / 1000 << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  fanime-typoindex: 从词库生成打错一个字母的索引 typo_index.bin，放到词库旁边，打开 typo_correction 之后使用
+
+  - 只看不超过 --max-len 个字母、全部是完整双拼的 key
+  - 每个 key 的每个字母换成键盘上相邻的键，以及相邻两个字母交换，得到的错误形式如果本身不是合法的 key 就收录
+  - 同一个错误形式按代价、再按 key 在词库里面最大的 weight 排序，格式见 src/typo_index.h
+  词库改了之后需要重新生成
+
+  Usage: fanime-typoindex --db cutted_flyciku_with_jp.db --out typo_index.bin [--max-len 8]
+*/
+#include <sqlite3.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bench_util.h"
+#include "typo_index.h"
+
+namespace {
+
+struct Entry {
+  uint64_t typo;
+  uint32_t code_idx;
+  uint8_t cost;
+};
+
+/*
+  key -> 最大的 weight
+*/
+std::unordered_map<std::string, int> load_keys(const std::string &db_path, size_t max_len) {
+  std::unordered_map<std::string, int> keys;
+  sqlite3 *db = nullptr;
+  if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+    sqlite3_close(db);
+    return keys;
+  }
+  std::vector<std::string> tables;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'table' and name like 'tbl_%';", -1, &stmt, nullptr);
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    tables.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+  sqlite3_finalize(stmt);
+  for (const auto &table : tables) {
+    sqlite3_prepare_v2(db, ("select key, max(weight) from " + table + " where length(key) <= ? group by key;").c_str(), -1, &stmt, nullptr);
+    sqlite3_bind_int(stmt, 1, static_cast<int>(max_len));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      std::string key(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+      if (key.size() < 2 || key.size() % 2 || !TypoIndex::pack(key))
+        continue;
+      int &weight = keys[key];
+      weight = std::max(weight, sqlite3_column_int(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(db);
+  return keys;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string db_path;
+  std::string out_path;
+  size_t max_len = 8;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--db")
+      db_path = argv[i + 1];
+    else if (opt == "--out")
+      out_path = argv[i + 1];
+    else if (opt == "--max-len")
+      max_len = std::min<size_t>(std::stoul(argv[i + 1]), TypoIndex::MAX_LEN);
+  }
+  if (db_path.empty() || out_path.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --db cutted_flyciku_with_jp.db --out typo_index.bin [--max-len 8]" << std::endl;
+    return 1;
+  }
+
+  double start = BenchUtil::now_us();
+  auto keys = load_keys(db_path, max_len);
+  std::vector<std::pair<uint64_t, int>> codes;
+  for (const auto &[key, weight] : keys)
+    codes.emplace_back(TypoIndex::pack(key), weight);
+  std::sort(codes.begin(), codes.end());
+
+  std::vector<std::vector<std::pair<char, uint8_t>>> neighbors(26);
+  for (char c = 'a'; c <= 'z'; c++)
+    neighbors[c - 'a'] = TypoIndex::neighbors(c);
+  std::vector<Entry> entries;
+  auto add = [&](const std::string &typo, uint32_t code_idx, uint8_t cost) {
+    if (!keys.count(typo))
+      entries.push_back(Entry{TypoIndex::pack(typo), code_idx, cost});
+  };
+  for (uint32_t idx = 0; idx < codes.size(); idx++) {
+    std::string key = TypoIndex::unpack(codes[idx].first);
+    std::string typo = key;
+    for (size_t i = 0; i < key.size(); i++) {
+      for (const auto &[other, cost] : neighbors[key[i] - 'a']) {
+        typo[i] = other;
+        add(typo, idx, cost);
+      }
+      typo[i] = key[i];
+      if (i + 1 < key.size() && key[i] != key[i + 1]) {
+        std::swap(typo[i], typo[i + 1]);
+        add(typo, idx, 1);
+        std::swap(typo[i], typo[i + 1]);
+      }
+    }
+  }
+  // 同一个 key 的同一个错误形式只留代价最小的，再按代价、weight 排好
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return std::tie(a.typo, a.code_idx, a.cost) < std::tie(b.typo, b.code_idx, b.cost); });
+  entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.typo == b.typo && a.code_idx == b.code_idx; }), entries.end());
+  std::sort(entries.begin(), entries.end(), [&codes](const Entry &a, const Entry &b) {
+    if (a.typo != b.typo)
+      return a.typo < b.typo;
+    if (a.cost != b.cost)
+      return a.cost < b.cost;
+    return codes[a.code_idx].second > codes[b.code_idx].second;
+  });
+
+  std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+  TypoIndex::Header header{};
+  memcpy(header.magic, TypoIndex::MAGIC, sizeof(TypoIndex::MAGIC));
+  header.version = TypoIndex::VERSION;
+  header.max_len = static_cast<uint32_t>(max_len);
+  header.entry_cnt = entries.size();
+  header.code_cnt = codes.size();
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const auto &entry : entries)
+    out.write(reinterpret_cast<const char *>(&entry.typo), sizeof(entry.typo));
+  for (const auto &entry : entries) {
+    uint32_t target = entry.code_idx << 2 | entry.cost;
+    out.write(reinterpret_cast<const char *>(&target), sizeof(target));
+  }
+  if (entries.size() % 2)
+    out.write("\0\0\0\0", 4);
+  for (const auto &[packed, weight] : codes)
+    out.write(reinterpret_cast<const char *>(&packed), sizeof(packed));
+  out.close();
+  if (!out) {
+    std::cerr << "failed to write " << out_path << std::endl;
+    return 1;
+  }
+  std::cout << "{\"keys\": " << codes.size() << ", \"entries\": " << entries.size() << ", \"size_bytes\": " << BenchUtil::file_size(out_path) << ", \"build_ms\": " << (BenchUtil::now_us() - start) / 1000 << "}" << std::endl;
+  return 0;
+}